@@ -19,7 +19,7 @@ exit 1
 esac
 
 echo "Building temporary ${YAM_B} binary..."
-${CC} -g -std=gnu99 -I./contrib ${CFLAGS} ${LDFLAGS} ./yam/*.c -o ${YAM_B} || exit 1
+${CC} -g -std=gnu99 -I./contrib ${CFLAGS} ${LDFLAGS} -lpthread ./yam/*.c -o ${YAM_B} || exit 1
 echo "Boostraping..."
 ./${YAM_B}
 rm ${YAM_B}
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2011, Julien P. Laffaye <jlaffaye@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef LINUX
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "yam.h"
+
+/*
+ * The commands yam runs itself, without a shell, for the jobs moving files
+ * around. Such a command is BUILTIN_PREFIX, the name of the builtin and its
+ * paths, relative to the subdir, separated by spaces.
+ */
+
+/* What a builtin runs with */
+struct run {
+	const char *cwd;
+	UT_string *out;
+	void (*cb)(void *, unsigned char, const char *);
+	void *arg;
+};
+
+struct builtin {
+	const char *name;
+	int min;
+	/* -1 means no limit */
+	int max;
+	int (*fn)(struct run *r, char **argv, int argc);
+};
+
+/*
+ * Write in `buf' the path `path' of the subdir `cwd', relative to the root,
+ * without the `.' and `..' components.
+ */
+void
+resolve_path(const char *cwd, const char *path, char *buf, size_t len)
+{
+	char tmp[PATH_MAX];
+	char *p, *next;
+	size_t n = 0;
+	/* Number of leading `..' */
+	size_t up = 0;
+
+	if (path[0] == '/' || strcmp(cwd, ".") == 0)
+		snprintf(tmp, sizeof(tmp), "%s", path);
+	else
+		snprintf(tmp, sizeof(tmp), "%s/%s", cwd, path);
+
+	if (tmp[0] == '/') {
+		snprintf(buf, len, "%s", tmp);
+		return;
+	}
+
+	buf[0] = '\0';
+	for (p = tmp; p != NULL; p = next) {
+		if ((next = strchr(p, '/')) != NULL)
+			*next++ = '\0';
+		if (p[0] == '\0' || strcmp(p, ".") == 0)
+			continue;
+		if (strcmp(p, "..") == 0) {
+			/* drop the last component, unless it is a `..' too */
+			if (n > (up > 0 ? up * 3 - 1 : 0)) {
+				while (n > 0 && buf[n - 1] != '/')
+					n--;
+				if (n > 0)
+					n--;
+				buf[n] = '\0';
+				continue;
+			}
+			up++;
+		}
+		n += snprintf(buf + n, len - n, "%s%s", n > 0 ? "/" : "", p);
+		if (n >= len)
+			n = len - 1;
+	}
+	if (n == 0)
+		snprintf(buf, len, ".");
+}
+
+static int
+fail(struct run *r, const char *what, const char *path)
+{
+	utstring_printf(r->out, "%s: %s: %s\n", what, path, strerror(errno));
+
+	return 1;
+}
+
+static void
+report(struct run *r, unsigned char mode, const char *path)
+{
+	if (r->cb != NULL)
+		r->cb(r->arg, mode, path);
+}
+
+/*
+ * Remove `path' if it exists, so that a link to another file is not written
+ * through.
+ */
+static int
+remove_file(struct run *r, const char *path)
+{
+	if (unlink(path) != 0 && errno != ENOENT)
+		return fail(r, "unlink", path);
+
+	return 0;
+}
+
+/*
+ * Copy the content of `in' to `fd', sharing the blocks of the file when the
+ * file system can.
+ */
+static int
+copy_data(int in, int fd)
+{
+	char buf[65536];
+	ssize_t sz, wsz;
+	char *p;
+
+#ifdef LINUX
+	if (ioctl(fd, FICLONE, in) == 0)
+		return 0;
+	while ((sz = copy_file_range(in, NULL, fd, NULL, SSIZE_MAX, 0)) > 0)
+		;
+	if (sz == 0)
+		return 0;
+	if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+		errno != EOPNOTSUPP)
+		return -1;
+#endif
+
+	while ((sz = read(in, buf, sizeof(buf))) > 0) {
+		for (p = buf; sz > 0; p += wsz, sz -= wsz) {
+			if ((wsz = write(fd, p, sz)) < 0)
+				return -1;
+		}
+	}
+
+	return sz < 0 ? -1 : 0;
+}
+
+static int
+b_copy(struct run *r, char **argv, int argc)
+{
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	struct stat st;
+	int in, fd;
+	int ret = 0;
+
+	(void)argc;
+	resolve_path(r->cwd, argv[0], src, sizeof(src));
+	resolve_path(r->cwd, argv[1], dst, sizeof(dst));
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return fail(r, "open", src);
+	report(r, 'r', src);
+	if (fstat(in, &st) != 0) {
+		ret = fail(r, "fstat", src);
+		goto out;
+	}
+	if ((ret = remove_file(r, dst)) != 0)
+		goto out;
+	if ((fd = open(dst, O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & 07777)) < 0) {
+		ret = fail(r, "open", dst);
+		goto out;
+	}
+	report(r, 'w', dst);
+	if (copy_data(in, fd) != 0)
+		ret = fail(r, "copy", dst);
+	else if (fchmod(fd, st.st_mode & 07777) != 0)
+		ret = fail(r, "fchmod", dst);
+	close(fd);
+out:
+	close(in);
+
+	return ret;
+}
+
+static int
+b_link(struct run *r, char **argv, int argc)
+{
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+
+	(void)argc;
+	resolve_path(r->cwd, argv[0], src, sizeof(src));
+	resolve_path(r->cwd, argv[1], dst, sizeof(dst));
+
+	if (remove_file(r, dst) != 0)
+		return 1;
+	if (link(src, dst) != 0)
+		return fail(r, "link", dst);
+	report(r, 'r', src);
+	report(r, 'w', dst);
+
+	return 0;
+}
+
+static int
+b_mkdir(struct run *r, char **argv, int argc)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	char *p;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		resolve_path(r->cwd, argv[i], path, sizeof(path));
+		for (p = strchr(path + 1, '/'); ; p = strchr(p + 1, '/')) {
+			if (p != NULL)
+				*p = '\0';
+			if (mkdir(path, 0777) != 0 && (errno != EEXIST ||
+				stat(path, &st) != 0 || !S_ISDIR(st.st_mode)))
+				return fail(r, "mkdir", path);
+			if (p == NULL)
+				break;
+			*p = '/';
+		}
+	}
+
+	return 0;
+}
+
+static int
+b_touch(struct run *r, char **argv, int argc)
+{
+	char path[PATH_MAX];
+	int fd;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		resolve_path(r->cwd, argv[i], path, sizeof(path));
+		if ((fd = open(path, O_WRONLY|O_CREAT, 0666)) < 0)
+			return fail(r, "open", path);
+		close(fd);
+		if (utimes(path, NULL) != 0)
+			return fail(r, "utimes", path);
+		report(r, 'w', path);
+	}
+
+	return 0;
+}
+
+static int
+b_rm(struct run *r, char **argv, int argc)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		resolve_path(r->cwd, argv[i], path, sizeof(path));
+		if (remove_file(r, path) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static const struct builtin builtins[] = {
+	{ "copy", 2, 2, b_copy },
+	{ "link", 2, 2, b_link },
+	{ "mkdir", 1, -1, b_mkdir },
+	{ "touch", 1, -1, b_touch },
+	{ "stamp", 1, -1, b_touch },
+	{ "rm", 1, -1, b_rm },
+};
+
+static const struct builtin *
+find_builtin(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+		if (strcmp(builtins[i].name, name) == 0)
+			return &builtins[i];
+
+	return NULL;
+}
+
+/*
+ * Whether `cmd' is run by yam itself.
+ */
+bool
+builtin_cmd(const char *cmd)
+{
+	return strncmp(cmd, BUILTIN_PREFIX, sizeof(BUILTIN_PREFIX) - 1) == 0;
+}
+
+/*
+ * Return why the builtin `name' cannot take `nargs' paths, NULL if it can.
+ */
+const char *
+builtin_check(const char *name, int nargs)
+{
+	const struct builtin *b;
+
+	if ((b = find_builtin(name)) == NULL)
+		return "no such builtin";
+	if (nargs < b->min || (b->max != -1 && nargs > b->max))
+		return "incorrect number of paths";
+
+	return NULL;
+}
+
+/*
+ * Run the builtin command `cmd' from the subdir `cwd', its errors going to
+ * `out'. Unless `cb' is NULL, it is called with `arg', 'r' or 'w' and the
+ * path relative to the root of each file read or written. Return the exit
+ * status.
+ */
+int
+builtin_run(const char *cmd, const char *cwd, UT_string *out,
+			void (*cb)(void *, unsigned char, const char *), void *arg)
+{
+	const struct builtin *b;
+	struct run r;
+	char *argv[64];
+	char *str, *p, *tok;
+	int argc = 0;
+	int ret;
+
+	if ((str = strdup(cmd + sizeof(BUILTIN_PREFIX) - 1)) == NULL)
+		die("strdup()");
+	for (p = str; (tok = strsep(&p, " \t")) != NULL; ) {
+		if (tok[0] == '\0')
+			continue;
+		if (argc == sizeof(argv) / sizeof(argv[0])) {
+			utstring_printf(out, "%s: too many paths\n", argv[0]);
+			free(str);
+			return 1;
+		}
+		argv[argc++] = tok;
+	}
+
+	if (argc == 0 || (b = find_builtin(argv[0])) == NULL) {
+		utstring_printf(out, "%s: no such builtin\n", argc > 0 ? argv[0] :
+						"");
+		free(str);
+		return 1;
+	}
+	if (argc - 1 < b->min || (b->max != -1 && argc - 1 > b->max)) {
+		utstring_printf(out, "%s: incorrect number of paths\n", argv[0]);
+		free(str);
+		return 1;
+	}
+
+	r.cwd = cwd;
+	r.out = out;
+	r.cb = cb;
+	r.arg = arg;
+	ret = b->fn(&r, argv + 1, argc - 1);
+	free(str);
+
+	return ret;
+}
@@ -0,0 +1,1168 @@
+/*
+ * Copyright (c) 2011, Julien P. Laffaye <jlaffaye@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "yam.h"
+
+#define CACHE_FILETEMP ".yam.cache.temp"
+#define CACHE_FILE ".yam.cache"
+
+/*
+ * The fragment produced by the Yamfile of a subdir is cached in the subdir,
+ * so the Yamfile is only evaluated again when one of its inputs changed.
+ *
+ * Layout of the cache, all the integers are in host byte order and strings
+ * are a uint32_t length followed by the bytes:
+ *
+ *   magic, uint32_t version
+ *   uint32_t ninputs, then for each: uint8_t env, name, and either
+ *            uint8_t set and the value for an environment variable, or the
+ *            struct stamp of the file
+ *   uint32_t nrules, then the command templates
+ *   uint32_t ntargets, then for each: name, uint32_t rule, then either cmd
+ *            without a rule or the source, uint32_t ndeps and the deps,
+ *            uint32_t noutputs and the other outputs, uint32_t norder and
+ *            the order-only deps, the dyndep file, the depfile and the
+ *            pool or an empty string, uint32_t batch, the worker or an
+ *            empty string, uint32_t trace, and the response file or an
+ *            empty string followed by its content. An alias has an empty
+ *            command.
+ *   uint32_t nsubdirs, then the subdirs
+ *   uint32_t npools, then for each: name, uint32_t depth
+ *
+ * A fragment which ran commands with io.popen() or os.execute() is not
+ * cached, as what they read is not known: yam.shell() is the way to run
+ * them only when needed. `yam -r' evaluates all the Yamfiles again.
+ */
+#define CACHE_MAGIC "YAMCACHE"
+#define CACHE_VERSION 11
+
+#define SHELL_FILETEMP ".yam.shell.temp"
+#define SHELL_FILE ".yam.shell"
+
+/*
+ * The output of the commands run by yam.shell() is cached in the root, for
+ * all the subdirs, as long as the files the command read and the
+ * environment variables it was given have not changed:
+ *
+ *   magic, uint32_t version
+ *   uint32_t nshells, then for each: the subdir, the command and the
+ *            environment variables separated by a NUL as the key, the
+ *            output, uint32_t status, and the inputs as above
+ *
+ * The files are known thanks to the wrapper, without it the output is
+ * only reused during the build.
+ */
+#define SHELL_MAGIC "YAMSHELL"
+#define SHELL_VERSION 1
+
+struct shell {
+	char *key;
+	size_t keylen;
+	char *output;
+	size_t outlen;
+	uint32_t status;
+	/* Whether the files it read are known */
+	bool traced;
+	/* Only the inputs are used */
+	struct fragment f;
+	UT_hash_handle hh;
+};
+
+/*
+ * The stamps and the listings of the directories are cached while the
+ * Yamfiles are evaluated, for all the threads, so nothing is read twice.
+ */
+struct statent {
+	char *path;
+	struct stamp stamp;
+	/* Sorted names of the entries, once the directory is listed */
+	bool listed;
+	char **names;
+	size_t nnames;
+	UT_hash_handle hh;
+};
+
+static struct statent *_stats = NULL;
+static pthread_mutex_t _stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct shell *_shells = NULL;
+static bool _shells_dirty = false;
+static pthread_mutex_t _shells_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cursor over the cache being read */
+struct reader {
+	const char *p;
+	const char *end;
+	int error;
+};
+
+static void *
+grow(void *array, size_t *cap, size_t len, size_t size)
+{
+	if (len < *cap)
+		return array;
+
+	*cap = *cap == 0 ? 16 : *cap * 2;
+	if ((array = realloc(array, *cap * size)) == NULL)
+		die("realloc()");
+
+	return array;
+}
+
+static struct statent *
+stat_find(const char *path)
+{
+	struct statent *se;
+
+	HASH_FIND_STR(_stats, path, se);
+	if (se != NULL)
+		return se;
+
+	if ((se = calloc(1, sizeof(struct statent))) == NULL)
+		die("calloc()");
+	se->path = strdup(path);
+	file_stamp(path, &se->stamp);
+	HASH_ADD_KEYPTR(hh, _stats, se->path, strlen(se->path), se);
+
+	return se;
+}
+
+/*
+ * file_stamp(), once per path while the Yamfiles are evaluated.
+ */
+void
+stat_cached(const char *path, struct stamp *stamp)
+{
+	pthread_mutex_lock(&_stats_mtx);
+	*stamp = stat_find(path)->stamp;
+	pthread_mutex_unlock(&_stats_mtx);
+}
+
+/*
+ * Return whether the stamp of `path' is already known, without stat(2).
+ */
+bool
+stat_lookup(const char *path, struct stamp *stamp)
+{
+	struct statent *se;
+
+	pthread_mutex_lock(&_stats_mtx);
+	HASH_FIND_STR(_stats, path, se);
+	if (se != NULL)
+		*stamp = se->stamp;
+	pthread_mutex_unlock(&_stats_mtx);
+
+	return se != NULL;
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Return the sorted names in the directory `path', and store its stamp in
+ * `stamp'. They are valid until stat_clear(). Return NULL if it can not be
+ * listed.
+ */
+char **
+stat_list(const char *path, size_t *n, struct stamp *stamp)
+{
+	struct statent *se;
+	struct dirent *de;
+	char **names = NULL;
+	size_t nnames = 0;
+	size_t cap = 0;
+	DIR *dir;
+
+	pthread_mutex_lock(&_stats_mtx);
+	se = stat_find(path);
+	*stamp = se->stamp;
+	if (se->listed) {
+		*n = se->nnames;
+		names = se->names;
+		pthread_mutex_unlock(&_stats_mtx);
+		return names;
+	}
+	pthread_mutex_unlock(&_stats_mtx);
+
+	if ((dir = opendir(path)) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			names = grow(names, &cap, nnames, sizeof(char *));
+			names[nnames++] = strdup(de->d_name);
+		}
+		closedir(dir);
+		qsort(names, nnames, sizeof(char *), name_cmp);
+	} else if (errno != ENOENT && errno != ENOTDIR)
+		perrorf("opendir(%s)", path);
+
+	/* Another thread may have listed it in the meantime */
+	pthread_mutex_lock(&_stats_mtx);
+	if (se->listed) {
+		while (nnames > 0)
+			free(names[--nnames]);
+		free(names);
+	} else {
+		se->listed = true;
+		se->names = names;
+		se->nnames = nnames;
+	}
+	*n = se->nnames;
+	names = se->names;
+	pthread_mutex_unlock(&_stats_mtx);
+
+	return names;
+}
+
+void
+stat_clear(void)
+{
+	struct statent *se, *tmp;
+	size_t i;
+
+	HASH_ITER(hh, _stats, se, tmp) {
+		HASH_DEL(_stats, se);
+		for (i = 0; i < se->nnames; i++)
+			free(se->names[i]);
+		free(se->names);
+		free(se->path);
+		free(se);
+	}
+}
+
+void
+fragment_init(struct fragment *f)
+{
+	memset(f, 0, sizeof(struct fragment));
+}
+
+void
+fragment_free(struct fragment *f)
+{
+	size_t i, j;
+
+	for (i = 0; i < f->ntargets; i++) {
+		free(f->targets[i].name);
+		free(f->targets[i].cmd);
+		free(f->targets[i].in);
+		for (j = 0; j < f->targets[i].ndeps; j++)
+			free(f->targets[i].deps[j]);
+		free(f->targets[i].deps);
+		for (j = 0; j < f->targets[i].noutputs; j++)
+			free(f->targets[i].outputs[j]);
+		free(f->targets[i].outputs);
+		for (j = 0; j < f->targets[i].norder; j++)
+			free(f->targets[i].order[j]);
+		free(f->targets[i].order);
+		free(f->targets[i].dyndep);
+		free(f->targets[i].depfile);
+		free(f->targets[i].pool);
+		free(f->targets[i].worker);
+		free(f->targets[i].rspfile);
+		free(f->targets[i].rspcontent);
+	}
+	free(f->targets);
+
+	for (i = 0; i < f->nrules; i++)
+		free(f->rules[i]);
+	free(f->rules);
+
+	for (i = 0; i < f->nsubdirs; i++)
+		free(f->subdirs[i]);
+	free(f->subdirs);
+
+	for (i = 0; i < f->ninputs; i++) {
+		free(f->inputs[i].name);
+		free(f->inputs[i].value);
+	}
+	free(f->inputs);
+
+	for (i = 0; i < f->npools; i++)
+		free(f->pools[i].name);
+	free(f->pools);
+
+	fragment_init(f);
+}
+
+struct ftarget *
+fragment_target(struct fragment *f, const char *name, const char *cmd)
+{
+	struct ftarget *t;
+
+	f->targets = grow(f->targets, &f->captargets, f->ntargets,
+					  sizeof(struct ftarget));
+	t = &f->targets[f->ntargets++];
+	memset(t, 0, sizeof(struct ftarget));
+	t->name = strdup(name);
+	t->cmd = strdup(cmd);
+	t->rule = FRAGMENT_NORULE;
+
+	return t;
+}
+
+/*
+ * Add a phony target, built once what it depends on is built.
+ */
+struct ftarget *
+fragment_alias(struct fragment *f, const char *name)
+{
+	struct ftarget *t;
+
+	t = fragment_target(f, name, "");
+	t->rule = FRAGMENT_ALIAS;
+
+	return t;
+}
+
+/*
+ * Add a target built by the rule `rule' from the source `in', its command
+ * is only expanded when merged in the graph.
+ */
+struct ftarget *
+fragment_rule_target(struct fragment *f, const char *name, uint32_t rule,
+					 const char *in)
+{
+	struct ftarget *t;
+
+	f->targets = grow(f->targets, &f->captargets, f->ntargets,
+					  sizeof(struct ftarget));
+	t = &f->targets[f->ntargets++];
+	memset(t, 0, sizeof(struct ftarget));
+	t->name = strdup(name);
+	t->rule = rule;
+	t->in = strdup(in);
+
+	return t;
+}
+
+uint32_t
+fragment_rule(struct fragment *f, const char *cmd)
+{
+	f->rules = grow(f->rules, &f->caprules, f->nrules, sizeof(char *));
+	f->rules[f->nrules] = strdup(cmd);
+
+	return f->nrules++;
+}
+
+/*
+ * Whether `var' is at `p', and not the start of a longer name.
+ */
+static bool
+is_var(const char *p, const char *var, size_t len)
+{
+	return strncmp(p, var, len) == 0 &&
+		!(isalnum((unsigned char)p[len]) || p[len] == '_');
+}
+
+/*
+ * Return the command of `t', declared in the subdir `dir'. In a template,
+ * `$in' is the source, `$out' the target relative to the subdir, and `$$'
+ * a dollar.
+ */
+char *
+fragment_cmd(const struct fragment *f, const struct ftarget *t,
+			 const char *dir)
+{
+	UT_string *cmd;
+	const char *p;
+	const char *out = t->name;
+	size_t len = strlen(dir);
+	size_t up = 0;
+	size_t i;
+	char *str;
+
+	if (t->rule == FRAGMENT_NORULE || t->rule == FRAGMENT_ALIAS)
+		return strdup(t->cmd);
+
+	/*
+	 * The targets are below the subdir, or below the output directory of
+	 * its variant, relative to the root.
+	 */
+	if (strcmp(dir, ".") != 0 && strncmp(out, dir, len) == 0 &&
+		out[len] == '/')
+		out += len + 1;
+	else if (strcmp(dir, ".") != 0) {
+		for (p = dir; p != NULL; p = strchr(p + 1, '/'))
+			up++;
+	}
+
+	utstring_new(cmd);
+	for (p = f->rules[t->rule]; *p != '\0'; p++) {
+		if (p[0] != '$') {
+			utstring_bincpy(cmd, p, 1);
+		} else if (p[1] == '$') {
+			utstring_bincpy(cmd, "$", 1);
+			p++;
+		} else if (is_var(p + 1, "in", 2)) {
+			utstring_bincpy(cmd, t->in, strlen(t->in));
+			p += 2;
+		} else if (is_var(p + 1, "out", 3)) {
+			for (i = 0; i < up; i++)
+				utstring_bincpy(cmd, "../", 3);
+			utstring_bincpy(cmd, out, strlen(out));
+			p += 3;
+		} else
+			utstring_bincpy(cmd, p, 1);
+	}
+
+	str = strdup(utstring_body(cmd));
+	utstring_free(cmd);
+
+	return str;
+}
+
+void
+fragment_dep(struct ftarget *t, const char *path)
+{
+	t->deps = grow(t->deps, &t->cap, t->ndeps, sizeof(char *));
+	t->deps[t->ndeps++] = strdup(path);
+}
+
+/*
+ * Add an output to the job `t', built along with `t->name'.
+ */
+void
+fragment_output(struct ftarget *t, const char *path)
+{
+	t->outputs = grow(t->outputs, &t->capoutputs, t->noutputs,
+					  sizeof(char *));
+	t->outputs[t->noutputs++] = strdup(path);
+}
+
+void
+fragment_order(struct ftarget *t, const char *path)
+{
+	t->order = grow(t->order, &t->caporder, t->norder, sizeof(char *));
+	t->order[t->norder++] = strdup(path);
+}
+
+void
+fragment_subdir(struct fragment *f, const char *path)
+{
+	f->subdirs = grow(f->subdirs, &f->capsubdirs, f->nsubdirs,
+					  sizeof(char *));
+	f->subdirs[f->nsubdirs++] = strdup(path);
+}
+
+static struct finput *
+fragment_add_input(struct fragment *f, const char *name, bool env)
+{
+	struct finput *in;
+	size_t i;
+
+	for (i = 0; i < f->ninputs; i++)
+		if (f->inputs[i].env == env && strcmp(f->inputs[i].name, name) == 0)
+			return NULL;
+
+	f->inputs = grow(f->inputs, &f->capinputs, f->ninputs,
+					 sizeof(struct finput));
+	in = &f->inputs[f->ninputs++];
+	memset(in, 0, sizeof(struct finput));
+	in->name = strdup(name);
+	in->env = env;
+
+	return in;
+}
+
+/*
+ * Record that the Yamfile read `path', relative to the root. The stamp is
+ * taken now, a missing file is recorded as such.
+ */
+void
+fragment_input(struct fragment *f, const char *path)
+{
+	struct finput *in;
+
+	if ((in = fragment_add_input(f, path, false)) != NULL)
+		stat_cached(path, &in->stamp);
+}
+
+/*
+ * Same as fragment_input(), with the stamp already known.
+ */
+void
+fragment_stamp(struct fragment *f, const char *path, const struct stamp *stamp)
+{
+	struct finput *in;
+
+	if ((in = fragment_add_input(f, path, false)) != NULL)
+		in->stamp = *stamp;
+}
+
+void
+fragment_env(struct fragment *f, const char *name, const char *value)
+{
+	struct finput *in;
+
+	if ((in = fragment_add_input(f, name, true)) != NULL && value != NULL)
+		in->value = strdup(value);
+}
+
+void
+fragment_pool(struct fragment *f, const char *name, uint32_t depth)
+{
+	f->pools = grow(f->pools, &f->cappools, f->npools,
+					sizeof(struct fpool));
+	f->pools[f->npools].name = strdup(name);
+	f->pools[f->npools].depth = depth;
+	f->npools++;
+}
+
+static void
+write_u32(FILE *fp, uint32_t v)
+{
+	fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void
+write_data(FILE *fp, const char *data, size_t len)
+{
+	write_u32(fp, len);
+	fwrite(data, 1, len, fp);
+}
+
+static void
+write_str(FILE *fp, const char *str)
+{
+	write_data(fp, str, strlen(str));
+}
+
+static void
+write_inputs(FILE *fp, const struct fragment *f)
+{
+	const struct finput *in;
+	uint8_t byte;
+	size_t i;
+
+	write_u32(fp, f->ninputs);
+	for (i = 0; i < f->ninputs; i++) {
+		in = &f->inputs[i];
+		byte = in->env;
+		fwrite(&byte, 1, 1, fp);
+		write_str(fp, in->name);
+		if (in->env) {
+			byte = in->value != NULL;
+			fwrite(&byte, 1, 1, fp);
+			if (in->value != NULL)
+				write_str(fp, in->value);
+		} else {
+			fwrite(&in->stamp, sizeof(in->stamp), 1, fp);
+		}
+	}
+}
+
+int
+cache_save(const char *dir, const struct fragment *f)
+{
+	char from[MAXPATHLEN];
+	char to[MAXPATHLEN];
+	uint32_t version = CACHE_VERSION;
+	FILE *fp;
+	size_t i, j;
+
+	snprintf(from, sizeof(from), "%s/%s", dir, CACHE_FILETEMP);
+	snprintf(to, sizeof(to), "%s/%s", dir, CACHE_FILE);
+
+	if (f->uncached) {
+		if (unlink(to) != 0 && errno != ENOENT) {
+			perrorf("unlink(%s)", to);
+			return -1;
+		}
+		return 0;
+	}
+
+	if ((fp = fopen(from, "w")) == NULL) {
+		perrorf("fopen(%s)", from);
+		return -1;
+	}
+
+	fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC) - 1, fp);
+	fwrite(&version, sizeof(version), 1, fp);
+
+	write_inputs(fp, f);
+
+	write_u32(fp, f->nrules);
+	for (i = 0; i < f->nrules; i++)
+		write_str(fp, f->rules[i]);
+
+	write_u32(fp, f->ntargets);
+	for (i = 0; i < f->ntargets; i++) {
+		write_str(fp, f->targets[i].name);
+		write_u32(fp, f->targets[i].rule);
+		if (f->targets[i].rule == FRAGMENT_NORULE ||
+			f->targets[i].rule == FRAGMENT_ALIAS)
+			write_str(fp, f->targets[i].cmd);
+		else
+			write_str(fp, f->targets[i].in);
+		write_u32(fp, f->targets[i].ndeps);
+		for (j = 0; j < f->targets[i].ndeps; j++)
+			write_str(fp, f->targets[i].deps[j]);
+		write_u32(fp, f->targets[i].noutputs);
+		for (j = 0; j < f->targets[i].noutputs; j++)
+			write_str(fp, f->targets[i].outputs[j]);
+		write_u32(fp, f->targets[i].norder);
+		for (j = 0; j < f->targets[i].norder; j++)
+			write_str(fp, f->targets[i].order[j]);
+		write_str(fp, f->targets[i].dyndep != NULL ?
+				  f->targets[i].dyndep : "");
+		write_str(fp, f->targets[i].depfile != NULL ?
+				  f->targets[i].depfile : "");
+		write_str(fp, f->targets[i].pool != NULL ?
+				  f->targets[i].pool : "");
+		write_u32(fp, f->targets[i].batch);
+		write_str(fp, f->targets[i].worker != NULL ?
+				  f->targets[i].worker : "");
+		write_u32(fp, f->targets[i].trace);
+		write_str(fp, f->targets[i].rspfile != NULL ?
+				  f->targets[i].rspfile : "");
+		write_str(fp, f->targets[i].rspcontent != NULL ?
+				  f->targets[i].rspcontent : "");
+	}
+
+	write_u32(fp, f->nsubdirs);
+	for (i = 0; i < f->nsubdirs; i++)
+		write_str(fp, f->subdirs[i]);
+
+	write_u32(fp, f->npools);
+	for (i = 0; i < f->npools; i++) {
+		write_str(fp, f->pools[i].name);
+		write_u32(fp, f->pools[i].depth);
+	}
+
+	if (ferror(fp) != 0 || fclose(fp) != 0) {
+		perrorf("fwrite(%s)", from);
+		unlink(from);
+		return -1;
+	}
+
+	if (rename(from, to) != 0) {
+		perrorf("rename(%s, %s)", from, to);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+read_bytes(struct reader *r, void *data, size_t len)
+{
+	if (r->error != 0 || (size_t)(r->end - r->p) < len) {
+		r->error = 1;
+		memset(data, 0, len);
+		return;
+	}
+
+	memcpy(data, r->p, len);
+	r->p += len;
+}
+
+static uint32_t
+read_u32(struct reader *r)
+{
+	uint32_t v;
+
+	read_bytes(r, &v, sizeof(v));
+	return v;
+}
+
+/*
+ * Return a NUL terminated copy of the next string, and its length in `lenp'
+ * as it may contain NUL bytes. Return NULL on error.
+ */
+static char *
+read_data(struct reader *r, size_t *lenp)
+{
+	uint32_t len;
+	char *str;
+
+	len = read_u32(r);
+	if (r->error != 0 || (size_t)(r->end - r->p) < len) {
+		r->error = 1;
+		return NULL;
+	}
+
+	if ((str = malloc(len + 1)) == NULL)
+		die("malloc()");
+	memcpy(str, r->p, len);
+	str[len] = '\0';
+	r->p += len;
+	*lenp = len;
+
+	return str;
+}
+
+/* Return a NUL terminated copy of the next string, NULL on error */
+static char *
+read_str(struct reader *r)
+{
+	size_t len;
+
+	return read_data(r, &len);
+}
+
+/*
+ * Whether the inputs of the fragment are as they were when the Yamfile was
+ * evaluated.
+ */
+static bool
+inputs_unchanged(const struct fragment *f)
+{
+	const struct finput *in;
+	struct stamp stamp;
+	const char *value;
+	size_t i;
+
+	for (i = 0; i < f->ninputs; i++) {
+		in = &f->inputs[i];
+		if (in->env) {
+			value = getenv(in->name);
+			if ((value == NULL) != (in->value == NULL) ||
+				(value != NULL && strcmp(value, in->value) != 0))
+				return false;
+		} else {
+			stamp.mtime = 0;
+			stamp.size = 0;
+			stat_cached(in->name, &stamp);
+			if (stamp.mtime == 0 || stamp.mtime != in->stamp.mtime ||
+				stamp.size != in->stamp.size)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+read_inputs(struct reader *r, struct fragment *f)
+{
+	struct finput *in;
+	char *name;
+	uint32_t n, i;
+	uint8_t byte;
+
+	n = read_u32(r);
+	for (i = 0; i < n && r->error == 0; i++) {
+		read_bytes(r, &byte, 1);
+		if ((name = read_str(r)) == NULL)
+			break;
+		f->inputs = grow(f->inputs, &f->capinputs, f->ninputs,
+						 sizeof(struct finput));
+		in = &f->inputs[f->ninputs++];
+		memset(in, 0, sizeof(struct finput));
+		in->name = name;
+		in->env = byte != 0;
+		if (in->env) {
+			read_bytes(r, &byte, 1);
+			if (byte != 0)
+				in->value = read_str(r);
+		} else {
+			read_bytes(r, &in->stamp, sizeof(in->stamp));
+		}
+	}
+}
+
+static int
+cache_parse(struct reader *r, struct fragment *f)
+{
+	struct ftarget *t;
+	char magic[sizeof(CACHE_MAGIC) - 1];
+	char *name, *cmd, *str;
+	uint32_t n, ndeps, noutputs, norder, rule;
+	uint32_t i, j;
+
+	read_bytes(r, magic, sizeof(magic));
+	if (r->error != 0 || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+		read_u32(r) != CACHE_VERSION)
+		return -1;
+
+	read_inputs(r, f);
+
+	/* Do not bother reading the rest if the Yamfile must be evaluated */
+	if (r->error != 0 || !inputs_unchanged(f))
+		return -1;
+
+	n = read_u32(r);
+	for (i = 0; i < n && r->error == 0; i++) {
+		if ((str = read_str(r)) == NULL)
+			break;
+		fragment_rule(f, str);
+		free(str);
+	}
+
+	n = read_u32(r);
+	for (i = 0; i < n && r->error == 0; i++) {
+		name = read_str(r);
+		rule = read_u32(r);
+		/* The command, or the source */
+		cmd = read_str(r);
+		if (rule != FRAGMENT_NORULE && rule != FRAGMENT_ALIAS &&
+			rule >= f->nrules)
+			r->error = 1;
+		if (name != NULL && cmd != NULL && r->error == 0) {
+			if (rule == FRAGMENT_NORULE)
+				t = fragment_target(f, name, cmd);
+			else if (rule == FRAGMENT_ALIAS)
+				t = fragment_alias(f, name);
+			else
+				t = fragment_rule_target(f, name, rule, cmd);
+			ndeps = read_u32(r);
+			for (j = 0; j < ndeps && r->error == 0; j++) {
+				if ((str = read_str(r)) == NULL)
+					break;
+				fragment_dep(t, str);
+				free(str);
+			}
+			noutputs = read_u32(r);
+			for (j = 0; j < noutputs && r->error == 0; j++) {
+				if ((str = read_str(r)) == NULL)
+					break;
+				fragment_output(t, str);
+				free(str);
+			}
+			norder = read_u32(r);
+			for (j = 0; j < norder && r->error == 0; j++) {
+				if ((str = read_str(r)) == NULL)
+					break;
+				fragment_order(t, str);
+				free(str);
+			}
+			if ((str = read_str(r)) != NULL && str[0] != '\0')
+				t->dyndep = str;
+			else
+				free(str);
+			if ((str = read_str(r)) != NULL && str[0] != '\0')
+				t->depfile = str;
+			else
+				free(str);
+			if ((str = read_str(r)) != NULL && str[0] != '\0')
+				t->pool = str;
+			else
+				free(str);
+			t->batch = read_u32(r) != 0;
+			if ((str = read_str(r)) != NULL && str[0] != '\0')
+				t->worker = str;
+			else
+				free(str);
+			t->trace = read_u32(r);
+			if ((str = read_str(r)) != NULL && str[0] != '\0')
+				t->rspfile = str;
+			else
+				free(str);
+			t->rspcontent = read_str(r);
+			if (t->rspfile == NULL) {
+				free(t->rspcontent);
+				t->rspcontent = NULL;
+			}
+		}
+		free(name);
+		free(cmd);
+	}
+
+	n = read_u32(r);
+	for (i = 0; i < n && r->error == 0; i++) {
+		if ((str = read_str(r)) == NULL)
+			break;
+		fragment_subdir(f, str);
+		free(str);
+	}
+
+	n = read_u32(r);
+	for (i = 0; i < n && r->error == 0; i++) {
+		if ((str = read_str(r)) == NULL)
+			break;
+		fragment_pool(f, str, read_u32(r));
+		free(str);
+	}
+
+	if (r->error != 0 || r->p != r->end)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Read the whole file at `path' and point `r' to it. Return the data to
+ * free, or NULL if there is no such file.
+ */
+static char *
+read_file(const char *path, struct reader *r)
+{
+	char *data = NULL;
+	size_t cap = 0;
+	size_t len = 0;
+	size_t n;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			perrorf("fopen(%s)", path);
+		return NULL;
+	}
+
+	do {
+		data = grow(data, &cap, len, 1);
+		n = fread(data + len, 1, cap - len, fp);
+		len += n;
+	} while (n > 0);
+	fclose(fp);
+
+	r->p = data;
+	r->end = data + len;
+	r->error = 0;
+
+	return data;
+}
+
+/*
+ * Load the fragment cached in `dir'. Return -1 if there is none, or if the
+ * Yamfile has to be evaluated again.
+ */
+int
+cache_load(const char *dir, struct fragment *f)
+{
+	char path[MAXPATHLEN];
+	struct reader r;
+	char *data;
+	int error;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, CACHE_FILE);
+	if ((data = read_file(path, &r)) == NULL)
+		return -1;
+
+	fragment_init(f);
+	if ((error = cache_parse(&r, f)) != 0)
+		fragment_free(f);
+	free(data);
+
+	return error;
+}
+
+static void
+shell_free_one(struct shell *sh)
+{
+	free(sh->key);
+	free(sh->output);
+	fragment_free(&sh->f);
+	free(sh);
+}
+
+/*
+ * Load the outputs of yam.shell() cached in the root, if they are still
+ * valid.
+ */
+void
+shell_load(void)
+{
+	struct reader r;
+	struct shell *sh;
+	char magic[sizeof(SHELL_MAGIC) - 1];
+	char *data;
+	uint32_t n, i;
+
+	if ((data = read_file(SHELL_FILE, &r)) == NULL)
+		return;
+
+	read_bytes(&r, magic, sizeof(magic));
+	if (r.error != 0 || memcmp(magic, SHELL_MAGIC, sizeof(magic)) != 0 ||
+		read_u32(&r) != SHELL_VERSION) {
+		free(data);
+		return;
+	}
+
+	n = read_u32(&r);
+	for (i = 0; i < n && r.error == 0; i++) {
+		if ((sh = calloc(1, sizeof(struct shell))) == NULL)
+			die("calloc()");
+		sh->traced = true;
+		sh->key = read_data(&r, &sh->keylen);
+		sh->output = read_data(&r, &sh->outlen);
+		sh->status = read_u32(&r);
+		read_inputs(&r, &sh->f);
+
+		if (r.error != 0 || !inputs_unchanged(&sh->f)) {
+			/* The command will run again, and the cache be saved */
+			_shells_dirty = true;
+			shell_free_one(sh);
+			continue;
+		}
+		HASH_ADD_KEYPTR(hh, _shells, sh->key, sh->keylen, sh);
+	}
+
+	free(data);
+}
+
+/*
+ * Save the outputs which can be reused by the next builds, and forget
+ * them.
+ */
+void
+shell_save(void)
+{
+	char from[MAXPATHLEN];
+	struct shell *sh, *tmp;
+	uint32_t version = SHELL_VERSION;
+	uint32_t n = 0;
+	FILE *fp = NULL;
+
+	snprintf(from, sizeof(from), "%s.%ld", SHELL_FILETEMP, (long)getpid());
+
+	if (_shells_dirty && (fp = fopen(from, "w")) == NULL)
+		perrorf("fopen(%s)", from);
+
+	if (fp != NULL) {
+		HASH_ITER(hh, _shells, sh, tmp)
+			n += sh->traced;
+
+		fwrite(SHELL_MAGIC, 1, sizeof(SHELL_MAGIC) - 1, fp);
+		fwrite(&version, sizeof(version), 1, fp);
+		write_u32(fp, n);
+		HASH_ITER(hh, _shells, sh, tmp) {
+			if (!sh->traced)
+				continue;
+			write_data(fp, sh->key, sh->keylen);
+			write_data(fp, sh->output, sh->outlen);
+			write_u32(fp, sh->status);
+			write_inputs(fp, &sh->f);
+		}
+
+		if (ferror(fp) != 0 || fclose(fp) != 0) {
+			perrorf("fwrite(%s)", from);
+			unlink(from);
+		} else if (rename(from, SHELL_FILE) != 0)
+			perrorf("rename(%s, %s)", from, SHELL_FILE);
+	}
+
+	HASH_ITER(hh, _shells, sh, tmp) {
+		HASH_DEL(_shells, sh);
+		shell_free_one(sh);
+	}
+	_shells_dirty = false;
+}
+
+/* Called by ipc_run() for each file read by the command */
+static void
+shell_input(void *arg, const char *path)
+{
+	fragment_input(arg, path);
+}
+
+/*
+ * Add the inputs of `sh' to the fragment of the Yamfile, it has to be
+ * evaluated again if the output may have changed.
+ */
+static void
+shell_inputs(const struct shell *sh, struct fragment *f)
+{
+	const struct finput *in;
+	size_t i;
+
+	for (i = 0; i < sh->f.ninputs; i++) {
+		in = &sh->f.inputs[i];
+		if (in->env)
+			fragment_env(f, in->name, in->value);
+		else
+			fragment_input(f, in->name);
+	}
+}
+
+/*
+ * Run `cmd' from the subdir `dir', with only the environment variables
+ * `envs' known to change its output, unless it already ran with the same
+ * inputs. Copy its output in `out', and return its exit status.
+ */
+int
+shell_run(const char *dir, const char *cmd, const char **envs, size_t nenvs,
+		  struct fragment *f, UT_string *out)
+{
+	UT_string *key;
+	struct shell *sh, *old;
+	size_t i;
+	int status;
+
+	utstring_new(key);
+	utstring_bincpy(key, dir, strlen(dir) + 1);
+	utstring_bincpy(key, cmd, strlen(cmd) + 1);
+	for (i = 0; i < nenvs; i++)
+		utstring_bincpy(key, envs[i], strlen(envs[i]) + 1);
+
+	utstring_clear(out);
+
+	/* The inputs of the loaded ones were checked by shell_load() */
+	pthread_mutex_lock(&_shells_mtx);
+	HASH_FIND(hh, _shells, utstring_body(key), utstring_len(key), sh);
+	if (sh != NULL) {
+		utstring_bincpy(out, sh->output, sh->outlen);
+		status = sh->status;
+		shell_inputs(sh, f);
+		pthread_mutex_unlock(&_shells_mtx);
+		utstring_free(key);
+		return status;
+	}
+	pthread_mutex_unlock(&_shells_mtx);
+
+	if ((sh = calloc(1, sizeof(struct shell))) == NULL)
+		die("calloc()");
+	fragment_init(&sh->f);
+	for (i = 0; i < nenvs; i++)
+		fragment_env(&sh->f, envs[i], getenv(envs[i]));
+
+	status = ipc_run(cmd, dir, out, &sh->traced, shell_input, &sh->f);
+	if (status < 0) {
+		shell_free_one(sh);
+		utstring_free(key);
+		return status;
+	}
+
+	sh->status = status;
+	sh->outlen = utstring_len(out);
+	if ((sh->output = malloc(sh->outlen + 1)) == NULL)
+		die("malloc()");
+	memcpy(sh->output, utstring_body(out), sh->outlen + 1);
+	sh->keylen = utstring_len(key);
+	if ((sh->key = malloc(sh->keylen)) == NULL)
+		die("malloc()");
+	memcpy(sh->key, utstring_body(key), sh->keylen);
+	utstring_free(key);
+
+	pthread_mutex_lock(&_shells_mtx);
+	HASH_FIND(hh, _shells, sh->key, sh->keylen, old);
+	if (old != NULL) {
+		HASH_DEL(_shells, old);
+		shell_free_one(old);
+	}
+	HASH_ADD_KEYPTR(hh, _shells, sh->key, sh->keylen, sh);
+	if (sh->traced)
+		_shells_dirty = true;
+	shell_inputs(sh, f);
+	pthread_mutex_unlock(&_shells_mtx);
+
+	return status;
+}
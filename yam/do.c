@@ -18,7 +18,9 @@
 #include <sys/uio.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #define _WITH_GETLINE
 #include <stdio.h>
 #include <unistd.h>
@@ -35,18 +37,64 @@ struct proc_info {
 	UT_string *output;
 	struct node *node;
 	struct file *files;
+
+	/*
+	 * The jobs run one after the other by the shell of the slot, instead
+	 * of `node'. Each has its own output, status and files.
+	 */
+	struct proc_info *batch;
+	size_t nbatch;
+	/* The tool running the job of the slot, if it is persistent */
+	struct worker *worker;
+	/* The files the job used were reported */
+	unsigned int traced :1;
+};
+
+/* Most jobs run by a single shell */
+#define BATCH_MAX 64
+/*
+ * Printed on a line of its own after each job of a batch, with the rank and
+ * the status of the job, to split the output of the shell.
+ */
+#define BATCH_MARK "\\036yam"
+#define BATCH_MARK_OUT "\n\036yam "
+
+/* A target of the command line, a job or a directory */
+struct target {
+	const char *path;
+	size_t len;
+	unsigned int found :1;
+	/* Whether it was looked up as a job */
+	unsigned int checked :1;
 };
 
 struct state {
 	struct graph *graph;
 	struct node *jobs;
+	/* The persistent tools started so far */
+	struct worker *workers;
 	unsigned int num_jobs;
 	unsigned int num_done;
 	int num_active;
+	/* Jobs running in the shell of a batch, besides the first ones */
+	int num_batched;
 	struct proc_info *pi;
 	struct pollfd *pfd;
 	const char *root;
-	FILE *log;
+	/* Subdirs declaring the wanted jobs, in the order they were loaded */
+	struct subdir **shards;
+	size_t num_shards;
+	struct eval *eval;
+	/* No target means all the jobs */
+	struct target *targets;
+	int num_targets;
+	/* Number of closures checked, to mark the nodes visited by a check */
+	unsigned int check;
+	/* A cycle was found while checking a closure, no job starts anymore */
+	bool cycle;
+	bool cycle_shown;
+	/* Logs which could not be loaded, no job starts anymore */
+	int failed;
 };
 
 struct file {
@@ -56,14 +104,192 @@ struct file {
 	struct file *next;
 };
 
+/*
+ * Add the jobs that were waiting for `n' to finish. The parents not
+ * computed yet will not wait for it.
+ */
+static void
+job_done(struct state *s, struct node *n)
+{
+	struct node *np;
+	size_t j;
+
+	n->finished = 1;
+	for (j = 0; j < n->parents.len; j++) {
+		np = n->parents.nodes[j];
+		if (np->visited == 0 || np->todo == 0)
+			continue;
+		np->waiting--;
+		if (np->waiting == 0)
+			DL_APPEND(s->jobs, np);
+	}
+}
+
+/*
+ * Return the first job ready to start whose pool is not full, NULL if none.
+ */
+static struct node *
+next_job(struct state *s)
+{
+	struct node *n;
+
+	DL_FOREACH(s->jobs, n) {
+		if (n->pool == NULL || n->pool->depth == 0 ||
+			n->pool->active < n->pool->depth)
+			return n;
+	}
+
+	return NULL;
+}
+
+/*
+ * Whether the wrapper reports the files `n' uses this time.
+ */
+static bool
+traced(const struct node *n)
+{
+	if (n->depfile != NULL)
+		return false;
+
+	switch (n->trace) {
+	case TRACE_NEVER:
+		return false;
+	case TRACE_NEW:
+		return n->logged == 0 || n->new_cmd == 1;
+	default:
+		return true;
+	}
+}
+
+/*
+ * Whether `m' can run in the same shell as `n'.
+ */
+static bool
+batchable(const struct node *n, const struct node *m)
+{
+	return m->batch == 1 && m->phony == 0 && m->pool == NULL &&
+		m->worker == NULL && m->rspfile == NULL && !builtin_cmd(m->cmd) &&
+		traced(m) == traced(n) &&
+		strcmp(m->cwd, n->cwd) == 0;
+}
+
+/*
+ * Take from the ready jobs the ones to run in the shell of `pi' along with
+ * `n', so the slots share them when there are only a few.
+ */
+static void
+gather_batch(struct state *s, struct proc_info *pi, struct node *n)
+{
+	struct node *m, *tmp;
+	size_t count = 0;
+	size_t max;
+	size_t k;
+
+	DL_FOREACH(s->jobs, m) {
+		if (batchable(n, m) && ++count == BATCH_MAX * (size_t)flags.jobs)
+			break;
+	}
+	max = MIN(MAX(count / flags.jobs, 1), BATCH_MAX);
+	if (max == 1)
+		return;
+
+	if ((pi->batch = calloc(max, sizeof(struct proc_info))) == NULL)
+		die("calloc()");
+	DL_DELETE(s->jobs, n);
+	pi->batch[pi->nbatch++].node = n;
+	DL_FOREACH_SAFE(s->jobs, m, tmp) {
+		if (pi->nbatch == max)
+			break;
+		if (!batchable(n, m))
+			continue;
+		DL_DELETE(s->jobs, m);
+		pi->batch[pi->nbatch++].node = m;
+	}
+	for (k = 0; k < pi->nbatch; k++)
+		pi->batch[k].traced = traced(pi->batch[k].node);
+}
+
+/*
+ * The script running the jobs of a batch, each followed by a line with its
+ * rank and its status. Traced jobs run in a shell of their own, so that it
+ * reports the files they open with their id, `slot' plus flags.jobs times
+ * their rank + 1.
+ */
+static char *
+batch_script(struct proc_info *pi, int slot)
+{
+	UT_string *script;
+	const char *p;
+	char *str;
+	size_t k;
+
+	utstring_new(script);
+	for (k = 0; k < pi->nbatch; k++) {
+		if (!pi->batch[k].traced) {
+			utstring_printf(script, "(\n%s\n)\n", pi->batch[k].node->cmd);
+		} else {
+			utstring_printf(script, "YAM_CHILD_ID=%d /bin/sh -c '",
+							slot + flags.jobs * (int)(k + 1));
+			for (p = pi->batch[k].node->cmd; *p != '\0'; p++) {
+				if (*p == '\'')
+					utstring_printf(script, "'\\''");
+				else
+					utstring_bincpy(script, p, 1);
+			}
+			utstring_printf(script, "'\n");
+		}
+		utstring_printf(script, "printf '\\n" BATCH_MARK " %zu %%d\\n' $?\n", k);
+	}
+	str = strdup(utstring_body(script));
+	utstring_free(script);
+
+	return str;
+}
+
+static int run_builtin(struct state *s, struct node *n);
+
+/*
+ * Write the response file of `n', which its command reads.
+ */
 static int
-start_job(struct state *s)
+write_rspfile(const struct node *n)
+{
+	FILE *fp;
+
+	if ((fp = fopen(n->rspfile, "w")) == NULL) {
+		perrorf("fopen(%s)", n->rspfile);
+		return -1;
+	}
+
+	fputs(n->rspcontent, fp);
+	if (ferror(fp) != 0 || fclose(fp) != 0) {
+		perrorf("fwrite(%s)", n->rspfile);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+start_job(struct state *s, struct node *n)
 {
 	struct proc_info *pi;
-	struct node *n;
+	char *cmd;
+	size_t k;
 	int i;
 
-	assert(s->jobs != NULL);
+	/* An alias is done as soon as what it depends on is */
+	if (n->phony == 1) {
+		DL_DELETE(s->jobs, n);
+		job_done(s, n);
+		return 0;
+	}
+
+	if (n->rspfile != NULL && write_rspfile(n) != 0)
+		return 1;
+
+	if (builtin_cmd(n->cmd))
+		return run_builtin(s, n);
 
 	/* find the first empty slot */
 	for (i = 0; i < flags.jobs; i++)
@@ -73,20 +299,61 @@ start_job(struct state *s)
 	assert(s->pi[i].fd == -1);
 
 	pi = &s->pi[i];
-	n = s->jobs;
 	assert(n->type == NODE_JOB);
-	if ((pi->pid = popen2(n->cmd, n->cwd, i, &pi->fd)) < 0) {
-		perror("popen2()");
-		return 1;
+	if (n->worker != NULL) {
+		if ((pi->worker = worker_get(&s->workers, n->worker,
+									 n->cwd)) == NULL)
+			return 1;
+		if (worker_send(pi->worker, n->cmd) != 0) {
+			worker_free(&s->workers, pi->worker);
+			pi->worker = NULL;
+			return 1;
+		}
+		pi->fd = pi->worker->fd;
+		pi->traced = 1;
+	} else {
+		if (n->batch == 1 && n->pool == NULL)
+			gather_batch(s, pi, n);
+
+		pi->traced = traced(n);
+		if (pi->batch != NULL) {
+			cmd = batch_script(pi, i);
+			pi->pid = popen2(cmd, n->cwd, i, pi->traced, &pi->fd);
+			free(cmd);
+		} else
+			pi->pid = popen2(n->cmd, n->cwd, i, pi->traced, &pi->fd);
+		if (pi->pid < 0) {
+			perror("popen2()");
+			/* The jobs of the batch are left to start, as a job alone is */
+			for (k = pi->nbatch; k > 0; k--)
+				DL_PREPEND(s->jobs, pi->batch[k - 1].node);
+			free(pi->batch);
+			pi->batch = NULL;
+			pi->nbatch = 0;
+			return 1;
+		}
 	}
 
 	s->pfd[i + 1].fd = pi->fd;
-	pi->node = n;
 	s->num_active++;
 
+	if (pi->batch != NULL) {
+		for (k = 0; k < pi->nbatch; k++)
+			printf("[%d/%d] %s\n", s->num_done + s->num_active +
+				   s->num_batched + (int)k, s->num_jobs,
+				   pi->batch[k].node->name);
+		s->num_batched += pi->nbatch - 1;
+		return 0;
+	}
+
+	pi->node = n;
+	if (n->pool != NULL)
+		n->pool->active++;
+
 	DL_DELETE(s->jobs, n);
 
-	printf("[%d/%d] %s\n", s->num_done + s->num_active, s->num_jobs, n->name);
+	printf("[%d/%d] %s\n", s->num_done + s->num_active + s->num_batched,
+		   s->num_jobs, n->name);
 
 	return 0;
 }
@@ -114,9 +381,10 @@ lint(struct state *s, struct proc_info *pi)
 	}
 
 	for (i = 0; i < pi->node->children.len; i++) {
-		dep = pi->node->children.nodes[i];
+		dep = pi->node->children.deps[i].node;
 
-		if (dep->type != NODE_DEP_EXPLICIT)
+		if (dep->type != NODE_DEP_EXPLICIT ||
+			pi->node->children.deps[i].order == 1)
 			continue;
 		found = 0;
 		LL_FOREACH(pi->files, f) {
@@ -133,47 +401,187 @@ lint(struct state *s, struct proc_info *pi)
 	}
 }
 
-static int
-finish_job(struct state *s, int i)
+/*
+ * Whether `dep', or the job building it, is an order-only dependency of `n'.
+ */
+static bool
+ordered(struct node *n, struct node *dep)
 {
-	struct proc_info *pi = &s->pi[i];
-	struct node *n;
-	struct node *np;
+	size_t i;
+
+	if (dep->type == NODE_OUTPUT)
+		dep = dep->job;
+
+	for (i = 0; i < n->children.len; i++) {
+		if (n->children.deps[i].node == dep &&
+			n->children.deps[i].order == 1)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Record the stamps of the output and of the dependencies, explicit or found
+ * by the wrapper, as they are now. The outputs of the order-only
+ * dependencies the job read are recorded with the implicit ones.
+ */
+static void
+log_job(struct state *s, struct proc_info *pi)
+{
+	struct node *n = pi->node;
+	struct node *dep;
 	struct file *f;
-	size_t j;
+	struct dep *deps = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	size_t i;
 
-	pi->retcode = pclose2(pi->pid, pi->fd);
+	/* What it read the last time it was traced still holds */
+	if (pi->traced == 0 && n->depfile == NULL && n->trace == TRACE_NEW) {
+		if (n->implicit != NULL) {
+			n->implicit = graph_restamp(s->graph, n->implicit);
+			log_entry_set(n->subdir->log, n->implicit);
+		}
+		goto stamps;
+	}
 
-	pi->pid = -1;
-	pi->fd = s->pfd[i + 1].fd = -1;
-	s->num_active--;
+	LL_FOREACH(pi->files, f) {
+		if (f->mode != 'r' || f->explicit == 1)
+			continue;
+		/* The response file is part of the command */
+		if (n->rspfile != NULL && strcmp(f->path, n->rspfile) == 0)
+			continue;
+		dep = graph_get(s->graph, f->path, true);
+		if ((dep->type == NODE_JOB || dep->type == NODE_OUTPUT) &&
+			!ordered(n, dep))
+			continue;
+		if (dep->type == NODE_UNKNOWN)
+			dep->type = NODE_DEP_IMPLICIT;
+		node_stat(dep);
+		if (len == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			if ((deps = realloc(deps, sizeof(struct dep) * cap)) == NULL)
+				die("realloc()");
+		}
+		deps[len].node = dep;
+		deps[len].stamp = dep->stamp;
+		len++;
+	}
 
-	if (pi->retcode != 0)
-		return 1;
+	/* Most jobs read the same files, only the first one adds the set */
+	if (len > 0) {
+		n->implicit = graph_depset(s->graph, deps, len);
+		log_entry_set(n->subdir->log, n->implicit);
+	} else {
+		free(deps);
+		n->implicit = NULL;
+	}
+
+stamps:
+	node_stat(n);
+	log_entry_start(n->subdir->log, n->name, log_cmd_hash(n), &n->stamp,
+					n->implicit);
+
+	for (i = 0; i < n->children.len; i++) {
+		if (!dep_stamped(&n->children.deps[i]))
+			continue;
+		dep = n->children.deps[i].node;
+		node_stat(dep);
+		log_entry_dep(n->subdir->log, dep->name, &dep->stamp,
+					  NODE_DEP_EXPLICIT);
+	}
+	for (i = 0; i < n->outputs.len; i++) {
+		dep = n->outputs.nodes[i];
+		node_stat(dep);
+		log_entry_dep(n->subdir->log, dep->name, &dep->stamp, NODE_OUTPUT);
+	}
+
+	log_entry_finish(n->subdir->log);
+}
+
+static void dyndep_built(struct state *s, struct node *n);
+static int read_deps(struct state *s, struct node *n, const char *file,
+		bool all, void (*cb)(struct state *, void *, const char *), void *arg);
+
+/*
+ * Add a file the job of `arg' read or wrote, `mode' being 'r' or 'w', as
+ * its depfile or a builtin says.
+ */
+static void
+add_file(void *arg, unsigned char mode, const char *path)
+{
+	struct proc_info *pi = arg;
+	struct node *n = pi->node;
+	struct file *f;
+	size_t i;
+
+	/* Outside of the root, as the wrapper would */
+	if (path[0] == '/' || strncmp(path, "../", 3) == 0)
+		return;
+
+	for (f = pi->files; f != NULL; f = f->next) {
+		if (strcmp(f->path, path) == 0) {
+			if (mode != 'r')
+				f->mode = mode;
+			return;
+		}
+	}
+
+	if ((f = calloc(1, sizeof(struct file))) == NULL ||
+		(f->path = strdup(path)) == NULL)
+		die("calloc()");
+	f->mode = mode;
+	for (i = 0; i < n->children.len; i++) {
+		if (n->children.deps[i].order == 0 &&
+			strcmp(n->children.deps[i].node->name, path) == 0)
+			f->explicit = 1;
+	}
+	LL_PREPEND(pi->files, f);
+}
+
+/*
+ * Add a file the job read, according to its depfile.
+ */
+static void
+add_read(struct state *s, void *arg, const char *path)
+{
+	(void)s;
+	add_file(arg, 'r', path);
+}
+
+/*
+ * Record that the job of `pi' succeeded, and forget what it did.
+ */
+static void
+job_finished(struct state *s, struct proc_info *pi)
+{
+	struct node *n = pi->node;
+	struct file *f;
+	size_t j;
+
+	dyndep_built(s, n);
+	job_done(s, n);
 
 	/*
-	 * Add jobs that were waiting for the current job to finish
+	 * The outputs have changed, forget their stamps
 	 */
-	n = pi->node;
-	for (j = 0; j < n->parents.len; j++) {
-		np = n->parents.nodes[j];
-		np->waiting--;
-		if (np->waiting == 0 && np->todo == 1)
-			DL_APPEND(s->jobs, np);
-	}
+	n->stamp.mtime = 0;
+	for (j = 0; j < n->outputs.len; j++)
+		n->outputs.nodes[j]->stamp.mtime = 0;
 
 	/*
-	 * Add an entry to the log
+	 * Add an entry to the log, with what the depfile lists if the job was
+	 * not traced.
 	 */
 	if (flags.fast != 1) {
-		log_entry_start(s->log, n->name, n->cmd);
-		LL_FOREACH(pi->files, f) {
-			if (f->mode == 'r' && f->explicit == 0)
-				log_entry_dep(s->log, f->path);
-		}
-		log_entry_finish(s->log);
+		if (n->depfile != NULL &&
+			read_deps(s, n, n->depfile, true, add_read, pi) != 0)
+			fprintf(stderr, "%s: %s was not written\n", n->name,
+					n->depfile);
+		log_job(s, pi);
 
-		if (flags.lint == 1)
+		if (flags.lint == 1 && (pi->traced == 1 || n->depfile != NULL))
 			lint(s, pi);
 	}
 
@@ -187,6 +595,170 @@ finish_job(struct state *s, int i)
 		free(f->path);
 		free(f);
 	}
+}
+
+/*
+ * Split the output of the shell of `pi' among the jobs of its batch, and
+ * finish the ones that succeeded. A job whose status was not printed failed
+ * with the shell. Return the number of jobs that failed, kept in the batch.
+ */
+static int
+finish_batch(struct state *s, struct proc_info *pi)
+{
+	struct proc_info *bi;
+	char *out, *mark, *end;
+	size_t k, nfailed = 0;
+	int status;
+
+	s->num_batched -= pi->nbatch - 1;
+	out = pi->output != NULL ? utstring_body(pi->output) : NULL;
+	for (k = 0; k < pi->nbatch; k++) {
+		bi = &pi->batch[k];
+		bi->retcode = pi->retcode != 0 ? pi->retcode : 1;
+		if (out == NULL)
+			continue;
+
+		/* the shell prints the status of the jobs in order */
+		if ((mark = strstr(out, BATCH_MARK_OUT)) == NULL) {
+			out = NULL;
+			continue;
+		}
+		if (mark > out) {
+			utstring_new(bi->output);
+			utstring_bincpy(bi->output, out, mark - out);
+		}
+		mark += sizeof(BATCH_MARK_OUT) - 1;
+		if (strtoul(mark, &end, 10) != k || sscanf(end, " %d", &status) != 1)
+			die("%s: unexpected output of the shell", bi->node->name);
+		bi->retcode = status;
+		if ((end = strchr(end, '\n')) == NULL)
+			out = NULL;
+		else
+			out = end + 1;
+	}
+	pi->retcode = 0;
+	if (pi->output != NULL)
+		utstring_clear(pi->output);
+
+	for (k = 0; k < pi->nbatch; k++) {
+		bi = &pi->batch[k];
+		if (bi->retcode != 0) {
+			pi->batch[nfailed++] = *bi;
+			continue;
+		}
+		job_finished(s, bi);
+		if (bi->output != NULL)
+			utstring_free(bi->output);
+	}
+	pi->nbatch = nfailed;
+	if (nfailed == 0) {
+		free(pi->batch);
+		pi->batch = NULL;
+	}
+
+	return (int)nfailed;
+}
+
+/*
+ * Run the builtin command of `n' right away, without a slot: it reports the
+ * files it uses itself.
+ */
+static int
+run_builtin(struct state *s, struct node *n)
+{
+	struct proc_info pi;
+	struct file *f;
+
+	memset(&pi, 0, sizeof(pi));
+	pi.pid = -1;
+	pi.fd = -1;
+	pi.node = n;
+	pi.traced = 1;
+	DL_DELETE(s->jobs, n);
+
+	printf("[%d/%d] %s\n", s->num_done + s->num_active + s->num_batched + 1,
+		   s->num_jobs, n->name);
+
+	utstring_new(pi.output);
+	pi.retcode = builtin_run(n->cmd, n->cwd, pi.output,
+							 flags.fast == 1 ? NULL : add_file, &pi);
+	if (pi.retcode == 0)
+		job_finished(s, &pi);
+	else {
+		fprintf(stderr, "%s\n%s\n*** Error code %d\n\n", n->cmd,
+				utstring_body(pi.output), pi.retcode);
+		while (pi.files != NULL) {
+			f = pi.files;
+			LL_DELETE(pi.files, f);
+			free(f->path);
+			free(f);
+		}
+	}
+	utstring_free(pi.output);
+
+	return pi.retcode != 0;
+}
+
+/*
+ * Read the answer of the worker of the slot `i', and finish its job once it
+ * is complete. A worker which exited fails the job.
+ */
+static int
+read_worker(struct state *s, int i)
+{
+	struct proc_info *pi = &s->pi[i];
+	int ret;
+
+	if (pi->output == NULL)
+		utstring_new(pi->output);
+	ret = worker_read(pi->worker, &pi->retcode, pi->output,
+					  flags.fast == 1 ? NULL : add_file, pi);
+	if (ret == 0)
+		return 0;
+	if (ret < 0) {
+		utstring_printf(pi->output, "worker %s exited\n", pi->worker->cmd);
+		if ((pi->retcode = worker_free(&s->workers, pi->worker)) == 0)
+			pi->retcode = 1;
+	} else
+		pi->worker->busy = 0;
+
+	pi->worker = NULL;
+	pi->fd = s->pfd[i + 1].fd = -1;
+	s->num_active--;
+	if (pi->node->pool != NULL)
+		pi->node->pool->active--;
+
+	if (pi->retcode != 0)
+		return 1;
+
+	job_finished(s, pi);
+
+	return 0;
+}
+
+static int
+finish_job(struct state *s, int i)
+{
+	struct proc_info *pi = &s->pi[i];
+
+	if (pi->worker != NULL)
+		return read_worker(s, i);
+
+	pi->retcode = pclose2(pi->pid, pi->fd);
+
+	pi->pid = -1;
+	pi->fd = s->pfd[i + 1].fd = -1;
+	s->num_active--;
+	if (pi->batch != NULL)
+		return finish_batch(s, pi);
+
+	if (pi->node->pool != NULL)
+		pi->node->pool->active--;
+
+	if (pi->retcode != 0)
+		return 1;
+
+	job_finished(s, pi);
 
 	return 0;
 }
@@ -197,6 +769,9 @@ read_pipe(struct state *s, int i)
 	ssize_t sz;
 	char buf[8192];
 
+	if (s->pi[i].worker != NULL)
+		return read_worker(s, i);
+
 	if ((sz = read(s->pi[i].fd, buf, sizeof(buf))) < 0) {
 		perror("read()");
 		finish_job(s, i);
@@ -218,6 +793,28 @@ read_pipe(struct state *s, int i)
 	return 0;
 }
 
+/*
+ * The job of the child `id', or of the batch it runs in, NULL if it is done.
+ */
+static struct proc_info *
+child_info(struct state *s, int id)
+{
+	struct proc_info *pi;
+	size_t k;
+
+	if (id < 0)
+		return NULL;
+	pi = &s->pi[id % flags.jobs];
+	k = (size_t)(id / flags.jobs);
+	if (pi->batch == NULL)
+		return k == 0 && pi->node != NULL ? pi : NULL;
+	/* the shell of a batch reports nothing of its own */
+	if (k == 0 || k > pi->nbatch)
+		return NULL;
+
+	return &pi->batch[k - 1];
+}
+
 static int
 ipc(struct state *s)
 {
@@ -226,7 +823,7 @@ ipc(struct state *s)
 	size_t cap = 0;
 	ssize_t len;
 	size_t rootlen;
-	int child_id = -1;
+	struct proc_info *pi = NULL;
 	struct node *n;
 	struct node *dep;
 	int explicit;
@@ -242,9 +839,10 @@ ipc(struct state *s)
 		if (line[len - 1] == '\n')
 			line[len - 1] = '\0';
 
-		if (child_id == -1) {
-			child_id = (int)strtol(line, NULL, 10);
-			n = s->pi[child_id].node;
+		if (pi == NULL) {
+			if ((pi = child_info(s, (int)strtol(line, NULL, 10))) == NULL)
+				break;
+			n = pi->node;
 		} else {
 			mode = line[0];
 			assert(mode == 'r' || mode == 'w');
@@ -257,11 +855,15 @@ ipc(struct state *s)
 			/* trim rootdir */
 			path += rootlen + 1;
 
-			/* ignore if already an explicit dep */
+			/*
+			 * ignore if already an explicit dep, an order-only one is
+			 * recorded if read.
+			 */
 			explicit = 0;
 			for (size_t i = 0; i < n->children.len; i++) {
-				dep = n->children.nodes[i];
-				if (dep->type != NODE_DEP_IMPLICIT && strcmp(dep->name, path) == 0) {
+				dep = n->children.deps[i].node;
+				if (n->children.deps[i].order == 0 &&
+					strcmp(dep->name, path) == 0) {
 					explicit = 1;
 					break;
 				}
@@ -274,7 +876,7 @@ ipc(struct state *s)
 				continue;
 
 			/* find if this file is in the list */
-			for (f = s->pi[child_id].files; f != NULL; f = f->next)
+			for (f = pi->files; f != NULL; f = f->next)
 				if (strcmp(f->path, path) == 0)
 					break;
 
@@ -288,7 +890,7 @@ ipc(struct state *s)
 			f->path = strdup(path);
 			f->mode = mode;
 			f->explicit = explicit;
-			LL_PREPEND(s->pi[child_id].files, f);
+			LL_PREPEND(pi->files, f);
 		}
 	}
 	if (ferror(fp))
@@ -299,58 +901,571 @@ ipc(struct state *s)
 	return 0;
 }
 
+/*
+ * Resolve `path', read in a file of the subdir `dir', relative to the root.
+ */
+static void
+dep_path(struct state *s, const char *dir, const char *path, char *buf,
+		 size_t len)
+{
+	size_t rootlen = strlen(s->root);
+
+	while (strncmp(path, "./", 2) == 0)
+		path += 2;
+
+	if (path[0] == '/' && strncmp(path, s->root, rootlen) == 0 &&
+		path[rootlen] == '/')
+		snprintf(buf, len, "%s", path + rootlen + 1);
+	else if (path[0] == '/' || strcmp(dir, ".") == 0)
+		snprintf(buf, len, "%s", path);
+	else
+		snprintf(buf, len, "%s/%s", dir, path);
+}
+
+/*
+ * Return the next path of the line at `*p', without the escapes of make,
+ * or NULL if there is none.
+ */
+static char *
+next_path(char **p)
+{
+	char *src = *p;
+	char *dst;
+	char *path;
+
+	while (*src == ' ' || *src == '\t')
+		src++;
+	if (*src == '\0')
+		return NULL;
+
+	path = dst = src;
+	while (*src != '\0' && *src != ' ' && *src != '\t') {
+		if ((src[0] == '\\' && (src[1] == ' ' || src[1] == '#')) ||
+			(src[0] == '$' && src[1] == '$'))
+			src++;
+		*dst++ = *src++;
+	}
+	*p = *src != '\0' ? src + 1 : src;
+	*dst = '\0';
+
+	return path;
+}
+
+/*
+ * Whether one of the targets in `list' is `n' or one of its outputs.
+ */
+static bool
+is_target(struct state *s, struct node *n, char *list)
+{
+	char path[MAXPATHLEN];
+	char *tok;
+	size_t i;
+
+	while ((tok = next_path(&list)) != NULL) {
+		dep_path(s, n->cwd, tok, path, sizeof(path));
+		if (strcmp(path, n->name) == 0)
+			return true;
+		for (i = 0; i < n->outputs.len; i++)
+			if (strcmp(path, n->outputs.nodes[i]->name) == 0)
+				return true;
+	}
+
+	return false;
+}
+
+/*
+ * Read the Makefile-like `file': lines of `targets: dependencies',
+ * continued by a backslash, with paths relative to the subdir of `n'.
+ * Call `cb' with each dependency of the lines naming `n', or of all the
+ * lines if `all' is true. Return -1 if it does not exist.
+ */
+static int
+read_deps(struct state *s, struct node *n, const char *file, bool all,
+		  void (*cb)(struct state *, void *, const char *), void *arg)
+{
+	char path[MAXPATHLEN];
+	char *line = NULL;
+	char *p, *tok;
+	size_t cap = 0;
+	ssize_t len;
+	FILE *fp;
+	bool mine = false;
+	bool cont = false;
+	bool next;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		if (errno != ENOENT)
+			perrorf("fopen(%s)", file);
+		return -1;
+	}
+
+	while ((len = getline(&line, &cap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if ((next = len > 0 && line[len - 1] == '\\'))
+			line[--len] = '\0';
+
+		p = line;
+		if (!cont) {
+			if ((p = strchr(line, ':')) == NULL) {
+				mine = false;
+				cont = next;
+				continue;
+			}
+			*p++ = '\0';
+			mine = all || is_target(s, n, line);
+		}
+		cont = next;
+		if (!mine)
+			continue;
+
+		while ((tok = next_path(&p)) != NULL) {
+			dep_path(s, n->cwd, tok, path, sizeof(path));
+			cb(s, arg, path);
+		}
+	}
+	if (ferror(fp))
+		perrorf("getline(%s)", file);
+	fclose(fp);
+	free(line);
+
+	return 0;
+}
+
+static void
+add_dyndep(struct state *s, void *arg, const char *path)
+{
+	struct node *n = arg;
+	struct node *dep;
+	size_t i;
+
+	/* Already a dependency */
+	if ((dep = graph_get(s->graph, path, false)) != NULL &&
+		dep->type == NODE_OUTPUT)
+		dep = dep->job;
+	for (i = 0; dep != NULL && i < n->children.len; i++)
+		if (n->children.deps[i].node == dep)
+			return;
+
+	graph_add_dep(s->graph, n, path, NODE_DEP_EXPLICIT);
+}
+
+/*
+ * Add the dependencies of `n' listed in its dyndep file, if it exists. The
+ * lines of other targets are skipped.
+ */
+static void
+read_dyndep(struct state *s, struct node *n)
+{
+	n->dyndep_read = 1;
+	read_deps(s, n, n->dyndep->name, false, add_dyndep, n);
+}
+
+/*
+ * Lock and load the log of `sd', the first time one of its jobs is wanted.
+ * A failure is counted in `failed', for the main loop.
+ */
+static void
+load_shard(struct state *s, struct subdir *sd)
+{
+	struct node *n;
+	size_t i;
+
+	if (sd->lock >= 0)
+		return;
+
+	/* The records have the stamps of what the dyndep files list */
+	for (i = 0; i < sd->jobs.len; i++) {
+		n = sd->jobs.nodes[i];
+		if (n->subdir == sd && n->dyndep != NULL && n->dyndep_read == 0)
+			read_dyndep(s, n);
+	}
+
+	if (log_load(s->graph, sd) != 0 && sd->lock < 0) {
+		fprintf(stderr, "can not lock the log of %s\n", sd->path);
+		s->failed++;
+		return;
+	}
+
+	s->shards = realloc(s->shards, (s->num_shards + 1) * sizeof(struct subdir *));
+	if (s->shards == NULL)
+		die("realloc()");
+	s->shards[s->num_shards++] = sd;
+
+	if (flags.fast != 1 && (sd->log = log_open(s->graph, sd)) == NULL) {
+		fprintf(stderr, "can not open the log of %s\n", sd->path);
+		s->failed++;
+	}
+}
+
+static void
+unload_shards(struct state *s)
+{
+	struct subdir *sd;
+	size_t i;
+
+	for (i = 0; i < s->num_shards; i++) {
+		sd = s->shards[i];
+		if (sd->log != NULL) {
+			graph_dump_log(s->graph, sd, sd->log);
+			log_close(sd->log);
+			sd->log = NULL;
+		}
+		log_unlock(sd);
+	}
+	free(s->shards);
+}
+
+/*
+ * Return a subdir not merged yet which may still declare `n' or what it
+ * depends on, or NULL if they are all known.
+ */
+static struct subdir *
+unsettled(struct state *s, struct node *n)
+{
+	struct subdir *sd;
+	size_t i;
+
+	if (n->settled == 1)
+		return NULL;
+	if (n->onstack == 1) {
+		s->cycle = true;
+		return NULL;
+	}
+	if (n->check == s->check)
+		return NULL;
+	n->check = s->check;
+
+	if ((sd = yamfile_pending(s->eval, n->name)) != NULL)
+		return sd;
+	if (n->type != NODE_JOB)
+		return NULL;
+
+	/* Once the dyndep file is known, so are the dependencies it lists */
+	n->onstack = 1;
+	if (n->dyndep != NULL && n->dyndep_read == 0 &&
+		(sd = unsettled(s, n->dyndep)) == NULL)
+		read_dyndep(s, n);
+	for (i = 0; sd == NULL && i < n->children.len; i++)
+		sd = unsettled(s, n->children.deps[i].node);
+	n->onstack = 0;
+
+	return sd;
+}
+
+/*
+ * Mark `n' and what it depends on as needed, once they are all known.
+ */
+static void
+want(struct state *s, struct node *n)
+{
+	size_t i;
+
+	n->settled = 1;
+	if (n->type != NODE_JOB || n->wanted == 1)
+		return;
+	n->wanted = 1;
+
+	load_shard(s, n->subdir);
+
+	for (i = 0; i < n->children.len; i++)
+		want(s, n->children.deps[i].node);
+}
+
+/*
+ * Compute the job `n' if what it depends on is known, otherwise wait for
+ * the subdir which may still change it.
+ */
+static void
+add_root(struct state *s, struct node *n)
+{
+	struct subdir *sd;
+
+	if (n->visited == 1)
+		return;
+
+	s->check++;
+	if ((sd = unsettled(s, n)) != NULL) {
+		nodes_add(&sd->blocked, n);
+		yamfile_eval(s->eval, sd);
+		return;
+	}
+	if (s->cycle)
+		return;
+
+	want(s, n);
+	s->num_jobs += graph_compute(s->graph, n, &s->jobs);
+}
+
+/*
+ * Look for the jobs to build now that `sd' is in the graph.
+ */
+static void
+merged(struct state *s, struct subdir *sd)
+{
+	struct nodes blocked = sd->blocked;
+	struct subdir *pending;
+	struct target *t;
+	struct node *n;
+	size_t i;
+	int j;
+	bool match = s->num_targets == 0;
+
+	for (j = 0; j < s->num_targets; j++) {
+		t = &s->targets[j];
+		if (strcmp(t->path, ".") == 0 || (strncmp(sd->path, t->path, t->len) == 0
+			&& (sd->path[t->len] == '\0' || sd->path[t->len] == '/'))) {
+			t->found = 1;
+			match = true;
+		}
+	}
+	if (match) {
+		for (i = 0; i < sd->jobs.len; i++)
+			add_root(s, sd->jobs.nodes[i]);
+	}
+
+	sd->blocked.nodes = NULL;
+	sd->blocked.len = sd->blocked.cap = 0;
+	for (i = 0; i < blocked.len; i++)
+		add_root(s, blocked.nodes[i]);
+	free(blocked.nodes);
+
+	/* Evaluate the subdirs above a target until it is known */
+	for (j = 0; j < s->num_targets; j++) {
+		t = &s->targets[j];
+		if (t->checked == 1)
+			continue;
+		if ((pending = yamfile_pending(s->eval, t->path)) != NULL) {
+			yamfile_eval(s->eval, pending);
+			continue;
+		}
+		t->checked = 1;
+		n = graph_get(s->graph, t->path, false);
+		if (n != NULL && n->type == NODE_OUTPUT)
+			n = n->job;
+		if (n != NULL && n->type == NODE_JOB) {
+			t->found = 1;
+			add_root(s, n);
+		}
+	}
+}
+
+/*
+ * Evaluate the subdirs which may still declare `n' or what it depends on.
+ */
+static void
+settle(struct state *s, struct node *n)
+{
+	struct subdir *sd;
+	struct subdir *m;
+
+	for (;;) {
+		s->check++;
+		if ((sd = unsettled(s, n)) == NULL)
+			return;
+		yamfile_eval(s->eval, sd);
+		do {
+			if ((m = yamfile_next(s->eval, true)) == NULL)
+				return;
+			merged(s, m);
+		} while (m != sd);
+	}
+}
+
+/*
+ * Whether `to' is `n' or one of the jobs `n' depends on.
+ */
+static bool
+depends(struct state *s, struct node *n, struct node *to)
+{
+	size_t i;
+
+	if (n == to)
+		return true;
+	if (n->type != NODE_JOB || n->check == s->check)
+		return false;
+	n->check = s->check;
+
+	for (i = 0; i < n->children.len; i++)
+		if (depends(s, n->children.deps[i].node, to))
+			return true;
+
+	return false;
+}
+
+/*
+ * The job `n' was built: read again the dyndep file it built for the jobs
+ * using it, and make them wait for the new dependencies to be built before
+ * they are released.
+ */
+static void
+dyndep_built(struct state *s, struct node *n)
+{
+	struct node *p;
+	struct node *c;
+	size_t i, j, first;
+
+	for (j = 0; j < n->parents.len; j++) {
+		p = n->parents.nodes[j];
+		if (p->dyndep == NULL || (p->dyndep != n && p->dyndep->job != n))
+			continue;
+
+		first = p->children.len;
+		read_dyndep(s, p);
+		if (p->visited == 0 || p->todo == 0)
+			continue;
+
+		for (i = first; i < p->children.len; i++) {
+			/* It may be an output of a job declared since */
+			settle(s, p->children.deps[i].node);
+			c = p->children.deps[i].node;
+			if (c->type != NODE_JOB)
+				continue;
+			/* The jobs it depended on were known to be free of cycles */
+			s->check++;
+			if (s->cycle || depends(s, c, p)) {
+				s->cycle = true;
+				return;
+			}
+			want(s, c);
+			s->num_jobs += graph_compute(s->graph, c, &s->jobs);
+			if (c->todo == 1 && c->finished == 0)
+				p->waiting++;
+		}
+	}
+}
+
+/*
+ * Show the cycle found while checking a closure, the first time.
+ */
+static int
+cycle_found(struct state *s)
+{
+	if (!s->cycle || s->cycle_shown)
+		return 0;
+	s->cycle_shown = true;
+
+	if (graph_check_cycles(s->graph) == 0)
+		fprintf(stderr, "There is a cycle in the graph\n");
+
+	return 1;
+}
+
+/*
+ * All the Yamfiles are evaluated, check what could not be checked before.
+ */
+static int
+evaluated(struct state *s)
+{
+	int j;
+	int error = 0;
+
+	for (j = 0; j < s->num_targets; j++) {
+		if (s->targets[j].found == 0) {
+			fprintf(stderr, "unknown target `%s'\n", s->targets[j].path);
+			error = 1;
+		}
+	}
+
+	return error;
+}
+
+/*
+ * Build `targets', or all the jobs if there is none. The targets are paths
+ * relative to the root, of a job or of a directory meaning all the jobs
+ * declared in it and below.
+ * The jobs start as soon as what they depend on is known, while the
+ * Yamfiles are still evaluated.
+ */
 int
-do_jobs(struct graph *g, char *root)
+do_jobs(struct graph *g, char *root, char **targets, int ntargets)
 {
-	struct state s = { g, NULL, 0, 0, 0, NULL, NULL, root, NULL};
-	struct proc_info *pi;
+	struct state s;
+	struct proc_info *pi, *bi;
+	struct subdir *sd;
+	struct node *n;
+	struct file *f;
+	size_t k;
 	int i;
 	int error = 0;
+	/* Whether all the Yamfiles we need were evaluated */
+	bool complete = true;
+	/* `flags.jobs' pipes + 1 unix socket + 1 pipe of the evaluation */
+	int npfd = flags.jobs + 2;
 
-	log_load(root, g);
-	s.num_jobs = graph_compute(g, &s.jobs);
-
-	/*
-	 * Nothing to do, exit early
-	 */
-	if (s.num_jobs == 0)
-		return 0;
+	memset(&s, 0, sizeof(s));
+	s.graph = g;
+	s.root = root;
+	s.num_targets = ntargets;
+	if (ntargets > 0 &&
+		(s.targets = calloc(ntargets, sizeof(struct target))) == NULL)
+		die("calloc()");
+	for (i = 0; i < ntargets; i++) {
+		s.targets[i].path = targets[i];
+		s.targets[i].len = strlen(targets[i]);
+	}
 
 	s.pi = calloc(flags.jobs, sizeof(struct proc_info));
 	for (i = 0; i < flags.jobs; i++)
 		s.pi[i].fd = -1;
 
-	/* `flags.jobs' pipes + 1 unix socket*/
-	s.pfd = malloc((flags.jobs + 1) * sizeof(struct pollfd));
-	for (i = 0; i < (flags.jobs + 1); i++) {
+	s.pfd = malloc(npfd * sizeof(struct pollfd));
+	for (i = 0; i < npfd; i++) {
 		s.pfd[i].fd = -1;
 		s.pfd[i].events = POLLIN;
 	}
 
-	if (flags.fast != 1) {
-		s.log = log_open(root);
-		if (s.log == NULL)
-			die("can not open log file for writing");
-
+	if (flags.fast != 1)
 		s.pfd[0].fd = ipc_listen(flags.jobs);
-	}
 
 	/*
-	 * Iterate as long as there are jobs to do/being done.
-	 * If there is an error, we still want to wait for running jobs to finish.
+	 * Only the subdirs below the targets are evaluated, and the ones
+	 * declaring what they depend on.
+	 */
+	s.eval = yamfile_start(g, root);
+	s.pfd[npfd - 1].fd = yamfile_fd(s.eval);
+	if (ntargets == 0)
+		yamfile_want(s.eval, ".");
+	for (i = 0; i < ntargets; i++)
+		yamfile_want(s.eval, targets[i]);
+
+	/*
+	 * Iterate as long as there are Yamfiles to evaluate or jobs to
+	 * do/being done.
+	 * If there is an error, we still want to wait for running jobs to finish,
+	 * and for the Yamfiles being evaluated, but no other one is.
 	 */
-	while ((s.jobs != NULL && error == 0) || s.num_active > 0) {
+	while (!yamfile_done(s.eval) || (s.jobs != NULL && error == 0) ||
+		   s.num_active > 0) {
+		while ((sd = yamfile_next(s.eval, false)) != NULL)
+			merged(&s, sd);
+		error += yamfile_errors(s.eval) + s.failed;
+		s.failed = 0;
+		if (error > 0) {
+			yamfile_stop(s.eval);
+			complete = false;
+		}
+		if (yamfile_done(s.eval) && s.pfd[npfd - 1].fd != -1) {
+			s.pfd[npfd - 1].fd = -1;
+			if (error == 0)
+				error += evaluated(&s);
+		}
+		error += cycle_found(&s);
+
 		/*
-		 * Launch new jobs if we have empty slots and if we have pending jobs.
+		 * Launch new jobs if we have empty slots and if we have pending jobs
+		 * whose pool is not full.
 		 * If there is an error, we do not want to launch new jobs.
 		 */
-		while (s.num_active < flags.jobs && s.jobs != NULL && error == 0)
-			start_job(&s);
+		while (s.num_active < flags.jobs && error == 0 &&
+			   (n = next_job(&s)) != NULL)
+			error += start_job(&s, n);
 
-		assert(s.num_active > 0);
+		if (s.num_active == 0 && yamfile_done(s.eval))
+			break;
 
-		/* poll running jobs + unix socket */
-		if (poll(s.pfd, flags.jobs + 1, -1) < 0)
+		/* poll running jobs + unix socket + evaluation */
+		if (poll(s.pfd, npfd, -1) < 0)
 			die("poll()");
 
 		/* special case for the unix socket */
@@ -360,20 +1475,15 @@ do_jobs(struct graph *g, char *root)
 			} while (poll(s.pfd, 1, 0) > 0);
 		}
 
+		/* what is left in a pipe is read before it is seen closed */
 		for (i = 1; i <= flags.jobs; i++)
-			if (s.pfd[i].revents & POLLHUP)
-				error += finish_job(&s, i - 1);
-			else if (s.pfd[i].revents & POLLIN)
+			if (s.pfd[i].revents & POLLIN)
 				error += read_pipe(&s, i - 1);
+			else if (s.pfd[i].revents & POLLHUP)
+				error += finish_job(&s, i - 1);
 	}
-
-	/*
-	 * If we did not all the jobs and that's not because of an error,
-	 * there is a cycle in the graph.
-	 */
-	if (s.num_done != s.num_jobs && error == 0) {
-		fprintf(stderr, "There is a cycle in the graph!\n");
-	}
+	yamfile_finish(s.eval);
+	worker_close(&s.workers);
 
 	/*
 	 * Print output generated by jobs that failed
@@ -388,16 +1498,33 @@ do_jobs(struct graph *g, char *root)
 		}
 		if (pi->output != NULL)
 			utstring_free(pi->output);
+		for (k = 0; k < pi->nbatch; k++) {
+			bi = &pi->batch[k];
+			fprintf(stderr, "%s\n", bi->node->cmd);
+			if (bi->output != NULL) {
+				fprintf(stderr, "%s\n", utstring_body(bi->output));
+				utstring_free(bi->output);
+			}
+			fprintf(stderr, "*** Error code %d\n\n", bi->retcode);
+			while (bi->files != NULL) {
+				f = bi->files;
+				LL_DELETE(bi->files, f);
+				free(f->path);
+				free(f);
+			}
+		}
+		free(pi->batch);
 	}
 
 	/*
-	 * Finalize and close the log file
+	 * Finalize and close the log files
 	 */
-	if (flags.fast != 1) {
-		graph_dump_log(g, s.log);
-		log_close(s.log, root);
+	unload_shards(&s);
+	/* All the subdirs were evaluated, unless there is a cycle */
+	log_text_finish(g, ntargets == 0 && !s.cycle && complete);
+	if (flags.fast != 1)
 		ipc_close(s.pfd[0].fd);
-	}
+	free(s.targets);
 	free(s.pfd);
 	free(s.pi);
 	return error;
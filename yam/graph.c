@@ -24,7 +24,7 @@
 
 #include "yam.h"
 
-static void
+void
 nodes_add(struct nodes *ns, struct node *n)
 {
 	if (ns->len >= ns->cap) {
@@ -32,55 +32,211 @@ nodes_add(struct nodes *ns, struct node *n)
 			ns->cap = 2;
 		else
 			ns->cap *= 2;
-		ns->nodes = realloc(ns->nodes, sizeof(struct node) * ns->cap);
+		ns->nodes = realloc(ns->nodes, sizeof(struct node *) * ns->cap);
 	}
 	ns->nodes[ns->len] = n;
 	ns->len++;
 }
 
-static unsigned int
-node_mark_todo(struct node *n)
+static struct dep *
+deps_add(struct deps *ds, struct node *n)
+{
+	struct dep *dep;
+
+	if (ds->len >= ds->cap) {
+		if (ds->cap == 0)
+			ds->cap = 2;
+		else
+			ds->cap *= 2;
+		ds->deps = realloc(ds->deps, sizeof(struct dep) * ds->cap);
+	}
+	dep = &ds->deps[ds->len];
+	ds->len++;
+
+	dep->node = n;
+	dep->stamp.mtime = 0;
+	dep->stamp.size = 0;
+	dep->order = 0;
+
+	return dep;
+}
+
+void
+file_stamp(const char *path, struct stamp *stamp)
+{
+	struct stat st;
+
+	if (stat(path, &st) == 0) {
+		stamp->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+			st.st_mtim.tv_nsec;
+		stamp->size = st.st_size;
+	} else if (errno == ENOENT || errno == ENOTDIR) {
+		stamp->mtime = -1;
+		stamp->size = 0;
+	} else
+		perrorf("stat(%s)", path);
+}
+
+/* stat(2) only if necessary */
+void
+node_stat(struct node *n)
+{
+	if (n->stamp.mtime != 0)
+		return;
+
+	file_stamp(n->name, &n->stamp);
+}
+
+static bool
+stamp_equal(const struct stamp *a, const struct stamp *b)
+{
+	return a->mtime == b->mtime && a->size == b->size;
+}
+
+/*
+ * Whether the stamp of an explicit dependency is part of the state of the
+ * job: neither order-only dependencies nor aliases are, an alias makes its
+ * parents out of date when one of its own dependencies is.
+ */
+bool
+dep_stamped(const struct dep *dep)
+{
+	return dep->order == 0 && dep->node->phony == 0;
+}
+
+/*
+ * Whether the job `c', or one of its outputs, is in the set `ds'.
+ */
+static bool
+depset_has(const struct depset *ds, const struct node *c)
+{
+	size_t i;
+
+	for (i = 0; ds != NULL && i < ds->len; i++) {
+		if (ds->deps[i].node == c || ds->deps[i].node->job == c)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Whether one of the dependencies of the set changed, computed only once
+ * for all the jobs sharing it.
+ */
+static bool
+depset_dirty(struct depset *ds)
+{
+	struct dep *dep;
+	size_t i;
+
+	if (ds->state != DEPSET_UNKNOWN)
+		return ds->state == DEPSET_DIRTY;
+
+	ds->state = DEPSET_CLEAN;
+	for (i = 0; i < ds->len; i++) {
+		dep = &ds->deps[i];
+		node_stat(dep->node);
+		if (!stamp_equal(&dep->node->stamp, &dep->stamp)) {
+			ds->state = DEPSET_DIRTY;
+			break;
+		}
+	}
+
+	return ds->state == DEPSET_DIRTY;
+}
+
+/*
+ * Whether the job has to run again, its dependencies being up to date.
+ */
+static bool
+node_dirty(struct node *n)
 {
+	struct dep *dep;
+	struct node *out;
+	int64_t oldest;
 	size_t i;
-	unsigned int nb = 1;
 
 	/*
-	 * If we mark a node more than once, we will increment its parents more
-	 * than needed!
+	 * If the command has changed, mark it to do now and avoid stat(2)
+	 * calls.
 	 */
-	assert(n->todo != 1);
-	assert(n->type == NODE_JOB);
+	if (n->new_cmd == 1)
+		return true;
+
+	/* All the outputs must exist */
+	node_stat(n);
+	if (n->stamp.mtime < 0)
+		return true;
+	oldest = n->stamp.mtime;
+	for (i = 0; i < n->outputs.len; i++) {
+		out = n->outputs.nodes[i];
+		node_stat(out);
+		if (out->stamp.mtime < 0)
+			return true;
+		oldest = MIN(oldest, out->stamp.mtime);
+	}
 
-	n->todo = 1;
+	/*
+	 * Without a record in the log, fallback to comparing the mtimes with
+	 * the oldest output.
+	 * The record will be added if the target is up to date.
+	 */
+	if (n->logged == 0) {
+		for (i = 0; i < n->children.len; i++) {
+			dep = &n->children.deps[i];
+			if (!dep_stamped(dep))
+				continue;
+			node_stat(dep->node);
+			if (dep->node->stamp.mtime > oldest)
+				return true;
+		}
+		for (i = 0; n->implicit != NULL && i < n->implicit->len; i++) {
+			dep = &n->implicit->deps[i];
+			node_stat(dep->node);
+			if (dep->node->stamp.mtime > oldest)
+				return true;
+		}
+		return false;
+	}
 
-	for (i = 0; i < n->parents.len; i++) {
-		if (n->parents.nodes[i]->todo != 1)
-			nb += node_mark_todo(n->parents.nodes[i]);
+	/*
+	 * Otherwise, the outputs and all the dependencies must be as they were
+	 * when the job last ran. A dependency or an output missing from the
+	 * record has a zero stamp and never matches.
+	 */
+	if (!stamp_equal(&n->stamp, &n->log_stamp))
+		return true;
 
-		n->parents.nodes[i]->waiting++;
+	for (i = 0; i < n->outputs.len; i++) {
+		out = n->outputs.nodes[i];
+		if (!stamp_equal(&out->stamp, &out->log_stamp))
+			return true;
 	}
 
-	return nb;
-}
+	for (i = 0; i < n->children.len; i++) {
+		dep = &n->children.deps[i];
+		if (!dep_stamped(dep))
+			continue;
+		node_stat(dep->node);
+		if (!stamp_equal(&dep->node->stamp, &dep->stamp))
+			return true;
+	}
 
-/* stat(2) only if necessary */
-#define NODE_STAT(n, st)													\
-	if (n->mtime == 0) {													\
-		errno = 0;															\
-		if (stat(n->name, &st) == 0)										\
-			n->mtime = st.st_mtime;											\
-		else if (errno == ENOENT)											\
-			n->mtime = -1;													\
-		else																\
-			perror("stat()");												\
-	}																		\
+	if (n->implicit != NULL && depset_dirty(n->implicit))
+		return true;
+
+	return false;
+}
 
 static unsigned int
-node_compute(struct graph *g, struct node *n)
+node_compute(struct graph *g, struct node *n, struct node **jobs)
 {
-	struct stat st;
+	struct dep *dep;
+	struct node *c;
 	size_t i;
 	unsigned int nb = 0;
+	bool todo = false;
 
 	assert(n->type == NODE_JOB);
 
@@ -92,79 +248,207 @@ node_compute(struct graph *g, struct node *n)
 	 * Mark it as visited early to avoid cycles
 	 */
 	n->visited = 1;
+	n->waiting = 0;
 
-	/* depth first */
+	/*
+	 * Depth first. The jobs to do which are not built yet have to finish
+	 * before this one can start; the ones built earlier in this run only
+	 * make it out of date. An order-only dependency does only if the job
+	 * read it the last time it ran, or if it builds the dyndep file: the
+	 * dependencies it lists are not known yet.
+	 */
 	for (i = 0; i < n->children.len; i++) {
-		if (n->children.nodes[i]->type == NODE_JOB) {
-			nb += node_compute(g, n->children.nodes[i]);
+		dep = &n->children.deps[i];
+		c = dep->node;
+		if (c->type != NODE_JOB)
+			continue;
+		nb += node_compute(g, c, jobs);
+		if (c->todo == 1) {
+			if (dep->order == 0 || depset_has(n->implicit, c) ||
+				(n->dyndep != NULL &&
+				 (n->dyndep == c || n->dyndep->job == c)))
+				todo = true;
+			if (c->finished == 0)
+				n->waiting++;
 		}
 	}
 
-	/*
-	 * The current node may have been marked to do during the depth
-	 * traversal.
-	 */
-	if (n->todo != 0)
+	if (!todo && (n->phony == 1 || !node_dirty(n)))
 		return nb;
 
-	/*
-	 * If the command has changed, mark it to do now and avoid stat(2)
-	 * calls.
-	 */
-	if (n->new_cmd == 1)
-		return node_mark_todo(n);
+	n->todo = 1;
+	if (n->waiting == 0)
+		DL_APPEND(*jobs, n);
+
+	/* An alias is not counted as a job */
+	return nb + (n->phony == 1 ? 0 : 1);
+}
 
-	NODE_STAT(n, st);
+struct tarjan {
+	unsigned int index;
+	unsigned int scc;
+	struct nodes stack;
+};
 
-	/*
-	 * Test if this target is newer than the log file.
-	 * If it is the case, we rebuild it to get another chance to discover its
-	 * dependencies.
-	 * If the mtime of the log file is < 0, there was no log file.
-	 */
-	if (g->log_mtime > 0 && n->mtime > g->log_mtime) {
-		fprintf(stderr, "marking %s to do because it is newer than the log "
-				"file (should not happen)\n", n->name);
-		return node_mark_todo(n);
+/*
+ * Find a path from `n' back to `to' without leaving their strongly connected
+ * component. `lowlink' is not needed anymore, it is reused as a mark.
+ */
+static bool
+cycle_path(struct node *n, struct node *to, struct nodes *path)
+{
+	struct node *c;
+	size_t i;
+
+	nodes_add(path, n);
+	n->lowlink = 0;
+
+	for (i = 0; i < n->children.len; i++) {
+		c = n->children.deps[i].node;
+		if (c->type != NODE_JOB || c->scc != to->scc)
+			continue;
+		if (c == to)
+			return true;
+		if (c->lowlink != 0 && cycle_path(c, to, path))
+			return true;
 	}
 
+	path->len--;
+	return false;
+}
+
+static int
+strongconnect(struct tarjan *t, struct node *n)
+{
+	struct nodes path = { NULL, 0, 0 };
+	struct node *c;
+	size_t i;
+	int loop = 0;
+
+	n->index = n->lowlink = ++t->index;
+	nodes_add(&t->stack, n);
+
 	for (i = 0; i < n->children.len; i++) {
-		NODE_STAT(n->children.nodes[i], st);
-		if (n->children.nodes[i]->mtime > n->mtime)
-			return node_mark_todo(n);
+		c = n->children.deps[i].node;
+		if (c->type != NODE_JOB)
+			continue;
+		if (c == n)
+			loop = 1;
+
+		if (c->index == 0) {
+			if (strongconnect(t, c) != 0)
+				return -1;
+			n->lowlink = MIN(n->lowlink, c->lowlink);
+		} else if (c->scc == 0) {
+			/* `c' is still on the stack */
+			n->lowlink = MIN(n->lowlink, c->index);
+		}
 	}
 
-	return 0;
+	if (n->lowlink != n->index)
+		return 0;
+
+	/* `n' is the root of a strongly connected component, pop it */
+	t->scc++;
+	do {
+		c = t->stack.nodes[--t->stack.len];
+		c->scc = t->scc;
+		if (c != n)
+			loop = 1;
+	} while (c != n);
+
+	if (loop == 0)
+		return 0;
+
+	cycle_path(n, n, &path);
+	fprintf(stderr, "There is a cycle in the graph: ");
+	for (i = 0; i < path.len; i++)
+		fprintf(stderr, "%s -> ", path.nodes[i]->name);
+	fprintf(stderr, "%s\n", n->name);
+	free(path.nodes);
+
+	return -1;
 }
 
 void
 graph_init(struct graph *g)
 {
 	g->index = NULL;
+	g->depsets = NULL;
+	g->depsets_list = NULL;
 	g->subdirs = NULL;
-	g->to_visit = NULL;
+	g->pools = NULL;
 }
 
 void
 graph_free(struct graph *g)
 {
 	struct node *n, *tmp;
+	struct depset *ds;
 	struct subdir *subdir;
+	struct setref *ref, *reftmp;
+	struct jobpool *pool, *pooltmp;
 
 	HASH_ITER(hh, g->index, n, tmp) {
 		HASH_DEL(g->index, n);
 		free(n->name);
 		free(n->cmd);
-		free(n->children.nodes);
+		free(n->children.deps);
 		free(n->parents.nodes);
+		free(n->outputs.nodes);
+		free(n->depfile);
+		free(n->worker);
+		free(n->rspfile);
+		free(n->rspcontent);
 		free(n);
 	}
 
+	HASH_CLEAR(hh, g->depsets);
+	while (g->depsets_list != NULL) {
+		ds = g->depsets_list;
+		LL_DELETE(g->depsets_list, ds);
+		free(ds->deps);
+		free(ds);
+	}
+
 	while (g->subdirs != NULL) {
 		subdir = g->subdirs;
 		LL_DELETE(g->subdirs, subdir);
+		HASH_ITER(hh, subdir->sets, ref, reftmp) {
+			HASH_DEL(subdir->sets, ref);
+			free(ref);
+		}
+		free(subdir->jobs.nodes);
+		free(subdir->blocked.nodes);
 		free(subdir);
 	}
+
+	HASH_ITER(hh, g->pools, pool, pooltmp) {
+		HASH_DEL(g->pools, pool);
+		free(pool->name);
+		free(pool);
+	}
+}
+
+/*
+ * Return the pool `name', created without limit if it does not exist.
+ */
+struct jobpool *
+graph_pool(struct graph *g, const char *name)
+{
+	struct jobpool *pool;
+
+	HASH_FIND_STR(g->pools, name, pool);
+	if (pool != NULL)
+		return pool;
+
+	if ((pool = calloc(1, sizeof(struct jobpool))) == NULL)
+		die("calloc()");
+	if ((pool->name = strdup(name)) == NULL)
+		die("strdup()");
+	HASH_ADD_KEYPTR(hh, g->pools, pool->name, strlen(pool->name), pool);
+
+	return pool;
 }
 
 struct node *
@@ -185,72 +469,243 @@ graph_get(struct graph *g, const char *key, bool create)
 	return n;
 }
 
-void
+struct dep *
 graph_add_dep(struct graph *g, struct node *n, const char *name, int type)
 {
 	struct node *dep;
 
 	dep = graph_get(g, name, true);
 
+	/* Depend on the job building it */
+	if (dep->type == NODE_OUTPUT)
+		dep = dep->job;
+
 	/*
 	 * If an implicit dep point to a job, it should be an explicit one.
 	 * Do not add this one because it will confuse the user (and the lint
 	 * option) if the build succeed with a missing dependency.
 	 */
 	if (dep->type == NODE_JOB && type == NODE_DEP_IMPLICIT)
-		return;
+		return NULL;
 
 	/* Do not overwrite the type */
 	if (dep->type == NODE_UNKNOWN)
 		dep->type = type;
 
-	nodes_add(&n->children, dep);
 	nodes_add(&dep->parents, n);
+	return deps_add(&n->children, dep);
+}
+
+/*
+ * Declare `name' as another output of the job `n'. The jobs which already
+ * depend on it, declared before `n', now depend on `n'.
+ * Return -1 if it is already declared by another job.
+ */
+int
+graph_add_output(struct graph *g, struct node *n, const char *name)
+{
+	struct node *out;
+	struct node *p;
+	size_t i, j;
+
+	out = graph_get(g, name, true);
+	if (out->type == NODE_JOB || (out->type == NODE_OUTPUT && out->job != n)) {
+		fprintf(stderr, "%s is an output of two jobs\n", name);
+		return -1;
+	}
+	out->type = NODE_OUTPUT;
+	out->job = n;
+	nodes_add(&n->outputs, out);
+
+	for (i = 0; i < out->parents.len; i++) {
+		p = out->parents.nodes[i];
+		for (j = 0; j < p->children.len; j++) {
+			if (p->children.deps[j].node != out)
+				continue;
+			p->children.deps[j].node = n;
+			nodes_add(&n->parents, p);
+		}
+	}
+	out->parents.len = 0;
+
+	return 0;
+}
+
+static int
+dep_cmp(const void *a, const void *b)
+{
+	const struct dep *da = a;
+	const struct dep *db = b;
+
+	return strcmp(da->node->name, db->node->name);
+}
+
+static bool
+depset_equal(const struct depset *ds, const struct dep *deps, size_t len)
+{
+	size_t i;
+
+	if (ds->len != len)
+		return false;
+
+	for (i = 0; i < len; i++) {
+		if (ds->deps[i].node != deps[i].node ||
+			!stamp_equal(&ds->deps[i].stamp, &deps[i].stamp))
+			return false;
+	}
+
+	return true;
 }
 
+/*
+ * Return the set made of `deps', which are sorted and owned by the graph
+ * from now on.
+ */
+struct depset *
+graph_depset(struct graph *g, struct dep *deps, size_t len)
+{
+	struct depset *ds;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	bool collision;
+	size_t i;
+
+	qsort(deps, len, sizeof(struct dep), dep_cmp);
+
+	for (i = 0; i < len; i++) {
+		hash ^= deps[i].node->hh.hashv;
+		hash *= 0x100000001b3ULL;
+		hash ^= (uint64_t)deps[i].stamp.mtime;
+		hash *= 0x100000001b3ULL;
+		hash ^= (uint64_t)deps[i].stamp.size;
+		hash *= 0x100000001b3ULL;
+	}
+
+	HASH_FIND(hh, g->depsets, &hash, sizeof(hash), ds);
+	if (ds != NULL && depset_equal(ds, deps, len)) {
+		free(deps);
+		return ds;
+	}
+	collision = ds != NULL;
+
+	if ((ds = calloc(1, sizeof(struct depset))) == NULL)
+		die("calloc()");
+	ds->hash = hash;
+	ds->deps = deps;
+	ds->len = len;
+	LL_PREPEND(g->depsets_list, ds);
+
+	/* In case of a collision, only the first set is in the index */
+	if (!collision)
+		HASH_ADD(hh, g->depsets, hash, sizeof(hash), ds);
+
+	return ds;
+}
+
+/*
+ * Find the jobs to do among `n' and the jobs it depends on, and append the
+ * ones which can start now to `jobs'. The jobs already computed are skipped,
+ * so the graph can be computed a part at a time.
+ */
 unsigned int
-graph_compute(struct graph *g, struct node **jobs)
+graph_compute(struct graph *g, struct node *n, struct node **jobs)
 {
+	return node_compute(g, n, jobs);
+}
+
+/*
+ * Look for a cycle between the jobs using Tarjan's strongly connected
+ * components algorithm, and print the first one found.
+ */
+int
+graph_check_cycles(struct graph *g)
+{
+	struct tarjan t = { 0, 0, { NULL, 0, 0 } };
 	struct node *n;
-	struct node *tmp;
-	unsigned int nb = 0;
+	int error = 0;
 
-	*jobs = NULL;
+	for (n = g->index; n != NULL; n = n->hh.next)
+		n->index = n->lowlink = n->scc = 0;
 
-	HASH_ITER(hh, g->index, n, tmp) {
-		if (n->todo != 0 || n->type != NODE_JOB)
+	for (n = g->index; n != NULL; n = n->hh.next) {
+		if (n->type != NODE_JOB || n->index != 0)
 			continue;
-
-		nb += node_compute(g, n);
+		if ((error = strongconnect(&t, n)) != 0)
+			break;
 	}
 
-	HASH_ITER(hh, g->index, n, tmp) {
-		if (n->type == NODE_JOB && n->todo == 1 && n->waiting == 0)
-			DL_APPEND(*jobs, n);
+	free(t.stack.nodes);
+
+	return error;
+}
+
+/*
+ * Return the set with the current stamps of its dependencies.
+ */
+struct depset *
+graph_restamp(struct graph *g, struct depset *ds)
+{
+	struct dep *deps;
+	size_t i;
+
+	if ((deps = malloc(sizeof(struct dep) * ds->len)) == NULL)
+		die("malloc()");
+
+	for (i = 0; i < ds->len; i++) {
+		deps[i].node = ds->deps[i].node;
+		node_stat(deps[i].node);
+		deps[i].stamp = deps[i].node->stamp;
 	}
 
-	return nb;
+	return graph_depset(g, deps, ds->len);
 }
 
 int
-graph_dump_log(struct graph *g, FILE *log)
+graph_dump_log(struct graph *g, struct subdir *sd, struct log *log)
 {
 	struct node *n;
-	struct node *tmp;
 	struct node *dep;
-	size_t i;
+	struct stamp none = { 0, 0 };
+	size_t i, j;
 
-	HASH_ITER(hh, g->index, n, tmp) {
-		if (n->type == NODE_JOB && n->todo == 0) {
-			log_entry_start(log, n->name, n->cmd);
-			for (i = 0; i < n->children.len; i++) {
-				dep = n->children.nodes[i];
-				if (dep->type == NODE_DEP_IMPLICIT) {
-					log_entry_dep(log, dep->name);
-				}
+	/*
+	 * Jobs that have been built are already in the journal, only add the
+	 * ones that are up to date but were not in the log.
+	 * The jobs left to do keep what the old text log found they read, with
+	 * a stamp which never matches so they still run.
+	 */
+	for (j = 0; j < sd->jobs.len; j++) {
+		n = sd->jobs.nodes[j];
+		if (n->subdir != sd || n->wanted == 0 || n->logged == 1 ||
+			n->phony == 1)
+			continue;
+		if (n->todo == 1 && (n->finished == 1 || n->implicit == NULL))
+			continue;
+		if (n->todo == 1) {
+			log_entry_set(log, n->implicit);
+			log_entry_start(log, n->name, log_cmd_hash(n), &none,
+							n->implicit);
+		} else {
+			node_stat(n);
+			if (n->implicit != NULL) {
+				n->implicit = graph_restamp(g, n->implicit);
+				log_entry_set(log, n->implicit);
 			}
-			log_entry_finish(log);
+			log_entry_start(log, n->name, log_cmd_hash(n), &n->stamp,
+							n->implicit);
+		}
+		for (i = 0; i < n->children.len; i++) {
+			if (!dep_stamped(&n->children.deps[i]))
+				continue;
+			dep = n->children.deps[i].node;
+			node_stat(dep);
+			log_entry_dep(log, dep->name, &dep->stamp, NODE_DEP_EXPLICIT);
+		}
+		for (i = 0; i < n->outputs.len; i++) {
+			dep = n->outputs.nodes[i];
+			node_stat(dep);
+			log_entry_dep(log, dep->name, &dep->stamp, NODE_OUTPUT);
 		}
+		log_entry_finish(log);
 	}
 	return 0;
 }
@@ -269,11 +724,11 @@ dump_graphviz(struct graph *g, FILE *out)
 		fprintf(out, "\"%p\" [label=\"%s\"];\n", n, n->name);
 		if (n->children.len == 1) {
 			fprintf(out, "\"%p\" -> \"%p\" [label=\" %s\"];\n",
-					n->children.nodes[0], n, n->cmd);
+					n->children.deps[0].node, n, n->cmd);
 		} else if (n->children.len > 1) {
 			fprintf(out, "\"%p!\" [shape=ellipse, label=\"%s\"];\n", n, n->cmd);
 			for (i = 0; i < n->children.len; i++) {
-				fprintf(out, "\"%p\" -> \"%p!\";\n", n->children.nodes[i],
+				fprintf(out, "\"%p\" -> \"%p!\";\n", n->children.deps[i].node,
 						n);
 			}
 			fprintf(out, "\"%p!\" -> \"%p\";", n, n);
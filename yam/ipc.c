@@ -17,24 +17,39 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#define _WITH_GETLINE
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yam.h"
 
 #define WRAPPER_PATH "/usr/local/lib/libwrp.so"
 
-int
-ipc_listen(int num_clients)
+/*
+ * Environment of the jobs, not of yam itself: the Yamfiles may still be
+ * evaluated, and what they run must not be traced.
+ */
+static char _env_ipc[sizeof("YAM_IPC=") + MAXPATHLEN];
+static char _env_preload[] = "LD_PRELOAD=" WRAPPER_PATH;
+static bool _wrapper = false;
+
+/*
+ * Listen on a new socket, its path is copied in `path'.
+ */
+static int
+ipc_socket(char *path, int num_clients)
 {
 	struct sockaddr_un saun;
-	char template[] = "/tmp/yam-socket.XXXXXX";
-	char *path;
 	int fd;
 
-	path = mktemp(template);
+	strcpy(path, "/tmp/yam-socket.XXXXXX");
+	mktemp(path);
 
 	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
 		die("socket()");
@@ -49,9 +64,21 @@ ipc_listen(int num_clients)
 	if (listen(fd, num_clients) < 0)
 		die("liten()");
 
+	return fd;
+}
+
+int
+ipc_listen(int num_clients)
+{
+	char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+	int fd;
+
+	fd = ipc_socket(path, num_clients);
+
+	snprintf(_env_ipc, sizeof(_env_ipc), "YAM_IPC=%s", path);
+
 	if (access(WRAPPER_PATH, F_OK) == 0) {
-		setenv("YAM_IPC", path, 1);
-		setenv("LD_PRELOAD", WRAPPER_PATH, 1);
+		_wrapper = true;
 	} else {
 		printf("WARNING: %s does not exist, dependency learning disabled\n",
 				WRAPPER_PATH);
@@ -60,11 +87,156 @@ ipc_listen(int num_clients)
 	return fd;
 }
 
+/*
+ * Read the files reported by one process.
+ */
+static void
+ipc_read(int fd, void (*cb)(void *, const char *), void *arg)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	bool first = true;
+
+	fp = ipc_accept(fd);
+	while ((len = getline(&line, &cap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		/* The first line is the child id */
+		if (!first && line[0] == 'r' && line[1] == ' ')
+			cb(arg, line + 2);
+		first = false;
+	}
+	fclose(fp);
+	free(line);
+}
+
+/*
+ * Run `cmd' from `cwd', append what it writes on its standard output to
+ * `out', and call `cb' with the absolute path of each file it read.
+ * Return the exit status of the command, -1 if it could not run or was
+ * killed by a signal, and set `traced' to whether the files could be known.
+ * Unlike the jobs, it is called by the threads evaluating the Yamfiles.
+ */
+int
+ipc_run(const char *cmd, const char *cwd, UT_string *out, bool *traced,
+		void (*cb)(void *, const char *), void *arg)
+{
+	char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+	char env_ipc[sizeof(_env_ipc)];
+	struct pollfd pfd[2];
+	char buf[4096];
+	int fildes[2];
+	ssize_t sz;
+	pid_t pid;
+	int status;
+
+	*traced = access(WRAPPER_PATH, F_OK) == 0;
+
+	pfd[1].fd = -1;
+	pfd[1].events = POLLIN;
+	if (*traced) {
+		pfd[1].fd = ipc_socket(path, 16);
+		snprintf(env_ipc, sizeof(env_ipc), "YAM_IPC=%s", path);
+	}
+
+	if (pipe(fildes) != 0) {
+		perror("pipe()");
+		status = -1;
+		goto cleanup;
+	}
+
+	if ((pid = fork()) < 0) {
+		perror("fork()");
+		close(fildes[0]);
+		close(fildes[1]);
+		status = -1;
+		goto cleanup;
+	}
+
+	/* child */
+	if (pid == 0) {
+		close(fildes[0]);
+		dup2(fildes[1], 1); /* stdout */
+
+		if (*traced) {
+			putenv("YAM_CHILD_ID=0");
+			putenv(env_ipc);
+			putenv(_env_preload);
+		}
+
+		if (chdir(cwd) != 0)
+			die("chdir(%s)", cwd);
+
+		execl("/bin/sh", "sh", "-c", cmd, NULL);
+		perror("execl()");
+		_exit(127);
+	}
+
+	close(fildes[1]);
+	pfd[0].fd = fildes[0];
+	pfd[0].events = POLLIN;
+
+	while (pfd[0].fd != -1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll()");
+		}
+		if (pfd[1].revents & POLLIN)
+			ipc_read(pfd[1].fd, cb, arg);
+		if (pfd[0].revents & (POLLIN|POLLHUP)) {
+			if ((sz = read(pfd[0].fd, buf, sizeof(buf))) > 0)
+				utstring_bincpy(out, buf, sz);
+			else {
+				close(pfd[0].fd);
+				pfd[0].fd = -1;
+			}
+		}
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid()");
+		status = -1;
+	} else if (!WIFEXITED(status))
+		status = -1;
+	else
+		status = WEXITSTATUS(status);
+
+	/* The processes report their files when they exit */
+	while (pfd[1].fd != -1 && poll(&pfd[1], 1, 0) > 0 &&
+		   (pfd[1].revents & POLLIN))
+		ipc_read(pfd[1].fd, cb, arg);
+
+cleanup:
+	if (pfd[1].fd != -1) {
+		close(pfd[1].fd);
+		unlink(path);
+	}
+
+	return status;
+}
+
+/*
+ * Called by the job, after fork(2).
+ */
+void
+ipc_child(void)
+{
+	if (!_wrapper)
+		return;
+
+	putenv(_env_ipc);
+	putenv(_env_preload);
+}
+
 void
 ipc_close(int fd)
 {
 	close(fd);
-	unlink(getenv("YAM_IPC"));
+	unlink(_env_ipc + sizeof("YAM_IPC=") - 1);
+	_wrapper = false;
 }
 
 FILE *
@@ -15,11 +15,14 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #define _WITH_GETLINE
 #include <stdio.h>
@@ -29,131 +32,1883 @@
 
 #define LOG_FILETEMP ".yam.log.temp"
 #define LOG_FILE ".yam.log"
+#define LOG_FILETEXT ".yam.log.text"
+#define LOG_FILETEXTTEMP ".yam.log.text.temp"
 #define LOG_EOF "-- YAM LOG EOF --"
+#define JOURNAL_FILETEMP ".yam.journal.temp"
+#define JOURNAL_FILE ".yam.journal"
+#define LOCK_FILE ".yam.lock"
 
-FILE *
-log_open(const char *dir)
+/*
+ * Each subdir keeps the state of the jobs it declares in its own files, so
+ * only the ones needed by the build are loaded and written. They are locked
+ * as the subdirs are evaluated, not in the order of their paths: a build
+ * which would deadlock with another one gives up, see log_lock().
+ *
+ * The state of the previous builds is kept in two files:
+ *
+ * - the log, compacted from time to time and mapped in memory when loaded,
+ * - the journal, where a record is appended each time a job finishes.
+ *   A record of the journal supersedes the previous ones for the same
+ *   target, be they in the journal or in the log.
+ *
+ * The log is only rewritten when the number of superseded (dead) records
+ * exceeds LOG_COMPACT_MIN and the number of live ones, once it is loaded.
+ *
+ * All the integers are in host byte order, files written by another
+ * architecture are simply ignored.
+ *
+ * Layout of the log:
+ *
+ *   header
+ *   strings: `nstrings' uint32_t offsets followed by the NUL terminated
+ *            strings, each path is stored only once
+ *   sets:    `nsets' uint32_t offsets followed by the sets of implicit
+ *            dependencies, one struct log_set followed by one struct log_dep
+ *            per dependency. Each set is stored only once.
+ *   records: one struct log_record per target, followed by one struct
+ *            log_dep per explicit dependency
+ *   index:   open addressing hash table of `nslots' struct log_slot, from
+ *            the name of a target to its record
+ *
+ * Only the records of the targets present in the graph are decoded.
+ *
+ * Layout of the journal:
+ *
+ *   header
+ *   records: one struct journal_record per finished job or new set of
+ *            implicit dependencies, followed by the name of the target, then
+ *            one struct journal_dep per dependency followed by its name.
+ *            Names are NUL terminated and padded to 8 bytes. Jobs refer to
+ *            their set by its hash, and a set is only added once.
+ *
+ * Along with the dependencies, explicit or implicit, is stored the stamp
+ * they had when the job ran. The target is up to date as long as they all
+ * still have the same stamp. The other outputs of a job are stored along
+ * with its explicit dependencies, with the type NODE_OUTPUT.
+ */
+#define LOG_MAGIC "YAMLOG\0\0"
+#define LOG_VERSION 3
+#define JOURNAL_MAGIC "YAMJRNL\0"
+#define JOURNAL_VERSION 3
+
+#define LOG_COMPACT_MIN 1024
+
+struct log_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nstrings;
+	uint32_t nsets;
+	uint32_t nrecords;
+	uint32_t nslots;
+	uint32_t pad;
+	uint64_t strings;
+	uint64_t sets;
+	uint64_t records;
+	uint64_t index;
+	uint64_t size;
+};
+
+struct log_dep {
+	uint32_t name;
+	uint32_t type;
+	struct stamp stamp;
+};
+
+struct log_set {
+	uint32_t ndeps;
+	uint32_t pad;
+	struct log_dep deps[];
+};
+
+#define SET_NONE UINT32_MAX
+
+struct log_record {
+	uint32_t name;
+	uint32_t ndeps;
+	uint64_t cmd;
+	struct stamp stamp;
+	uint32_t set;
+	uint32_t pad;
+	struct log_dep deps[];
+};
+
+#define SLOT_EMPTY UINT32_MAX
+
+struct log_slot {
+	uint32_t hash;
+	uint32_t record;
+};
+
+struct journal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+};
+
+#define JOURNAL_JOB 0
+#define JOURNAL_SET 1
+
+struct journal_record {
+	uint32_t size;
+	uint32_t type;
+	uint32_t ndeps;
+	uint32_t pad;
+	uint64_t hash;	/* of the command for a job, of the set for a set */
+	uint64_t set;	/* hash of the set of a job, 0 if it has none */
+	struct stamp stamp;
+	char name[];
+};
+
+struct journal_dep {
+	struct stamp stamp;
+	uint32_t type;
+	uint32_t len;
+	char name[];
+};
+
+struct buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct table_string {
+	char *str;
+	uint32_t id;
+	UT_hash_handle hh;
+};
+
+/* A log being written */
+struct table {
+	struct table_string *index;
+	uint32_t nstrings;
+	struct buf offsets;
+	struct buf strings;
+	uint32_t nsets;
+	struct buf set_offsets;
+	struct buf sets;
+	uint32_t nrecords;
+	struct buf records;
+	struct buf slots;
+	size_t current;
+};
+
+/*
+ * The journal, open for appending. It is only opened when the first record
+ * is added, after the log is replaced if it is compacted.
+ */
+struct log {
+	struct subdir *sd;
+	/* Journal, opened by the writer when the first record comes */
+	int fd;
+	int error;
+	struct buf current;
+	/* The compacted log, written by the writer before any record */
+	struct table *compact;
+
+	/* Guarded by _writer_mtx */
+	struct buf pending;
+	/* In the queue of the writer, or being written by it */
+	int queued;
+	int busy;
+	struct log *next;
+};
+
+/*
+ * The records of all the subdirs are written in the background by a single
+ * thread, running as long as a log is open.
+ */
+static pthread_t _writer;
+static pthread_mutex_t _writer_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when there are records to write, or the writer shall stop */
+static pthread_cond_t _writer_cond = PTHREAD_COND_INITIALIZER;
+/* Signaled when the records of a log have been written */
+static pthread_cond_t _writer_idle = PTHREAD_COND_INITIALIZER;
+static struct log *_writer_queue = NULL;
+static unsigned int _writer_nlogs = 0;
+static bool _writer_done = false;
+
+/* Last record of a target in the journal */
+struct journal_entry {
+	const char *name;
+	const struct journal_record *record;
+	UT_hash_handle hh;
+};
+
+/* Set of implicit dependencies in the journal */
+struct journal_set {
+	uint64_t hash;
+	const struct journal_record *record;
+	struct depset *set;
+	UT_hash_handle hh;
+};
+
+/*
+ * Write in `buf' the path of the file `name' of the subdir `dir'. Return -1
+ * if it does not fit.
+ */
+static int
+log_path(char *buf, size_t len, const char *dir, const char *name)
+{
+	int n;
+
+	n = snprintf(buf, len, "%s/%s", dir, name);
+	if (n < 0 || (size_t)n >= len) {
+		fprintf(stderr, "%s/%s: path too long\n", dir, name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+buf_add(struct buf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->cap) {
+		if (b->cap == 0)
+			b->cap = 4096;
+		while (b->len + len > b->cap)
+			b->cap *= 2;
+		if ((b->data = realloc(b->data, b->cap)) == NULL)
+			die("realloc()");
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void
+buf_write(const struct buf *b, FILE *fp)
+{
+	/* The data of an empty buffer is NULL */
+	if (b->len > 0)
+		fwrite(b->data, 1, b->len, fp);
+}
+
+static void
+buf_pad(struct buf *b)
+{
+	static const char zero[8];
+
+	if (b->len % 8 != 0)
+		buf_add(b, zero, 8 - b->len % 8);
+}
+
+/* FNV-1a, going on from `h' */
+static uint64_t
+hash_str(uint64_t h, const char *str)
+{
+	for (; *str != '\0'; str++) {
+		h ^= (unsigned char)*str;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+uint64_t
+log_hash(const char *str)
+{
+	return hash_str(0xcbf29ce484222325ULL, str);
+}
+
+/*
+ * Hash of the command of `n', along with the content of its response file
+ * if any, as if separated by a NUL.
+ */
+uint64_t
+log_cmd_hash(const struct node *n)
+{
+	uint64_t h = log_hash(n->cmd);
+
+	if (n->rspcontent != NULL)
+		h = hash_str(h * 0x100000001b3ULL, n->rspcontent);
+
+	return h;
+}
+
+/*
+ * Return the id of `str' in the string table, adding it if needed.
+ */
+static uint32_t
+table_string(struct table *t, const char *str)
+{
+	struct table_string *ts;
+	uint32_t offset;
+
+	HASH_FIND_STR(t->index, str, ts);
+	if (ts != NULL)
+		return ts->id;
+
+	offset = t->strings.len;
+	buf_add(&t->offsets, &offset, sizeof(offset));
+	buf_add(&t->strings, str, strlen(str) + 1);
+
+	ts = malloc(sizeof(struct table_string));
+	if (ts == NULL || (ts->str = strdup(str)) == NULL)
+		die("malloc()");
+	ts->id = t->nstrings++;
+	HASH_ADD_KEYPTR(hh, t->index, ts->str, strlen(ts->str), ts);
+
+	return ts->id;
+}
+
+static struct table *
+table_new(void)
+{
+	struct table *t;
+
+	if ((t = calloc(1, sizeof(struct table))) == NULL)
+		die("calloc()");
+
+	return t;
+}
+
+/*
+ * Return the id of the set in the table, adding it if needed.
+ */
+static uint32_t
+table_set(struct table *t, struct depset *ds)
+{
+	struct log_set ls;
+	struct log_dep d;
+	uint32_t offset;
+	size_t i;
+
+	if (ds->id != SET_NONE)
+		return ds->id;
+
+	offset = t->sets.len;
+	buf_add(&t->set_offsets, &offset, sizeof(offset));
+
+	ls.ndeps = ds->len;
+	ls.pad = 0;
+	buf_add(&t->sets, &ls, sizeof(ls));
+	for (i = 0; i < ds->len; i++) {
+		d.name = table_string(t, ds->deps[i].node->name);
+		d.type = NODE_DEP_IMPLICIT;
+		d.stamp = ds->deps[i].stamp;
+		buf_add(&t->sets, &d, sizeof(d));
+	}
+
+	ds->id = t->nsets++;
+	return ds->id;
+}
+
+static void
+table_entry_start(struct table *t, const char *name, uint64_t cmd,
+				  const struct stamp *stamp, struct depset *set)
+{
+	struct log_record r;
+	struct log_slot slot;
+
+	/*
+	 * The records are reallocated as they grow, so we only keep the offset
+	 * of the current one.
+	 */
+	t->current = t->records.len;
+
+	r.name = table_string(t, name);
+	r.ndeps = 0;
+	r.cmd = cmd;
+	r.stamp = *stamp;
+	r.set = set != NULL ? table_set(t, set) : SET_NONE;
+	r.pad = 0;
+	buf_add(&t->records, &r, sizeof(r));
+
+	slot.hash = (uint32_t)log_hash(name);
+	slot.record = t->current;
+	buf_add(&t->slots, &slot, sizeof(slot));
+	t->nrecords++;
+}
+
+static void
+table_entry_dep(struct table *t, const char *path, const struct stamp *stamp,
+				int type)
+{
+	struct log_record *r;
+	struct log_dep d;
+
+	d.name = table_string(t, path);
+	d.type = type;
+	d.stamp = *stamp;
+	buf_add(&t->records, &d, sizeof(d));
+
+	r = (struct log_record *)(t->records.data + t->current);
+	r->ndeps++;
+}
+
+static void
+table_entry_finish(struct table *t)
+{
+	buf_pad(&t->records);
+}
+
+static const char *
+log_str(const char *base, const struct log_header *h, uint32_t id)
+{
+	const uint32_t *offsets = (const uint32_t *)(base + h->strings);
+
+	return base + h->strings + h->nstrings * sizeof(uint32_t) + offsets[id];
+}
+
+/* Start of the sets, after their offsets */
+static uint64_t
+log_sets(const struct log_header *h)
+{
+	uint64_t off = h->sets + h->nsets * sizeof(uint32_t);
+
+	return off + (8 - off % 8) % 8;
+}
+
+/*
+ * Build the index: an open addressing hash table with at most 50% load.
+ * If a target was logged twice, the last record wins.
+ */
+static struct log_slot *
+table_build_index(struct table *t, uint32_t *nslots)
+{
+	struct log_slot *slots;
+	struct log_slot *s;
+	struct log_record *r, *o;
+	uint32_t i, j, n = 16;
+
+	while (n < t->nrecords * 2)
+		n *= 2;
+
+	if ((slots = malloc(n * sizeof(struct log_slot))) == NULL)
+		die("malloc()");
+	for (i = 0; i < n; i++) {
+		slots[i].hash = 0;
+		slots[i].record = SLOT_EMPTY;
+	}
+
+	for (i = 0; i < t->nrecords; i++) {
+		s = &((struct log_slot *)t->slots.data)[i];
+		r = (struct log_record *)(t->records.data + s->record);
+
+		for (j = s->hash & (n - 1); slots[j].record != SLOT_EMPTY;
+			 j = (j + 1) & (n - 1)) {
+			o = (struct log_record *)(t->records.data + slots[j].record);
+			if (o->name == r->name)
+				break;
+		}
+		slots[j] = *s;
+	}
+
+	*nslots = n;
+	return slots;
+}
+
+static void
+table_free(struct table *t)
+{
+	struct table_string *ts, *tmp;
+
+	HASH_ITER(hh, t->index, ts, tmp) {
+		HASH_DEL(t->index, ts);
+		free(ts->str);
+		free(ts);
+	}
+	free(t->offsets.data);
+	free(t->strings.data);
+	free(t->set_offsets.data);
+	free(t->sets.data);
+	free(t->records.data);
+	free(t->slots.data);
+	free(t);
+}
+
+/*
+ * Write the table in `from', renamed `to' once it is complete, and free it.
+ */
+static int
+table_close(struct table *t, const char *from, const char *to)
+{
+	struct log_header h;
+	struct log_slot *slots;
+	FILE *fp;
+	int error = 0;
+
+	if ((fp = fopen(from, "w")) == NULL) {
+		perrorf("fopen(%s)", from);
+		table_free(t);
+		return -1;
+	}
+
+	slots = table_build_index(t, &h.nslots);
+	buf_pad(&t->strings);
+
+	memcpy(h.magic, LOG_MAGIC, sizeof(h.magic));
+	h.version = LOG_VERSION;
+	h.nstrings = t->nstrings;
+	h.nsets = t->nsets;
+	h.nrecords = t->nrecords;
+	h.pad = 0;
+	h.strings = sizeof(h);
+	h.sets = h.strings + t->offsets.len + t->strings.len;
+	h.sets += (8 - h.sets % 8) % 8;
+	h.records = log_sets(&h) + t->sets.len;
+	h.index = h.records + t->records.len;
+	h.size = h.index + h.nslots * sizeof(struct log_slot);
+
+	fwrite(&h, sizeof(h), 1, fp);
+	buf_write(&t->offsets, fp);
+	buf_write(&t->strings, fp);
+	fseek(fp, h.sets, SEEK_SET);
+	buf_write(&t->set_offsets, fp);
+	fseek(fp, log_sets(&h), SEEK_SET);
+	buf_write(&t->sets, fp);
+	fseek(fp, h.records, SEEK_SET);
+	buf_write(&t->records, fp);
+	fwrite(slots, sizeof(struct log_slot), h.nslots, fp);
+	free(slots);
+
+	if (fflush(fp) != 0 || ferror(fp)) {
+		perrorf("fwrite(%s)", from);
+		error = -1;
+	}
+	fsync(fileno(fp));
+	fclose(fp);
+	table_free(t);
+
+	if (error == 0 && rename(from, to) != 0) {
+		perrorf("rename(%s, %s)", from, to);
+		error = -1;
+	}
+
+	return error;
+}
+
+static int
+write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, data, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write()");
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+journal_create(const char *dir)
+{
+	char from[MAXPATHLEN];
+	char to[MAXPATHLEN];
+	struct journal_header h;
+	int fd;
+
+	if (log_path(from, sizeof(from), dir, JOURNAL_FILETEMP) != 0 ||
+		log_path(to, sizeof(to), dir, JOURNAL_FILE) != 0)
+		return -1;
+
+	if ((fd = open(from, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		perrorf("open(%s)", from);
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+	h.version = JOURNAL_VERSION;
+
+	if (write_all(fd, (const char *)&h, sizeof(h)) != 0 || fsync(fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(from, to) != 0) {
+		perrorf("rename(%s, %s)", from, to);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Skip the padding after a name */
+static const char *
+journal_align(const char *base, const char *p)
+{
+	return p + (8 - (p - base) % 8) % 8;
+}
+
+/*
+ * Return the size of the valid part of the journal, 0 if the header itself
+ * is not valid.
+ * A record may be truncated if yam was interrupted while writing it.
+ */
+static size_t
+journal_check(const char *base, size_t size)
+{
+	const struct journal_header *h = (const struct journal_header *)base;
+	const struct journal_record *r;
+	const struct journal_dep *d;
+	const char *p, *end;
+	size_t off;
+	uint32_t i;
+
+	if (size < sizeof(*h) ||
+		memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic)) != 0 ||
+		h->version != JOURNAL_VERSION)
+		return 0;
+
+	for (off = sizeof(*h); off + sizeof(*r) <= size; off += r->size) {
+		r = (const struct journal_record *)(base + off);
+		if (r->size < sizeof(*r) || r->size % 8 != 0 ||
+			r->size > size - off ||
+			(r->type != JOURNAL_JOB && r->type != JOURNAL_SET))
+			break;
+
+		/* The name and the dependencies must be terminated */
+		end = base + off + r->size;
+		if ((p = memchr(r->name, '\0', end - r->name)) == NULL)
+			break;
+		p = journal_align(base, p + 1);
+		for (i = 0; i < r->ndeps; i++) {
+			d = (const struct journal_dep *)p;
+			if (p + sizeof(*d) > end || d->len >= (size_t)(end - d->name) ||
+				d->name[d->len] != '\0')
+				break;
+			p = journal_align(base, d->name + d->len + 1);
+		}
+		if (i < r->ndeps || p != end)
+			break;
+	}
+
+	return off;
+}
+
+static int journal_open(struct log *log);
+static void log_replace(struct log *log);
+
+static void *
+journal_writer(void *arg)
+{
+	struct log *log;
+	struct buf b = { NULL, 0, 0 };
+	struct buf tmp;
+
+	(void)arg;
+	pthread_mutex_lock(&_writer_mtx);
+	for (;;) {
+		while (_writer_queue == NULL && !_writer_done)
+			pthread_cond_wait(&_writer_cond, &_writer_mtx);
+		if ((log = _writer_queue) == NULL)
+			break;
+
+		LL_DELETE(_writer_queue, log);
+		log->queued = 0;
+		log->busy = 1;
+		tmp = log->pending;
+		log->pending = b;
+		b = tmp;
+		pthread_mutex_unlock(&_writer_mtx);
+
+		if (log->compact != NULL)
+			log_replace(log);
+		if (b.len > 0 && log->fd < 0 && log->error == 0 &&
+			journal_open(log) != 0) {
+			fprintf(stderr, "can not open the log of %s for writing\n",
+					log->sd->path);
+			log->error = -1;
+		}
+		if (b.len > 0 && log->error == 0 &&
+			write_all(log->fd, b.data, b.len) != 0)
+			log->error = -1;
+		b.len = 0;
+
+		pthread_mutex_lock(&_writer_mtx);
+		log->busy = 0;
+		pthread_cond_broadcast(&_writer_idle);
+	}
+	pthread_mutex_unlock(&_writer_mtx);
+
+	free(b.data);
+	return NULL;
+}
+
+static bool
+setref_find(struct subdir *sd, uint64_t hash)
+{
+	struct setref *ref;
+
+	HASH_FIND(hh, sd->sets, &hash, sizeof(hash), ref);
+	return ref != NULL;
+}
+
+static void
+setref_add(struct subdir *sd, uint64_t hash)
+{
+	struct setref *ref;
+
+	if (setref_find(sd, hash))
+		return;
+
+	if ((ref = malloc(sizeof(struct setref))) == NULL)
+		die("malloc()");
+	ref->hash = hash;
+	HASH_ADD(hh, sd->sets, hash, sizeof(ref->hash), ref);
+}
+
+static void
+setref_clear(struct subdir *sd)
+{
+	struct setref *ref, *tmp;
+
+	HASH_ITER(hh, sd->sets, ref, tmp) {
+		HASH_DEL(sd->sets, ref);
+		free(ref);
+	}
+}
+
+static struct table *log_compact(struct graph *g, struct subdir *sd);
+
+/*
+ * Open the log of `sd', once it is loaded. It is compacted right away, as
+ * the records are those just loaded, but written by the writer.
+ */
+struct log *
+log_open(struct graph *g, struct subdir *sd)
+{
+	struct log *log;
+
+	if ((log = calloc(1, sizeof(struct log))) == NULL)
+		return NULL;
+	log->sd = sd;
+	log->fd = -1;
+	log->compact = log_compact(g, sd);
+
+	pthread_mutex_lock(&_writer_mtx);
+	if (_writer_nlogs == 0 &&
+		pthread_create(&_writer, NULL, journal_writer, NULL) != 0) {
+		pthread_mutex_unlock(&_writer_mtx);
+		perror("pthread_create()");
+		if (log->compact != NULL)
+			table_free(log->compact);
+		free(log);
+		return NULL;
+	}
+	_writer_nlogs++;
+	if (log->compact != NULL) {
+		log->queued = 1;
+		LL_APPEND(_writer_queue, log);
+		pthread_cond_signal(&_writer_cond);
+	}
+	pthread_mutex_unlock(&_writer_mtx);
+
+	return log;
+}
+
+/*
+ * Open the journal of `log' to append to it, by the writer.
+ */
+static int
+journal_open(struct log *log)
+{
+	char path[MAXPATHLEN];
+	const char *dir = log->sd->path;
+	struct stat st;
+	void *base;
+	size_t valid = 0;
+	int fd;
+
+	if (log_path(path, sizeof(path), dir, JOURNAL_FILE) != 0)
+		return -1;
+
+	/*
+	 * Drop what follows the last valid record so we do not append after
+	 * garbage, and start a new journal if it is not valid at all.
+	 */
+	if ((fd = open(path, O_RDWR|O_APPEND)) >= 0) {
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (base != MAP_FAILED) {
+				valid = journal_check(base, st.st_size);
+				munmap(base, st.st_size);
+			}
+		}
+		if (valid == 0) {
+			close(fd);
+			fd = -1;
+		} else if (valid < (size_t)st.st_size && ftruncate(fd, valid) != 0) {
+			perrorf("ftruncate(%s)", path);
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (fd < 0) {
+		if (journal_create(dir) != 0)
+			return -1;
+		if ((fd = open(path, O_RDWR|O_APPEND)) < 0) {
+			perrorf("open(%s)", path);
+			return -1;
+		}
+	}
+
+	log->fd = fd;
+
+	return 0;
+}
+
+/*
+ * Add a set of implicit dependencies, before the first job referring to it.
+ */
+int
+log_entry_set(struct log *log, struct depset *set)
+{
+	struct journal_record r;
+	size_t i;
+
+	if (setref_find(log->sd, set->hash))
+		return 0;
+	setref_add(log->sd, set->hash);
+
+	memset(&r, 0, sizeof(r));
+	r.type = JOURNAL_SET;
+	r.hash = set->hash;
+
+	log->current.len = 0;
+	buf_add(&log->current, &r, sizeof(r));
+	buf_add(&log->current, "", 1);
+	buf_pad(&log->current);
+
+	for (i = 0; i < set->len; i++)
+		log_entry_dep(log, set->deps[i].node->name, &set->deps[i].stamp,
+					  NODE_DEP_IMPLICIT);
+
+	return log_entry_finish(log);
+}
+
+int
+log_entry_start(struct log *log, const char *name, uint64_t cmd,
+				const struct stamp *stamp, const struct depset *set)
+{
+	struct journal_record r;
+
+	r.size = 0;
+	r.type = JOURNAL_JOB;
+	r.ndeps = 0;
+	r.pad = 0;
+	r.hash = cmd;
+	r.set = set != NULL ? set->hash : 0;
+	r.stamp = *stamp;
+
+	log->current.len = 0;
+	buf_add(&log->current, &r, sizeof(r));
+	buf_add(&log->current, name, strlen(name) + 1);
+	buf_pad(&log->current);
+
+	return 0;
+}
+
+int
+log_entry_dep(struct log *log, const char *path, const struct stamp *stamp,
+			  int type)
+{
+	struct journal_record *r;
+	struct journal_dep d;
+
+	d.stamp = *stamp;
+	d.type = type;
+	d.len = strlen(path);
+	buf_add(&log->current, &d, sizeof(d));
+	buf_add(&log->current, path, d.len + 1);
+	buf_pad(&log->current);
+
+	r = (struct journal_record *)log->current.data;
+	r->ndeps++;
+
+	return 0;
+}
+
+/*
+ * Hand the record over to the writer, so we never block on I/O.
+ */
+int
+log_entry_finish(struct log *log)
+{
+	struct journal_record *r;
+
+	r = (struct journal_record *)log->current.data;
+	r->size = log->current.len;
+
+	pthread_mutex_lock(&_writer_mtx);
+	buf_add(&log->pending, log->current.data, log->current.len);
+	if (log->queued == 0) {
+		log->queued = 1;
+		LL_APPEND(_writer_queue, log);
+	}
+	pthread_cond_signal(&_writer_cond);
+	pthread_mutex_unlock(&_writer_mtx);
+
+	return 0;
+}
+
+/*
+ * Wait until the records of `log' are written, and close it. The writer
+ * stops with the last log.
+ */
+int
+log_close(struct log *log)
+{
+	int error;
+	bool last;
+
+	pthread_mutex_lock(&_writer_mtx);
+	while (log->queued == 1 || log->busy == 1)
+		pthread_cond_wait(&_writer_idle, &_writer_mtx);
+	if ((last = --_writer_nlogs == 0)) {
+		_writer_done = true;
+		pthread_cond_signal(&_writer_cond);
+	}
+	pthread_mutex_unlock(&_writer_mtx);
+
+	if (last) {
+		pthread_join(_writer, NULL);
+		_writer_done = false;
+	}
+
+	error = log->error;
+	if (log->fd >= 0) {
+		if (fsync(log->fd) != 0) {
+			perror("fsync()");
+			error = -1;
+		}
+		close(log->fd);
+	}
+
+	free(log->current.data);
+	free(log->pending.data);
+	free(log);
+
+	return error;
+}
+
+/*
+ * Return the log rewritten from the graph, to replace the one of `sd' along
+ * with a new journal, if there are enough dead records. NULL otherwise.
+ */
+static struct table *
+log_compact(struct graph *g, struct subdir *sd)
+{
+	struct table *t;
+	struct node *n;
+	struct node *out;
+	struct dep *dep;
+	struct depset *ds;
+	size_t i, j;
+
+	if (sd->log_dead <= LOG_COMPACT_MIN || sd->log_dead <= sd->log_live)
+		return NULL;
+
+	t = table_new();
+
+	LL_FOREACH(g->depsets_list, ds)
+		ds->id = SET_NONE;
+
+	for (j = 0; j < sd->jobs.len; j++) {
+		n = sd->jobs.nodes[j];
+		if (n->subdir != sd || n->logged == 0)
+			continue;
+
+		table_entry_start(t, n->name, n->log_cmd, &n->log_stamp,
+						  n->implicit);
+		for (i = 0; i < n->children.len; i++) {
+			dep = &n->children.deps[i];
+			if (!dep_stamped(dep))
+				continue;
+			table_entry_dep(t, dep->node->name, &dep->stamp,
+							NODE_DEP_EXPLICIT);
+		}
+		for (i = 0; i < n->outputs.len; i++) {
+			out = n->outputs.nodes[i];
+			table_entry_dep(t, out->name, &out->log_stamp, NODE_OUTPUT);
+		}
+		table_entry_finish(t);
+	}
+
+	/* The sets are added again to the new journal */
+	setref_clear(sd);
+	sd->log_dead = 0;
+
+	return t;
+}
+
+/*
+ * Replace the log of `log' with the compacted one and start a new journal,
+ * by the writer. If it fails, the records are still appended to the old
+ * journal, which goes along with the old log.
+ */
+static void
+log_replace(struct log *log)
+{
+	char from[MAXPATHLEN];
+	char to[MAXPATHLEN];
+	const char *dir = log->sd->path;
+	struct table *t = log->compact;
+
+	log->compact = NULL;
+	if (log_path(from, sizeof(from), dir, LOG_FILETEMP) != 0 ||
+		log_path(to, sizeof(to), dir, LOG_FILE) != 0) {
+		table_free(t);
+		return;
+	}
+
+	if (table_close(t, from, to) == 0)
+		journal_create(dir);
+}
+
+#define STATE_ENTRY 0
+#define STATE_CMD 1
+#define STATE_DEP 2
+#define STATE_EOF 3
+
+/* A record of the old text log */
+struct text_record {
+	char *name;
+	char *cmd;
+	const char **deps;
+	size_t ndeps;
+	UT_hash_handle hh;
+};
+
+/* A path of the old text log, most are dependencies of many jobs */
+struct text_path {
+	char *path;
+	UT_hash_handle hh;
+};
+
+/*
+ * The old text log, of the whole build, is read once for all the subdirs
+ * which do not have a log of their own yet.
+ */
+static bool _text_loaded = false;
+static bool _text_found = false;
+static struct text_record *_text_records = NULL;
+static struct text_path *_text_paths = NULL;
+
+static const char *
+text_path(const char *path)
+{
+	struct text_path *tp;
+
+	HASH_FIND_STR(_text_paths, path, tp);
+	if (tp != NULL)
+		return tp->path;
+
+	if ((tp = malloc(sizeof(struct text_path))) == NULL ||
+		(tp->path = strdup(path)) == NULL)
+		die("malloc()");
+	HASH_ADD_KEYPTR(hh, _text_paths, tp->path, strlen(tp->path), tp);
+
+	return tp->path;
+}
+
+static void
+text_record_free(struct text_record *r)
 {
-	char path[MAXPATHLEN];
+	free(r->name);
+	free(r->cmd);
+	free(r->deps);
+	free(r);
+}
 
-	snprintf(path, sizeof(path), "%s/%s", dir, LOG_FILETEMP);
+static void
+text_free(void)
+{
+	struct text_record *r, *rtmp;
+	struct text_path *tp, *tptmp;
 
-	return fopen(path, "w");
+	HASH_ITER(hh, _text_records, r, rtmp) {
+		HASH_DEL(_text_records, r);
+		text_record_free(r);
+	}
+	HASH_ITER(hh, _text_paths, tp, tptmp) {
+		HASH_DEL(_text_paths, tp);
+		free(tp->path);
+		free(tp);
+	}
+	_text_loaded = false;
+	_text_found = false;
 }
 
-int
-log_entry_start(FILE *log, const char *name, const char *cmd)
+/*
+ * Read the records of the old text log. A target logged twice keeps its
+ * last record. Return -1 if the log is truncated, keeping the records read.
+ */
+static int
+text_read(FILE *fp)
 {
-	fprintf(log, "%s\n%s\n", name, cmd);
-	return 0;
+	char *line = NULL;
+	size_t cap = 0;
+	size_t capdeps = 0;
+	ssize_t len;
+	unsigned int state = STATE_ENTRY;
+	struct text_record *r = NULL;
+	struct text_record *old;
+
+	while (state != STATE_EOF && (len = getline(&line, &cap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (state == STATE_ENTRY) {
+			if (strcmp(line, LOG_EOF) == 0) {
+				state = STATE_EOF;
+				continue;
+			}
+			if ((r = calloc(1, sizeof(struct text_record))) == NULL ||
+				(r->name = strdup(line)) == NULL)
+				die("calloc()");
+			capdeps = 0;
+			state = STATE_CMD;
+		} else if (state == STATE_CMD) {
+			if ((r->cmd = strdup(line)) == NULL)
+				die("strdup()");
+			state = STATE_DEP;
+		} else if (line[0] != '\0') {
+			if (r->ndeps == capdeps) {
+				capdeps = capdeps == 0 ? 16 : capdeps * 2;
+				if ((r->deps = realloc(r->deps,
+									   sizeof(char *) * capdeps)) == NULL)
+					die("realloc()");
+			}
+			r->deps[r->ndeps++] = text_path(line);
+		} else {
+			HASH_FIND_STR(_text_records, r->name, old);
+			if (old != NULL) {
+				HASH_DEL(_text_records, old);
+				text_record_free(old);
+			}
+			HASH_ADD_KEYPTR(hh, _text_records, r->name, strlen(r->name), r);
+			r = NULL;
+			state = STATE_ENTRY;
+		}
+	}
+	free(line);
+	if (r != NULL)
+		text_record_free(r);
+
+	return state == STATE_EOF ? 0 : -1;
 }
 
-int
-log_entry_dep(FILE *log, const char *path)
+/*
+ * Read the text log of the root, if there is one. It is moved aside once the
+ * root has a log of its own, for the subdirs which do not yet.
+ */
+static void
+text_load(void)
 {
-	fprintf(log, "%s\n", path);
-	return 0;
+	static const char *names[] = { LOG_FILETEXT, LOG_FILE };
+	char path[MAXPATHLEN];
+	char magic[sizeof(LOG_MAGIC) - 1];
+	FILE *fp = NULL;
+	size_t i;
+
+	_text_loaded = true;
+	for (i = 0; fp == NULL && i < sizeof(names) / sizeof(names[0]); i++) {
+		if (log_path(path, sizeof(path), ".", names[i]) != 0)
+			return;
+		if ((fp = fopen(path, "r")) == NULL && errno != ENOENT) {
+			perrorf("fopen(%s)", path);
+			return;
+		}
+	}
+	if (fp == NULL)
+		return;
+
+	/* The root may have been converted by another build meanwhile */
+	if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+		memcmp(magic, LOG_MAGIC, sizeof(magic)) == 0) {
+		fclose(fp);
+		return;
+	}
+
+	rewind(fp);
+	_text_found = true;
+	if (text_read(fp) != 0)
+		fprintf(stderr, "%s: truncated log, the records read are kept\n",
+				path);
+	fclose(fp);
 }
 
-int
-log_entry_finish(FILE *log)
+/*
+ * Load the records of the jobs of `sd' from the old text log, if there is
+ * one. It will be rewritten in the binary format before the build.
+ * As it does not have any stamp, the jobs are treated as missing from the
+ * log unless their command changed.
+ */
+static void
+log_load_text(struct graph *g, struct subdir *sd)
 {
-	fprintf(log, "\n");
-	return 0;
+	struct text_record *r;
+	struct node *n;
+	struct node *dep;
+	struct dep *deps = NULL;
+	size_t ndeps = 0;
+	size_t capdeps = 0;
+	size_t i, j;
+
+	if (!_text_loaded)
+		text_load();
+	if (!_text_found)
+		return;
+
+	for (j = 0; j < sd->jobs.len; j++) {
+		n = sd->jobs.nodes[j];
+		if (n->subdir != sd || n->phony == 1)
+			continue;
+		HASH_FIND_STR(_text_records, n->name, r);
+		if (r == NULL)
+			continue;
+
+		if (strcmp(n->cmd, r->cmd) != 0) {
+			n->new_cmd = 1;
+			n->logged = 1;
+			n->log_cmd = log_hash(r->cmd);
+			sd->log_live++;
+		}
+
+		for (i = 0; i < r->ndeps; i++) {
+			dep = graph_get(g, r->deps[i], true);
+			if (dep->type == NODE_JOB || dep->type == NODE_OUTPUT)
+				continue;
+			if (dep->type == NODE_UNKNOWN)
+				dep->type = NODE_DEP_IMPLICIT;
+			if (ndeps == capdeps) {
+				capdeps = capdeps == 0 ? 16 : capdeps * 2;
+				deps = realloc(deps, sizeof(struct dep) * capdeps);
+				if (deps == NULL)
+					die("realloc()");
+			}
+			deps[ndeps].node = dep;
+			deps[ndeps].stamp.mtime = 0;
+			deps[ndeps].stamp.size = 0;
+			ndeps++;
+		}
+
+		/* Without stamps, the set is only used to compare mtimes */
+		if (ndeps > 0) {
+			n->implicit = graph_depset(g, deps, ndeps);
+			deps = NULL;
+			capdeps = 0;
+		}
+		ndeps = 0;
+	}
+	free(deps);
+
+	/* Always convert an old log */
+	sd->log_dead = UINT32_MAX - sd->log_live;
 }
 
-int
-log_close(FILE *fp, const char *dir)
+/*
+ * Write the records of the text log which are still needed, if any, in
+ * place of the text logs.
+ */
+static int
+text_save(const struct text_record *keep)
 {
 	char from[MAXPATHLEN];
 	char to[MAXPATHLEN];
+	char magic[sizeof(LOG_MAGIC) - 1];
+	const struct text_record *r;
+	FILE *fp;
+	size_t i;
+	int error = 0;
 
-	snprintf(from, sizeof(from), "%s/%s", dir, LOG_FILETEMP);
-	snprintf(to, sizeof(to), "%s/%s", dir, LOG_FILE);
+	if (log_path(from, sizeof(from), ".", LOG_FILETEXTTEMP) != 0 ||
+		log_path(to, sizeof(to), ".", LOG_FILETEXT) != 0)
+		return -1;
 
-	fprintf(fp, "%s\n", LOG_EOF);
+	if (keep == NULL) {
+		if (unlink(to) != 0 && errno != ENOENT) {
+			perrorf("unlink(%s)", to);
+			return -1;
+		}
+	} else {
+		if ((fp = fopen(from, "w")) == NULL) {
+			perrorf("fopen(%s)", from);
+			return -1;
+		}
+		for (r = keep; r != NULL; r = r->hh.next) {
+			fprintf(fp, "%s\n%s\n", r->name, r->cmd);
+			for (i = 0; i < r->ndeps; i++)
+				fprintf(fp, "%s\n", r->deps[i]);
+			fprintf(fp, "\n");
+		}
+		fprintf(fp, "%s\n", LOG_EOF);
+		if (fflush(fp) != 0 || ferror(fp)) {
+			perrorf("fwrite(%s)", from);
+			error = -1;
+		}
+		fclose(fp);
+		if (error == 0 && rename(from, to) != 0) {
+			perrorf("rename(%s, %s)", from, to);
+			error = -1;
+		}
+		if (error != 0)
+			return -1;
+	}
 
-	fflush(fp);
-	fsync(fileno(fp));
+	/* The root did not convert its text log, its records are kept above */
+	if (log_path(to, sizeof(to), ".", LOG_FILE) != 0 ||
+		(fp = fopen(to, "r")) == NULL)
+		return 0;
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+		memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0) {
+		if (unlink(to) != 0) {
+			perrorf("unlink(%s)", to);
+			error = -1;
+		}
+	}
 	fclose(fp);
-	rename(from, to);
+
+	return error;
+}
+
+/*
+ * Once the build is over, drop from the old text log the records of the jobs
+ * whose subdir has a log now: it is never read for them again. If `all' the
+ * subdirs were evaluated, the records of the jobs which are not declared
+ * anymore are dropped too. The text log is removed once it is empty.
+ */
+int
+log_text_finish(struct graph *g, bool all)
+{
+	struct text_record *keep = NULL;
+	struct text_record *r, *tmp;
+	struct node *n;
+	bool drop;
+	int error = 0;
+
+	if (_text_found && flags.fast != 1) {
+		HASH_ITER(hh, _text_records, r, tmp) {
+			n = graph_get(g, r->name, false);
+			if (n != NULL && n->type == NODE_JOB && n->wanted == 1)
+				drop = true;
+			else
+				drop = all && (n == NULL || n->type != NODE_JOB);
+			if (drop)
+				continue;
+			HASH_DEL(_text_records, r);
+			HASH_ADD_KEYPTR(hh, keep, r->name, strlen(r->name), r);
+		}
+		error = text_save(keep);
+		HASH_ITER(hh, keep, r, tmp) {
+			HASH_DEL(keep, r);
+			text_record_free(r);
+		}
+	}
+	text_free();
+
+	return error;
+}
+
+static int
+log_check(const char *base, size_t size)
+{
+	const struct log_header *h = (const struct log_header *)base;
+	const uint32_t *offsets;
+	uint64_t strsize;
+	uint32_t i;
+
+	if (h->version != LOG_VERSION || h->size != size)
+		return -1;
+
+	if (h->strings != sizeof(*h) ||
+		h->sets < h->strings + (uint64_t)h->nstrings * sizeof(uint32_t) ||
+		h->sets % 8 != 0 || h->records < log_sets(h) ||
+		h->records % 8 != 0 || h->index < h->records || h->index % 8 != 0 ||
+		h->index + (uint64_t)h->nslots * sizeof(struct log_slot) != size ||
+		h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0)
+		return -1;
+
+	/*
+	 * All the strings must start inside the table, which must end with a
+	 * NUL so they are all terminated.
+	 */
+	offsets = (const uint32_t *)(base + h->strings);
+	strsize = h->sets - h->strings - h->nstrings * sizeof(uint32_t);
+	for (i = 0; i < h->nstrings; i++)
+		if (offsets[i] >= strsize)
+			return -1;
+	if (strsize > 0 && base[h->sets - 1] != '\0')
+		return -1;
+
+	/* The dependencies of the sets are checked when they are decoded */
+	offsets = (const uint32_t *)(base + h->sets);
+	for (i = 0; i < h->nsets; i++)
+		if (offsets[i] % 8 != 0 ||
+			offsets[i] + sizeof(struct log_set) > h->records - log_sets(h))
+			return -1;
 
 	return 0;
 }
 
-#define STATE_ENTRY 0
-#define STATE_CMD 1
-#define STATE_DEP 2
-#define STATE_EOF 3
+/*
+ * Find the record of `name' in the index.
+ */
+static const struct log_record *
+log_find(const char *base, const struct log_header *h, const char *name)
+{
+	const struct log_slot *slots;
+	const struct log_record *r;
+	uint32_t hash;
+	uint32_t i;
 
-int
-log_load(const char *dir, struct graph *g)
+	slots = (const struct log_slot *)(base + h->index);
+	hash = (uint32_t)log_hash(name);
+
+	for (i = hash & (h->nslots - 1); slots[i].record != SLOT_EMPTY;
+		 i = (i + 1) & (h->nslots - 1)) {
+		if (slots[i].hash != hash)
+			continue;
+		if (slots[i].record % 8 != 0 ||
+		    slots[i].record + sizeof(*r) > h->index - h->records)
+			return NULL;
+		r = (const struct log_record *)(base + h->records + slots[i].record);
+		if (r->name < h->nstrings &&
+		    strcmp(log_str(base, h, r->name), name) == 0)
+			return r;
+	}
+
+	return NULL;
+}
+
+static void
+node_logged(struct node *n, uint64_t cmd, const struct stamp *stamp)
 {
-	char path[MAXPATHLEN];
-	struct stat st;
-	FILE *fp;
-	char *line = NULL;
-	size_t cap = 0;
-	ssize_t len;
-	unsigned int state = STATE_ENTRY;
-	struct node *n = NULL;
+	n->logged = 1;
+	n->log_cmd = cmd;
+	n->log_stamp = *stamp;
+	n->new_cmd = cmd != log_cmd_hash(n);
+	n->subdir->log_live++;
+}
 
-	snprintf(path, sizeof(path), "%s/%s", dir, LOG_FILE);
+/*
+ * Set the stamp an explicit dependency, or another output, had when the
+ * job ran.
+ */
+static void
+node_logged_dep(struct graph *g, struct node *n, const char *name,
+				const struct stamp *stamp, uint32_t type)
+{
+	struct node *dep;
+	size_t i;
 
-	if (stat(path, &st) != 0) {
-		g->log_mtime = -1;
-		if (errno == ENOENT) {
-			return 0;
-		} else {
-			perrorf("stat(%s)", path);
+	/* Not a dependency anymore */
+	if ((dep = graph_get(g, name, false)) == NULL)
+		return;
+
+	if (type == NODE_OUTPUT) {
+		if (dep->type == NODE_OUTPUT && dep->job == n)
+			dep->log_stamp = *stamp;
+		return;
+	}
+
+	/* Two outputs of a job are two dependencies on the job */
+	for (i = 0; i < n->children.len; i++)
+		if (n->children.deps[i].node == dep)
+			n->children.deps[i].stamp = *stamp;
+}
+
+/*
+ * Add an implicit dependency to a set being loaded. It may be the output of
+ * a job, read through an order-only dependency.
+ */
+static void
+logged_set_add(struct graph *g, struct deps *set, const char *name,
+			   const struct stamp *stamp)
+{
+	struct node *dep;
+	struct dep *d;
+
+	dep = graph_get(g, name, true);
+	if (dep->type == NODE_UNKNOWN)
+		dep->type = NODE_DEP_IMPLICIT;
+
+	if (set->len == set->cap) {
+		set->cap = set->cap == 0 ? 16 : set->cap * 2;
+		if ((set->deps = realloc(set->deps,
+								 sizeof(struct dep) * set->cap)) == NULL)
+			die("realloc()");
+	}
+	d = &set->deps[set->len++];
+	d->node = dep;
+	d->stamp = *stamp;
+}
+
+/*
+ * Decode the set `id' of the log, only once for all the jobs referring to it.
+ */
+static int
+log_set(struct graph *g, const char *base, const struct log_header *h,
+		struct depset **sets, uint32_t id)
+{
+	const uint32_t *offsets = (const uint32_t *)(base + h->sets);
+	const struct log_set *ls;
+	struct deps set = { NULL, 0, 0 };
+	uint32_t i;
+
+	if (sets[id] != NULL)
+		return 0;
+
+	ls = (const struct log_set *)(base + log_sets(h) + offsets[id]);
+	if ((const char *)&ls->deps[ls->ndeps] > base + h->records)
+		return -1;
+
+	for (i = 0; i < ls->ndeps; i++) {
+		if (ls->deps[i].name >= h->nstrings) {
+			free(set.deps);
 			return -1;
 		}
+		logged_set_add(g, &set, log_str(base, h, ls->deps[i].name),
+					   &ls->deps[i].stamp);
 	}
-	g->log_mtime = st.st_mtime;
 
-	fp = fopen(path, "r");
-	if (fp == NULL) {
-		perrorf("fopen(%s)", path);
-		return -1;
+	sets[id] = graph_depset(g, set.deps, set.len);
+	return 0;
+}
+
+/*
+ * Decode a set of the journal, only once for all the jobs referring to it.
+ */
+static void
+journal_set(struct graph *g, struct subdir *sd, const char *journal,
+			struct journal_set *js)
+{
+	const struct journal_record *jr = js->record;
+	const struct journal_dep *jd;
+	struct deps set = { NULL, 0, 0 };
+	const char *p;
+	uint32_t i;
+
+	if (js->set != NULL)
+		return;
+
+	p = journal_align(journal, jr->name + strlen(jr->name) + 1);
+	for (i = 0; i < jr->ndeps; i++) {
+		jd = (const struct journal_dep *)p;
+		logged_set_add(g, &set, jd->name, &jd->stamp);
+		p = journal_align(journal, jd->name + jd->len + 1);
 	}
 
-	while((len = getline(&line, &cap, fp)) > 0) {
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
+	js->set = graph_depset(g, set.deps, set.len);
 
-		if (state == STATE_ENTRY) {
-			if (strcmp(line, LOG_EOF) == 0) {
-				state = STATE_EOF;
-			} else {
-				/*
-				 * If the entry does not exist in the graph, the current entry
-				 * is old. Do not create a new node for this entry.
-				 * This means that `n' might be NULL.
-				 */
-				n = graph_get(g, line, false);
-				state = STATE_CMD;
+	/* Unless a file became a job, the set does not need to be added again */
+	if (js->set->hash == js->hash)
+		setref_add(sd, js->hash);
+}
+
+/*
+ * Apply the records of the log (if `base' is not NULL) and of the journal to
+ * the jobs of the graph. Return -1 if some records of the log are corrupted.
+ */
+static int
+log_apply(struct graph *g, struct subdir *sd, const char *base,
+		  const char *journal, size_t journal_size)
+{
+	const struct log_header *h = (const struct log_header *)base;
+	const struct log_record *r;
+	const struct journal_record *jr;
+	const struct journal_dep *jd;
+	struct journal_entry *entries = NULL;
+	struct journal_entry *e, *etmp;
+	struct journal_set *jsets = NULL;
+	struct journal_set *js, *jstmp;
+	struct depset **sets = NULL;
+	struct node *n;
+	const char *p;
+	size_t off;
+	size_t j;
+	uint32_t total = 0;
+	uint32_t i;
+	int error = 0;
+
+	/* Find the last record of each target in the journal */
+	for (off = sizeof(struct journal_header); off < journal_size;
+		 off += jr->size) {
+		jr = (const struct journal_record *)(journal + off);
+
+		if (jr->type == JOURNAL_SET) {
+			HASH_FIND(hh, jsets, &jr->hash, sizeof(jr->hash), js);
+			if (js == NULL) {
+				if ((js = calloc(1, sizeof(struct journal_set))) == NULL)
+					die("calloc()");
+				js->hash = jr->hash;
+				js->record = jr;
+				HASH_ADD(hh, jsets, hash, sizeof(js->hash), js);
 			}
-		} else if (state == STATE_CMD) {
-			state = STATE_DEP;
-			if (n != NULL && strcmp(n->cmd, line) != 0)
-				n->new_cmd = 1;
-		} else {
-			if (line[0] != '\0') {
-				if (n != NULL)
-					graph_add_dep(g, n, line, NODE_DEP_IMPLICIT);
-			} else {
-				state = STATE_ENTRY;
-				n = NULL;
+			continue;
+		}
+		total++;
+
+		HASH_FIND_STR(entries, jr->name, e);
+		if (e == NULL) {
+			if ((e = malloc(sizeof(struct journal_entry))) == NULL)
+				die("malloc()");
+			e->name = jr->name;
+			HASH_ADD_KEYPTR(hh, entries, e->name, strlen(e->name), e);
+		}
+		e->record = jr;
+	}
+
+	if (base != NULL) {
+		total += h->nrecords;
+		if ((sets = calloc(h->nsets + 1, sizeof(struct depset *))) == NULL)
+			die("calloc()");
+	}
+
+	for (j = 0; j < sd->jobs.len; j++) {
+		n = sd->jobs.nodes[j];
+		if (n->subdir != sd || n->phony == 1)
+			continue;
+
+		HASH_FIND_STR(entries, n->name, e);
+		if (e != NULL) {
+			jr = e->record;
+			node_logged(n, jr->hash, &jr->stamp);
+
+			if (jr->set != 0) {
+				HASH_FIND(hh, jsets, &jr->set, sizeof(jr->set), js);
+				if (js != NULL) {
+					journal_set(g, sd, journal, js);
+					n->implicit = js->set;
+				} else {
+					/* Lost set, rebuild the job */
+					n->log_stamp.mtime = 0;
+				}
+			}
+
+			p = journal_align(journal, jr->name + strlen(jr->name) + 1);
+			for (i = 0; i < jr->ndeps; i++) {
+				jd = (const struct journal_dep *)p;
+				node_logged_dep(g, n, jd->name, &jd->stamp, jd->type);
+				p = journal_align(journal, jd->name + jd->len + 1);
+			}
+			continue;
+		}
+
+		if (base == NULL || (r = log_find(base, h, n->name)) == NULL)
+			continue;
+
+		/* A corrupted record is skipped, and its job rebuilt */
+		if ((const char *)&r->deps[r->ndeps] > base + h->index) {
+			error = -1;
+			continue;
+		}
+
+		node_logged(n, r->cmd, &r->stamp);
+
+		if (r->set != SET_NONE) {
+			if (r->set >= h->nsets || log_set(g, base, h, sets, r->set) != 0) {
+				n->log_stamp.mtime = 0;
+				error = -1;
+				continue;
+			}
+			n->implicit = sets[r->set];
+		}
+
+		for (i = 0; i < r->ndeps; i++) {
+			if (r->deps[i].name >= h->nstrings) {
+				n->log_stamp.mtime = 0;
+				error = -1;
+				break;
 			}
+			node_logged_dep(g, n, log_str(base, h, r->deps[i].name),
+							&r->deps[i].stamp, r->deps[i].type);
 		}
 	}
-	fclose(fp);
-	free(line);
 
-	if (state != STATE_EOF) {
-		fprintf(stderr, "log corrupted %d\n", state);
+	HASH_ITER(hh, entries, e, etmp) {
+		HASH_DEL(entries, e);
+		free(e);
+	}
+	HASH_ITER(hh, jsets, js, jstmp) {
+		HASH_DEL(jsets, js);
+		free(js);
+	}
+	free(sets);
+
+	sd->log_dead += total - sd->log_live;
+
+	return error;
+}
+
+/*
+ * Map `name' in memory. Return NULL if it does not exist or is empty.
+ */
+static void *
+map_file(const char *dir, const char *name, size_t *size)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+	void *base;
+	int fd;
+
+	if (log_path(path, sizeof(path), dir, name) != 0)
+		return NULL;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			perrorf("open(%s)", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perrorf("mmap(%s)", path);
+		return NULL;
+	}
+
+	*size = st.st_size;
+
+	return base;
+}
+
+/*
+ * Wait until no other build uses the log of `sd'.
+ * The logs are locked as the subdirs are evaluated, so two builds may lock
+ * them in different orders: fcntl(2) locks are used as the kernel detects
+ * the deadlocks, unlike flock(2).
+ */
+static int
+log_lock(struct subdir *sd)
+{
+	char path[MAXPATHLEN];
+	struct flock fl;
+
+	if (log_path(path, sizeof(path), sd->path, LOCK_FILE) != 0)
+		return -1;
+
+	if ((sd->lock = open(path, O_RDWR|O_CREAT, 0644)) < 0) {
+		perrorf("open(%s)", path);
 		return -1;
 	}
 
-	return 0;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	if (fcntl(sd->lock, F_SETLK, &fl) == 0)
+		return 0;
+
+	if (errno == EACCES || errno == EAGAIN) {
+		fprintf(stderr, "waiting for another build in %s\n", sd->path);
+		if (fcntl(sd->lock, F_SETLKW, &fl) == 0)
+			return 0;
+	}
+
+	if (errno == EDEADLK)
+		fprintf(stderr, "another build is waiting for %s, try again\n",
+				sd->path);
+	else
+		perrorf("fcntl(%s)", path);
+	close(sd->lock);
+	sd->lock = -1;
+	return -1;
+}
+
+void
+log_unlock(struct subdir *sd)
+{
+	if (sd->lock < 0)
+		return;
+
+	close(sd->lock);
+	sd->lock = -1;
+}
+
+/*
+ * Lock the log of `sd' and apply it to the jobs it declares.
+ */
+int
+log_load(struct graph *g, struct subdir *sd)
+{
+	char from[MAXPATHLEN];
+	char to[MAXPATHLEN];
+	const char *dir = sd->path;
+	char *base;
+	char *journal;
+	size_t size = 0;
+	size_t journal_size = 0;
+	size_t valid = 0;
+	int error = 0;
+	bool rewrite = false;
+
+	sd->log_live = 0;
+	sd->log_dead = 0;
+
+	if (log_lock(sd) != 0)
+		return -1;
+
+	base = map_file(dir, LOG_FILE, &size);
+	journal = map_file(dir, JOURNAL_FILE, &journal_size);
+
+	if (base != NULL && (size < sizeof(LOG_MAGIC) - 1 ||
+		memcmp(base, LOG_MAGIC, sizeof(LOG_MAGIC) - 1) != 0)) {
+		/*
+		 * Old text log, of the whole build: the binary one of the subdir
+		 * will replace it, so move it aside for the other subdirs.
+		 */
+		munmap(base, size);
+		base = NULL;
+
+		if (log_path(from, sizeof(from), dir, LOG_FILE) != 0 ||
+			log_path(to, sizeof(to), dir, LOG_FILETEXT) != 0) {
+			error = -1;
+		} else if (rename(from, to) != 0) {
+			perrorf("rename(%s, %s)", from, to);
+			error = -1;
+		}
+	} else if (base != NULL && (size < sizeof(struct log_header) ||
+			   log_check(base, size) != 0)) {
+		/* As if there was none, but replace it with the records we have */
+		fprintf(stderr, "%s/%s: unsupported or corrupted log, ignored\n",
+				dir, LOG_FILE);
+		munmap(base, size);
+		base = NULL;
+		rewrite = true;
+	}
+
+	/*
+	 * Without a log nor a journal, the subdir has not been built since the
+	 * logs are kept by subdir. The journal can not be more recent than an
+	 * old text log, which is converted before anything is appended to the
+	 * journal.
+	 */
+	if (error == 0 && base == NULL && journal == NULL)
+		log_load_text(g, sd);
+	if (journal != NULL && sd->log_dead == 0)
+		valid = journal_check(journal, journal_size);
+
+	if (error == 0 && (base != NULL || valid > 0) &&
+		log_apply(g, sd, base, journal, valid) != 0) {
+		fprintf(stderr, "%s/%s: corrupted log, rewritten\n", dir, LOG_FILE);
+		rewrite = true;
+	}
+	if (error == 0 && rewrite)
+		sd->log_dead = UINT32_MAX - sd->log_live;
+
+	if (base != NULL)
+		munmap(base, size);
+	if (journal != NULL)
+		munmap(journal, journal_size);
+
+	return error;
 }
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
@@ -32,8 +33,8 @@ clean(struct graph *g)
 	struct node *n;
 
 	for (n = g->index; n != NULL; n = n->hh.next) {
-		/* Skip non jobs */
-		if (n->type != NODE_JOB)
+		/* Skip what is not built by a job */
+		if ((n->type != NODE_JOB && n->type != NODE_OUTPUT) || n->phony == 1)
 			continue;
 		if (unlink(n->name) != 0) {
 			if (errno != ENOENT && errno != ENOTDIR) {
@@ -73,16 +74,111 @@ get_root(char *root, size_t len)
 	return found;
 }
 
+/*
+ * Lexically clean `path', relative to the root: remove the `.' components
+ * and resolve the `..' ones. The root itself is `.'.
+ */
+static int
+clean_path(char *path)
+{
+	char buf[MAXPATHLEN];
+	char *comp, *last;
+	size_t len = 0;
+	char *slash;
+
+	buf[0] = '\0';
+	for (comp = strtok_r(path, "/", &last); comp != NULL;
+		 comp = strtok_r(NULL, "/", &last)) {
+		if (strcmp(comp, ".") == 0)
+			continue;
+		if (strcmp(comp, "..") == 0) {
+			if (len == 0)
+				return -1;
+			slash = strrchr(buf, '/');
+			len = slash != NULL ? (size_t)(slash - buf) : 0;
+			buf[len] = '\0';
+			continue;
+		}
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+						len > 0 ? "/" : "", comp);
+		if (len >= sizeof(buf))
+			return -1;
+	}
+
+	strcpy(path, len > 0 ? buf : ".");
+	return 0;
+}
+
+/*
+ * Return the path of the target `arg', relative to the root.
+ */
+static char *
+target_path(const char *prefix, const char *arg)
+{
+	char path[MAXPATHLEN];
+	char *dup;
+
+	if (arg[0] == '/')
+		diex("%s: targets must be relative", arg);
+	snprintf(path, sizeof(path), "%s/%s", prefix, arg);
+	if (clean_path(path) != 0)
+		diex("%s is outside of the root", arg);
+
+	if ((dup = strdup(path)) == NULL)
+		die("strdup()");
+
+	return dup;
+}
+
+/*
+ * Add `path' to the targets, in each variant unless it is already below
+ * one: the sources are not built by any job then.
+ */
+static void
+add_target(char **targets, int *ntargets, char *path)
+{
+	char buf[MAXPATHLEN];
+	size_t len;
+	int i;
+
+	for (i = 0; i < flags.nvariants; i++) {
+		len = strlen(flags.variants[i]);
+		if (strncmp(path, flags.variants[i], len) == 0 &&
+			(path[len] == '\0' || path[len] == '/'))
+			break;
+	}
+	if (flags.nvariants == 0 || i < flags.nvariants) {
+		targets[(*ntargets)++] = path;
+		return;
+	}
+
+	for (i = 0; i < flags.nvariants; i++) {
+		if (strcmp(path, ".") == 0)
+			snprintf(buf, sizeof(buf), "%s", flags.variants[i]);
+		else
+			snprintf(buf, sizeof(buf), "%s/%s", flags.variants[i], path);
+		if ((targets[(*ntargets)++] = strdup(buf)) == NULL)
+			die("strdup()");
+	}
+	free(path);
+}
+
 int
 main(int argc, char **argv)
 {
 	struct graph g;
+	char **targets;
+	int ntargets = 0;
 	char root[MAXPATHLEN];
+	char cwd[MAXPATHLEN];
+	const char *prefix;
 	int ch;
+	int i;
+	int error = 0;
 
 	bzero(&flags, sizeof(struct flags));
 
-	while ((ch = getopt(argc, argv, "clfgj:v")) != -1) {
+	while ((ch = getopt(argc, argv, "clfgj:rvV:")) != -1) {
 		switch(ch) {
 			case 'c':
 				flags.clean = 1;
@@ -101,9 +197,19 @@ main(int argc, char **argv)
 				if (flags.jobs == 0)
 					fprintf(stderr, "wrong -j arg `%s'", optarg);
 				break;
+			case 'r':
+				flags.reload = 1;
+				break;
 			case 'v':
 				flags.verbose++;
 				break;
+			case 'V':
+				flags.variants = realloc(flags.variants,
+										 (flags.nvariants + 1) * sizeof(char *));
+				if (flags.variants == NULL)
+					die("realloc()");
+				flags.variants[flags.nvariants++] = optarg;
+				break;
 		}
 	}
 	argc -= optind;
@@ -115,20 +221,51 @@ main(int argc, char **argv)
 	if( get_root(root, sizeof(root)) != 0)
 		die("can't find root");
 
+	/* Targets are relative to the current directory */
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		die("getcwd()");
+	prefix = cwd[strlen(root)] == '/' ? cwd + strlen(root) + 1 : ".";
+
 	if (chdir(root) != 0)
 		die("chdir(%s)", root);
 
+	/* The output directories of the variants are relative to the root */
+	for (i = 0; i < flags.nvariants; i++) {
+		flags.variants[i] = target_path(".", flags.variants[i]);
+		if (strcmp(flags.variants[i], ".") == 0)
+			diex("the root can not be a variant");
+	}
+
+	/*
+	 * Without any target, build what is declared in the current directory
+	 * and below, that is everything from the root.
+	 */
+	if ((targets = calloc((argc + 1) * MAX(flags.nvariants, 1),
+						  sizeof(char *))) == NULL)
+		die("calloc()");
+	for (i = 0; i < argc; i++)
+		add_target(targets, &ntargets, target_path(prefix, argv[i]));
+	if (argc == 0 && strcmp(prefix, ".") != 0)
+		add_target(targets, &ntargets, target_path(prefix, "."));
+
 	graph_init(&g);
-	yamfile(&g, root);
 
-	if (flags.clean == 1)
-		clean(&g);
-	else if (flags.graphviz == 1)
-		dump_graphviz(&g, stdout);
-	else
-		do_jobs(&g, root);
+	if (flags.clean == 1) {
+		if ((error = yamfile(&g, root)) == 0)
+			clean(&g);
+	} else if (flags.graphviz == 1) {
+		if ((error = yamfile(&g, root)) == 0)
+			dump_graphviz(&g, stdout);
+	} else
+		error = do_jobs(&g, root, targets, ntargets);
 
+	for (i = 0; i < ntargets; i++)
+		free(targets[i]);
+	free(targets);
+	for (i = 0; i < flags.nvariants; i++)
+		free(flags.variants[i]);
+	free(flags.variants);
 	graph_free(&g);
 
-	return 0;
+	return error != 0;
 }
@@ -0,0 +1,1155 @@
+/*
+ * Copyright (c) 2011, Julien P. Laffaye <jlaffaye@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "yam.h"
+
+/*
+ * Reader of the manifests of ninja, the build.ninja files written by CMake,
+ * Meson or gn. The builds are added to the fragment of the subdir, so they
+ * are cached, merged and logged like the targets of the Yamfile.
+ *
+ * The paths of a manifest are relative to the directory of the top one,
+ * where the commands run. Rules, variables and pools are supported, as
+ * well as include and subninja. The ninja_dyndep files are not.
+ */
+
+/* How deep the variables of a rule can refer to each other */
+#define MAX_DEPTH 16
+
+struct var {
+	char *name;
+	/* Expanded, except for the bindings of a rule */
+	char *value;
+	UT_hash_handle hh;
+};
+
+struct rule {
+	char *name;
+	struct var *vars;
+	UT_hash_handle hh;
+};
+
+/* A subninja has its own scope, seeing the one of its parent */
+struct scope {
+	struct var *vars;
+	struct rule *rules;
+	struct scope *parent;
+};
+
+/* The paths of a build, as written */
+struct paths {
+	char **paths;
+	size_t len;
+	size_t cap;
+};
+
+/* What a variable is looked up in */
+struct env {
+	struct scope *scope;
+	/* The bindings of the build, and its rule, NULL outside of a build */
+	struct var *vars;
+	struct rule *rule;
+	/* $in and $out, quoted for the shell but in the paths of files */
+	const struct paths *ins;
+	size_t nins;
+	const struct paths *outs;
+	size_t nouts;
+	bool escape;
+	int depth;
+};
+
+struct lexer {
+	const char *path;
+	char *data;
+	char *p;
+	int line;
+};
+
+struct parser {
+	struct fragment *f;
+	const char *root;
+	size_t rootlen;
+	/* The subdir of the Yamfile, where the jobs start */
+	const char *dir;
+	/* Where the commands run, relative to the root */
+	char base[MAXPATHLEN];
+	/* Path of `base' relative to `dir', NULL if they are the same */
+	const char *cd;
+	/* Pools declared so far, the value is the name known to the graph */
+	struct var *pools;
+	struct rule phony;
+	char *err;
+	size_t errlen;
+};
+
+static int parse_file(struct parser *ps, struct scope *sc, const char *path);
+
+static int
+syntax(struct parser *ps, const struct lexer *lx, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	snprintf(ps->err, ps->errlen, "%s:%d: %s", lx->path, lx->line, msg);
+	return -1;
+}
+
+static void
+paths_add(struct paths *ps, char *path)
+{
+	if (ps->len == ps->cap) {
+		ps->cap = ps->cap > 0 ? ps->cap * 2 : 8;
+		if ((ps->paths = realloc(ps->paths,
+								 ps->cap * sizeof(char *))) == NULL)
+			die("realloc()");
+	}
+	ps->paths[ps->len++] = path;
+}
+
+static void
+paths_free(struct paths *ps)
+{
+	size_t i;
+
+	for (i = 0; i < ps->len; i++)
+		free(ps->paths[i]);
+	free(ps->paths);
+	memset(ps, 0, sizeof(struct paths));
+}
+
+static void
+var_set(struct var **vars, const char *name, char *value)
+{
+	struct var *v;
+
+	HASH_FIND_STR(*vars, name, v);
+	if (v == NULL) {
+		if ((v = calloc(1, sizeof(struct var))) == NULL)
+			die("calloc()");
+		v->name = strdup(name);
+		HASH_ADD_KEYPTR(hh, *vars, v->name, strlen(v->name), v);
+	} else
+		free(v->value);
+	v->value = value;
+}
+
+static void
+vars_free(struct var **vars)
+{
+	struct var *v, *tmp;
+
+	HASH_ITER(hh, *vars, v, tmp) {
+		HASH_DEL(*vars, v);
+		free(v->name);
+		free(v->value);
+		free(v);
+	}
+}
+
+static void
+scope_free(struct scope *sc)
+{
+	struct rule *r, *tmp;
+
+	vars_free(&sc->vars);
+	HASH_ITER(hh, sc->rules, r, tmp) {
+		HASH_DEL(sc->rules, r);
+		vars_free(&r->vars);
+		free(r->name);
+		free(r);
+	}
+}
+
+static struct rule *
+find_rule(struct parser *ps, struct scope *sc, const char *name)
+{
+	struct rule *r;
+
+	if (strcmp(name, "phony") == 0)
+		return &ps->phony;
+
+	for (; sc != NULL; sc = sc->parent) {
+		HASH_FIND_STR(sc->rules, name, r);
+		if (r != NULL)
+			return r;
+	}
+
+	return NULL;
+}
+
+/*
+ * The lexer works on lines: a `$' at the end of a line joins it with the
+ * next one, without its indentation.
+ */
+static bool
+is_newline(const char *p)
+{
+	return p[0] == '\n' || (p[0] == '\r' && p[1] == '\n');
+}
+
+static void
+skip_newline(struct lexer *lx)
+{
+	if (lx->p[0] == '\r')
+		lx->p++;
+	if (lx->p[0] == '\n') {
+		lx->p++;
+		lx->line++;
+	}
+}
+
+static bool
+skip_continuation(struct lexer *lx)
+{
+	if (lx->p[0] != '$' || !is_newline(lx->p + 1))
+		return false;
+
+	lx->p++;
+	skip_newline(lx);
+	while (lx->p[0] == ' ')
+		lx->p++;
+	return true;
+}
+
+static void
+skip_spaces(struct lexer *lx)
+{
+	while (lx->p[0] == ' ' || skip_continuation(lx)) {
+		if (lx->p[0] == ' ')
+			lx->p++;
+	}
+}
+
+static void
+skip_line(struct lexer *lx)
+{
+	while (lx->p[0] != '\0' && lx->p[0] != '\n')
+		lx->p++;
+	skip_newline(lx);
+}
+
+static bool
+is_ident(char c, bool simple)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '-' ||
+		(!simple && c == '.');
+}
+
+/*
+ * Read the identifier at the current position into `buf'.
+ */
+static int
+read_ident(struct parser *ps, struct lexer *lx, char *buf, size_t len)
+{
+	size_t i = 0;
+
+	while (is_ident(lx->p[0], false)) {
+		if (i + 1 < len)
+			buf[i++] = lx->p[0];
+		lx->p++;
+	}
+	buf[i] = '\0';
+
+	if (i == 0)
+		return syntax(ps, lx, "expected a name");
+	return 0;
+}
+
+/*
+ * Return the value up to the end of the line, with its escapes. Unlike a
+ * path, it can contain spaces, `:' and `|'.
+ */
+static char *
+read_value(struct lexer *lx, bool path)
+{
+	UT_string *buf;
+	char *str;
+
+	utstring_new(buf);
+	while (lx->p[0] != '\0' && !is_newline(lx->p)) {
+		if (skip_continuation(lx))
+			continue;
+		if (path && (lx->p[0] == ' ' || lx->p[0] == ':' || lx->p[0] == '|'))
+			break;
+		if (lx->p[0] == '$' && lx->p[1] != '\0' && lx->p[1] != '\r') {
+			utstring_bincpy(buf, lx->p, 2);
+			lx->p += 2;
+			continue;
+		}
+		utstring_bincpy(buf, lx->p, 1);
+		lx->p++;
+	}
+
+	str = strndup(utstring_body(buf), utstring_len(buf));
+	utstring_free(buf);
+
+	return str;
+}
+
+/*
+ * Read the paths up to the next `:', `|' or the end of the line.
+ */
+static void
+read_paths(struct lexer *lx, struct paths *paths)
+{
+	char *path;
+
+	for (;;) {
+		skip_spaces(lx);
+		if (lx->p[0] == '\0' || is_newline(lx->p) || lx->p[0] == ':' ||
+			lx->p[0] == '|')
+			return;
+		path = read_value(lx, true);
+		paths_add(paths, path);
+	}
+}
+
+/*
+ * Append `path' to `out', quoted for the shell if needed.
+ */
+static void
+quote(UT_string *out, const char *path)
+{
+	const char *p;
+
+	for (p = path; *p != '\0'; p++) {
+		if (!isalnum((unsigned char)*p) && strchr("_+-,./@%=", *p) == NULL)
+			break;
+	}
+	if (*p == '\0' && p != path) {
+		utstring_printf(out, "%s", path);
+		return;
+	}
+
+	utstring_printf(out, "'");
+	for (p = path; *p != '\0'; p++) {
+		if (*p == '\'')
+			utstring_printf(out, "'\\''");
+		else
+			utstring_bincpy(out, p, 1);
+	}
+	utstring_printf(out, "'");
+}
+
+static void
+join_paths(UT_string *out, const struct paths *paths, size_t len,
+		   const char *sep, bool escape)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (i > 0)
+			utstring_printf(out, "%s", sep);
+		if (escape)
+			quote(out, paths->paths[i]);
+		else
+			utstring_printf(out, "%s", paths->paths[i]);
+	}
+}
+
+static int expand(struct parser *ps, const struct lexer *lx, struct env *env,
+		const char *str, UT_string *out);
+
+static int
+lookup(struct parser *ps, const struct lexer *lx, struct env *env,
+	   const char *name, UT_string *out)
+{
+	struct scope *sc;
+	struct var *v;
+	int ret;
+
+	if (env->rule != NULL) {
+		if (strcmp(name, "in") == 0) {
+			join_paths(out, env->ins, env->nins, " ", env->escape);
+			return 0;
+		} else if (strcmp(name, "in_newline") == 0) {
+			join_paths(out, env->ins, env->nins, "\n", env->escape);
+			return 0;
+		} else if (strcmp(name, "out") == 0) {
+			join_paths(out, env->outs, env->nouts, " ", env->escape);
+			return 0;
+		}
+	}
+
+	HASH_FIND_STR(env->vars, name, v);
+	if (v != NULL) {
+		utstring_printf(out, "%s", v->value);
+		return 0;
+	}
+
+	/* The bindings of the rule are expanded in the scope of the build */
+	if (env->rule != NULL) {
+		HASH_FIND_STR(env->rule->vars, name, v);
+		if (v != NULL) {
+			if (env->depth >= MAX_DEPTH)
+				return syntax(ps, lx, "cycle in the variable %s", name);
+			env->depth++;
+			ret = expand(ps, lx, env, v->value, out);
+			env->depth--;
+			return ret;
+		}
+	}
+
+	for (sc = env->scope; sc != NULL; sc = sc->parent) {
+		HASH_FIND_STR(sc->vars, name, v);
+		if (v != NULL) {
+			utstring_printf(out, "%s", v->value);
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Append `str' to `out', with its variables and escapes expanded.
+ */
+static int
+expand(struct parser *ps, const struct lexer *lx, struct env *env,
+	   const char *str, UT_string *out)
+{
+	char name[128];
+	const char *p, *end;
+	size_t len;
+
+	for (p = str; *p != '\0'; p++) {
+		if (p[0] != '$') {
+			utstring_bincpy(out, p, 1);
+			continue;
+		}
+
+		p++;
+		if (p[0] == '$' || p[0] == ' ' || p[0] == ':') {
+			utstring_bincpy(out, p, 1);
+			continue;
+		}
+
+		if (p[0] == '{') {
+			if ((end = strchr(p, '}')) == NULL)
+				return syntax(ps, lx, "unterminated ${");
+			p++;
+		} else {
+			for (end = p; is_ident(*end, true); end++)
+				;
+		}
+
+		len = end - p;
+		if (len == 0 || len >= sizeof(name))
+			return syntax(ps, lx, "bad $-escape");
+		memcpy(name, p, len);
+		name[len] = '\0';
+		if (lookup(ps, lx, env, name, out) != 0)
+			return -1;
+
+		/* Stay on the last character of the variable */
+		p = *end == '}' ? end : end - 1;
+	}
+
+	return 0;
+}
+
+static char *
+expand_str(struct parser *ps, const struct lexer *lx, struct env *env,
+		   const char *str)
+{
+	UT_string *buf;
+	char *ret = NULL;
+
+	utstring_new(buf);
+	if (expand(ps, lx, env, str, buf) == 0)
+		ret = strndup(utstring_body(buf), utstring_len(buf));
+	utstring_free(buf);
+
+	return ret;
+}
+
+/*
+ * Expand the binding `name' of the build into `value', NULL if empty.
+ */
+static int
+binding(struct parser *ps, const struct lexer *lx, struct env *env,
+		const char *name, char **value)
+{
+	UT_string *buf;
+	int ret;
+
+	utstring_new(buf);
+	ret = lookup(ps, lx, env, name, buf);
+	*value = ret == 0 && utstring_len(buf) > 0 ?
+		strndup(utstring_body(buf), utstring_len(buf)) : NULL;
+	utstring_free(buf);
+
+	return ret;
+}
+
+/*
+ * Return the path relative to the root of `path', relative to the
+ * directory of the manifest. The components are cleaned lexically, as
+ * ninja does.
+ */
+static char *
+canon_path(struct parser *ps, const struct lexer *lx, const char *path)
+{
+	char buf[MAXPATHLEN];
+	char clean[MAXPATHLEN];
+	char *comp, *last;
+	size_t len = 0;
+	char *slash;
+	int n;
+
+	if (path[0] == '\0') {
+		syntax(ps, lx, "empty path");
+		return NULL;
+	}
+
+	if (path[0] != '/')
+		n = snprintf(buf, sizeof(buf), "%s/%s", ps->base, path);
+	else if (strncmp(path, ps->root, ps->rootlen) == 0 &&
+			 (path[ps->rootlen] == '/' || path[ps->rootlen] == '\0'))
+		n = snprintf(buf, sizeof(buf), ".%s", path + ps->rootlen);
+	else
+		return strdup(path);
+	if (n < 0 || (size_t)n >= sizeof(buf)) {
+		syntax(ps, lx, "%s: path too long", path);
+		return NULL;
+	}
+
+	clean[0] = '\0';
+	for (comp = strtok_r(buf, "/", &last); comp != NULL;
+		 comp = strtok_r(NULL, "/", &last)) {
+		if (strcmp(comp, ".") == 0)
+			continue;
+		if (strcmp(comp, "..") == 0) {
+			if (len == 0) {
+				syntax(ps, lx, "%s is outside of the root", path);
+				return NULL;
+			}
+			slash = strrchr(clean, '/');
+			len = slash != NULL ? (size_t)(slash - clean) : 0;
+			clean[len] = '\0';
+			continue;
+		}
+		len += snprintf(clean + len, sizeof(clean) - len, "%s%s",
+						len > 0 ? "/" : "", comp);
+		if (len >= sizeof(clean)) {
+			syntax(ps, lx, "%s: path too long", path);
+			return NULL;
+		}
+	}
+
+	return strdup(len > 0 ? clean : ".");
+}
+
+/*
+ * Whether the next line is indented, and so is a binding of the current
+ * block. The comments are skipped.
+ */
+static bool
+next_binding(struct lexer *lx)
+{
+	char *p;
+
+	for (;;) {
+		for (p = lx->p; *p == ' '; p++)
+			;
+		if (*p == '#') {
+			lx->p = p;
+			skip_line(lx);
+			continue;
+		}
+		if (p == lx->p || *p == '\0' || is_newline(p))
+			return false;
+		lx->p = p;
+		return true;
+	}
+}
+
+/*
+ * Read `name = value' and the end of the line. The value is not expanded.
+ */
+static int
+read_binding(struct parser *ps, struct lexer *lx, char *name, size_t len,
+			 char **value)
+{
+	if (read_ident(ps, lx, name, len) != 0)
+		return -1;
+	skip_spaces(lx);
+	if (lx->p[0] != '=')
+		return syntax(ps, lx, "expected '='");
+	lx->p++;
+	skip_spaces(lx);
+
+	*value = read_value(lx, false);
+	skip_newline(lx);
+
+	return 0;
+}
+
+static int
+end_of_line(struct parser *ps, struct lexer *lx)
+{
+	skip_spaces(lx);
+	if (lx->p[0] != '\0' && !is_newline(lx->p))
+		return syntax(ps, lx, "expected a newline");
+	skip_newline(lx);
+
+	return 0;
+}
+
+static int
+parse_rule(struct parser *ps, struct scope *sc, struct lexer *lx)
+{
+	char name[128];
+	char *value;
+	struct rule *r;
+	struct var *v;
+
+	skip_spaces(lx);
+	if (read_ident(ps, lx, name, sizeof(name)) != 0 ||
+		end_of_line(ps, lx) != 0)
+		return -1;
+
+	HASH_FIND_STR(sc->rules, name, r);
+	if (r != NULL || strcmp(name, "phony") == 0)
+		return syntax(ps, lx, "duplicate rule %s", name);
+
+	if ((r = calloc(1, sizeof(struct rule))) == NULL)
+		die("calloc()");
+	r->name = strdup(name);
+	HASH_ADD_KEYPTR(hh, sc->rules, r->name, strlen(r->name), r);
+
+	while (next_binding(lx)) {
+		if (read_binding(ps, lx, name, sizeof(name), &value) != 0)
+			return -1;
+		var_set(&r->vars, name, value);
+	}
+
+	HASH_FIND_STR(r->vars, "command", v);
+	if (v == NULL)
+		return syntax(ps, lx, "rule %s has no command", r->name);
+
+	return 0;
+}
+
+/*
+ * Declare a pool, named after the subdir in the graph as the same name can
+ * be used by the manifests of other subdirs.
+ */
+static int
+parse_pool(struct parser *ps, struct scope *sc, struct lexer *lx)
+{
+	char name[128];
+	char var[128];
+	char key[MAXPATHLEN];
+	char *value, *end;
+	struct env env = { .scope = sc };
+	struct var *v;
+	long depth = -1;
+
+	skip_spaces(lx);
+	if (read_ident(ps, lx, name, sizeof(name)) != 0 ||
+		end_of_line(ps, lx) != 0)
+		return -1;
+
+	HASH_FIND_STR(ps->pools, name, v);
+	if (v != NULL || strcmp(name, "console") == 0)
+		return syntax(ps, lx, "duplicate pool %s", name);
+
+	while (next_binding(lx)) {
+		if (read_binding(ps, lx, var, sizeof(var), &value) != 0)
+			return -1;
+		if (strcmp(var, "depth") != 0) {
+			free(value);
+			return syntax(ps, lx, "unexpected variable %s", var);
+		}
+		end = expand_str(ps, lx, &env, value);
+		free(value);
+		if (end == NULL)
+			return -1;
+		depth = strtol(end, &value, 10);
+		if (*end == '\0' || *value != '\0' || depth < 0)
+			depth = -1;
+		free(end);
+		if (depth < 0)
+			return syntax(ps, lx, "invalid depth of pool %s", name);
+	}
+	if (depth < 0)
+		return syntax(ps, lx, "pool %s has no depth", name);
+
+	snprintf(key, sizeof(key), "%s:%s", ps->dir, name);
+	var_set(&ps->pools, name, strdup(key));
+	fragment_pool(ps->f, key, depth);
+
+	return 0;
+}
+
+/*
+ * Add the paths of `from' to `to', relative to the root.
+ */
+static int
+canon_paths(struct parser *ps, const struct lexer *lx, struct env *env,
+			struct paths *from, struct paths *to)
+{
+	char *path;
+	size_t i;
+
+	for (i = 0; i < from->len; i++) {
+		if ((path = expand_str(ps, lx, env, from->paths[i])) == NULL)
+			return -1;
+		/* $in and $out are the paths as written, expanded */
+		free(from->paths[i]);
+		from->paths[i] = path;
+		if ((path = canon_path(ps, lx, path)) == NULL)
+			return -1;
+		paths_add(to, path);
+	}
+
+	return 0;
+}
+
+/*
+ * Turn the command of a build into the one of a job, run from the subdir
+ * of the Yamfile.
+ */
+static char *
+job_cmd(struct parser *ps, const char *cmd)
+{
+	UT_string *buf;
+	char *str;
+
+	utstring_new(buf);
+	if (ps->cd != NULL) {
+		utstring_printf(buf, "cd ");
+		quote(buf, ps->cd);
+		utstring_printf(buf, " && ");
+	}
+	utstring_printf(buf, "%s", cmd);
+
+	str = strndup(utstring_body(buf), utstring_len(buf));
+	utstring_free(buf);
+
+	return str;
+}
+
+/*
+ * Set the pool of the job `t' from the one of the build.
+ */
+static int
+set_pool(struct parser *ps, const struct lexer *lx, struct ftarget *t,
+		 const char *pool)
+{
+	struct var *v;
+
+	HASH_FIND_STR(ps->pools, pool, v);
+	if (v == NULL && strcmp(pool, "console") == 0) {
+		/* Shared by all the manifests */
+		var_set(&ps->pools, pool, strdup(pool));
+		fragment_pool(ps->f, pool, 1);
+		HASH_FIND_STR(ps->pools, pool, v);
+	}
+	if (v == NULL)
+		return syntax(ps, lx, "unknown pool %s", pool);
+
+	free(t->pool);
+	t->pool = strdup(v->value);
+
+	return 0;
+}
+
+/*
+ * build outs | implicit outs: rule ins | implicit ins || order-only |@ validations
+ *
+ * A phony build is an alias of its inputs. The validations are not built.
+ */
+static int
+parse_build(struct parser *ps, struct scope *sc, struct lexer *lx)
+{
+	struct paths outs = { NULL, 0, 0 };
+	struct paths ins = { NULL, 0, 0 };
+	struct paths couts = { NULL, 0, 0 };
+	struct paths cins = { NULL, 0, 0 };
+	struct env env = { .scope = sc };
+	char name[128];
+	char *value, *expanded;
+	char *cmd = NULL, *depfile = NULL, *deps = NULL, *pool = NULL;
+	char *rspfile = NULL, *rspcontent = NULL, *dyndep = NULL;
+	size_t nouts, nins, nimplicit, norder;
+	struct ftarget *t;
+	struct rule *r;
+	struct stamp stamp;
+	size_t i, j;
+	int ret = -1;
+
+	read_paths(lx, &outs);
+	nouts = outs.len;
+	if (lx->p[0] == '|') {
+		lx->p++;
+		read_paths(lx, &outs);
+	}
+	if (nouts == 0) {
+		syntax(ps, lx, "expected an output");
+		goto out;
+	}
+	if (lx->p[0] != ':') {
+		syntax(ps, lx, "expected ':'");
+		goto out;
+	}
+	lx->p++;
+	skip_spaces(lx);
+	if (read_ident(ps, lx, name, sizeof(name)) != 0)
+		goto out;
+	if ((r = find_rule(ps, sc, name)) == NULL) {
+		syntax(ps, lx, "unknown rule %s", name);
+		goto out;
+	}
+
+	read_paths(lx, &ins);
+	nins = ins.len;
+	if (lx->p[0] == '|' && lx->p[1] != '|' && lx->p[1] != '@') {
+		lx->p++;
+		read_paths(lx, &ins);
+	}
+	nimplicit = ins.len;
+	if (lx->p[0] == '|' && lx->p[1] == '|') {
+		lx->p += 2;
+		read_paths(lx, &ins);
+	}
+	norder = ins.len;
+	if (lx->p[0] == '|' && lx->p[1] == '@') {
+		lx->p += 2;
+		read_paths(lx, &ins);
+	}
+	if (end_of_line(ps, lx) != 0)
+		goto out;
+
+	/* The bindings of the build see the previous ones */
+	while (next_binding(lx)) {
+		if (read_binding(ps, lx, name, sizeof(name), &value) != 0)
+			goto out;
+		expanded = expand_str(ps, lx, &env, value);
+		free(value);
+		if (expanded == NULL)
+			goto out;
+		var_set(&env.vars, name, expanded);
+	}
+
+	if (canon_paths(ps, lx, &env, &outs, &couts) != 0 ||
+		canon_paths(ps, lx, &env, &ins, &cins) != 0)
+		goto out;
+
+	if (r == &ps->phony) {
+		for (i = 0; i < couts.len; i++) {
+			/*
+			 * Without inputs, it stands for a file that may be missing,
+			 * like a deleted header. The manifest is read again when
+			 * the file appears.
+			 */
+			if (norder == 0) {
+				fragment_input(ps->f, couts.paths[i]);
+				stat_cached(couts.paths[i], &stamp);
+				if (stamp.mtime >= 0)
+					continue;
+			}
+			t = fragment_alias(ps->f, couts.paths[i]);
+			for (j = 0; j < norder; j++)
+				fragment_dep(t, cins.paths[j]);
+		}
+		ret = 0;
+		goto out;
+	}
+
+	env.rule = r;
+	env.ins = &ins;
+	env.nins = nins;
+	env.outs = &outs;
+	env.nouts = nouts;
+	env.escape = true;
+	if (binding(ps, lx, &env, "command", &cmd) != 0 ||
+		binding(ps, lx, &env, "rspfile_content", &rspcontent) != 0 ||
+		binding(ps, lx, &env, "deps", &deps) != 0 ||
+		binding(ps, lx, &env, "pool", &pool) != 0)
+		goto out;
+	/* Paths of files, not part of a command */
+	env.escape = false;
+	if (binding(ps, lx, &env, "depfile", &depfile) != 0 ||
+		binding(ps, lx, &env, "rspfile", &rspfile) != 0 ||
+		binding(ps, lx, &env, "dyndep", &dyndep) != 0)
+		goto out;
+	if (cmd == NULL) {
+		syntax(ps, lx, "%s: empty command", couts.paths[0]);
+		goto out;
+	}
+	if (dyndep != NULL) {
+		syntax(ps, lx, "%s: dyndep is not supported", couts.paths[0]);
+		goto out;
+	}
+
+	value = job_cmd(ps, cmd);
+	t = fragment_target(ps->f, couts.paths[0], value);
+	free(value);
+	for (i = 1; i < couts.len; i++)
+		fragment_output(t, couts.paths[i]);
+	for (i = 0; i < nimplicit; i++)
+		fragment_dep(t, cins.paths[i]);
+	for (i = nimplicit; i < norder; i++)
+		fragment_order(t, cins.paths[i]);
+
+	/* With deps = msvc, what the compiler read is traced instead */
+	if (depfile != NULL && (deps == NULL || strcmp(deps, "msvc") != 0) &&
+		(t->depfile = canon_path(ps, lx, depfile)) == NULL)
+		goto out;
+	if (pool != NULL && set_pool(ps, lx, t, pool) != 0)
+		goto out;
+	/* Written by yam, it may be too large for the command line */
+	if (rspfile != NULL) {
+		if ((t->rspfile = canon_path(ps, lx, rspfile)) == NULL)
+			goto out;
+		t->rspcontent = rspcontent != NULL ? rspcontent : strdup("");
+		rspcontent = NULL;
+	}
+
+	ret = 0;
+out:
+	paths_free(&outs);
+	paths_free(&ins);
+	paths_free(&couts);
+	paths_free(&cins);
+	vars_free(&env.vars);
+	free(cmd);
+	free(depfile);
+	free(deps);
+	free(pool);
+	free(rspfile);
+	free(rspcontent);
+	free(dyndep);
+
+	return ret;
+}
+
+/*
+ * include or subninja: return the path of the file, relative to the root.
+ */
+static char *
+read_include(struct parser *ps, struct scope *sc, struct lexer *lx)
+{
+	struct env env = { .scope = sc };
+	char *value, *path;
+
+	skip_spaces(lx);
+	value = read_value(lx, true);
+	if (end_of_line(ps, lx) != 0) {
+		free(value);
+		return NULL;
+	}
+
+	path = expand_str(ps, lx, &env, value);
+	free(value);
+	if (path == NULL)
+		return NULL;
+	value = canon_path(ps, lx, path);
+	free(path);
+
+	return value;
+}
+
+static char *
+read_manifest(const char *path)
+{
+	FILE *fp;
+	char *data;
+	long len;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+		fseek(fp, 0, SEEK_SET) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+	if ((data = malloc(len + 1)) == NULL)
+		die("malloc()");
+	if (fread(data, 1, len, fp) != (size_t)len) {
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
+	data[len] = '\0';
+	fclose(fp);
+
+	return data;
+}
+
+static bool
+is_keyword(const char *name, const struct lexer *lx, const char *keyword)
+{
+	return strcmp(name, keyword) == 0 && lx->p[0] != '=' &&
+		(lx->p[0] == ' ' || lx->p[0] == '$');
+}
+
+static int
+parse_file(struct parser *ps, struct scope *sc, const char *path)
+{
+	struct lexer lx;
+	struct scope child;
+	struct env env = { .scope = sc };
+	char name[128];
+	char *value, *expanded;
+	int ret = 0;
+
+	lx.path = path;
+	lx.line = 1;
+	if ((lx.data = read_manifest(path)) == NULL) {
+		snprintf(ps->err, ps->errlen, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+	lx.p = lx.data;
+	fragment_input(ps->f, path);
+
+	while (ret == 0 && lx.p[0] != '\0') {
+		if (lx.p[0] == ' ') {
+			if (next_binding(&lx))
+				ret = syntax(ps, &lx, "unexpected indent");
+			continue;
+		}
+		if (lx.p[0] == '#') {
+			skip_line(&lx);
+			continue;
+		}
+		if (is_newline(lx.p)) {
+			skip_newline(&lx);
+			continue;
+		}
+
+		if ((ret = read_ident(ps, &lx, name, sizeof(name))) != 0)
+			break;
+
+		if (is_keyword(name, &lx, "build")) {
+			ret = parse_build(ps, sc, &lx);
+		} else if (is_keyword(name, &lx, "rule")) {
+			ret = parse_rule(ps, sc, &lx);
+		} else if (is_keyword(name, &lx, "pool")) {
+			ret = parse_pool(ps, sc, &lx);
+		} else if (is_keyword(name, &lx, "default")) {
+			/* All the jobs are built by default */
+			skip_line(&lx);
+		} else if (is_keyword(name, &lx, "include")) {
+			if ((value = read_include(ps, sc, &lx)) == NULL)
+				ret = -1;
+			else
+				ret = parse_file(ps, sc, value);
+			free(value);
+		} else if (is_keyword(name, &lx, "subninja")) {
+			if ((value = read_include(ps, sc, &lx)) == NULL) {
+				ret = -1;
+			} else {
+				memset(&child, 0, sizeof(child));
+				child.parent = sc;
+				ret = parse_file(ps, &child, value);
+				scope_free(&child);
+			}
+			free(value);
+		} else {
+			skip_spaces(&lx);
+			if (lx.p[0] != '=') {
+				ret = syntax(ps, &lx, "expected '='");
+				break;
+			}
+			lx.p++;
+			skip_spaces(&lx);
+			value = read_value(&lx, false);
+			skip_newline(&lx);
+			expanded = expand_str(ps, &lx, &env, value);
+			free(value);
+			if (expanded == NULL)
+				ret = -1;
+			else
+				var_set(&sc->vars, name, expanded);
+		}
+	}
+
+	free(lx.data);
+
+	return ret;
+}
+
+/*
+ * Add the builds of the manifest at `path', relative to the root, to the
+ * fragment of the subdir `dir'. The commands run from the directory of
+ * the manifest. Return -1 with a message in `err' on error.
+ */
+int
+ninja_load(const char *root, const char *dir, const char *path,
+		   struct fragment *f, char *err, size_t errlen)
+{
+	char up[MAXPATHLEN];
+	struct parser ps;
+	struct scope top;
+	const char *slash;
+	size_t len = strlen(dir);
+	size_t uplen = 0;
+	int ret;
+
+	memset(&ps, 0, sizeof(ps));
+	memset(&top, 0, sizeof(top));
+	ps.f = f;
+	ps.root = root;
+	ps.rootlen = strlen(root);
+	ps.dir = dir;
+	ps.err = err;
+	ps.errlen = errlen;
+
+	if ((slash = strrchr(path, '/')) == NULL)
+		snprintf(ps.base, sizeof(ps.base), ".");
+	else
+		snprintf(ps.base, sizeof(ps.base), "%.*s", (int)(slash - path),
+				 path);
+
+	if (strcmp(ps.base, dir) == 0)
+		ps.cd = NULL;
+	else if (strcmp(dir, ".") == 0)
+		ps.cd = ps.base;
+	else if (strncmp(ps.base, dir, len) == 0 && ps.base[len] == '/')
+		ps.cd = ps.base + len + 1;
+	else {
+		/* In the output directory of a variant */
+		for (slash = dir; slash != NULL; slash = strchr(slash + 1, '/'))
+			uplen += snprintf(up + uplen, sizeof(up) - uplen, "../");
+		snprintf(up + uplen, sizeof(up) - uplen, "%s", ps.base);
+		ps.cd = up;
+	}
+
+	ret = parse_file(&ps, &top, path);
+
+	scope_free(&top);
+	vars_free(&ps.pools);
+
+	return ret;
+}
@@ -23,8 +23,12 @@
 
 #include "yam.h"
 
+/*
+ * Run `cmd' in `cwd', its output going to `*fd'. Unless `traced' is false,
+ * the wrapper reports the files it opens.
+ */
 pid_t
-popen2(const char *cmd, const char *cwd, int child_id, int *fd)
+popen2(const char *cmd, const char *cwd, int child_id, bool traced, int *fd)
 {
 	int fildes[2];
 	pid_t pid;
@@ -55,6 +59,8 @@ popen2(const char *cmd, const char *cwd, int child_id, int *fd)
 
 		snprintf(e, sizeof(e), "YAM_CHILD_ID=%d", child_id);
 		putenv(e);
+		if (traced)
+			ipc_child();
 
 		if (chdir(cwd) != 0)
 			die("chdir(%s)", cwd);
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2011, Julien P. Laffaye <jlaffaye@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "yam.h"
+
+/*
+ * Persistent workers, the tools slow to start which run many jobs, one at a
+ * time. A worker is started by `sh -c' with its command, from the subdir of
+ * the jobs, and reads the requests on its stdin:
+ *
+ *   <length of the command>\n<command of the job>
+ *
+ * It answers each on its stdout with:
+ *
+ *   <exit status> <length of the output> <length of the files>\n<output>
+ *   <files>
+ *
+ * where the files are lines of `r path' or `w path' for the files the job
+ * read or wrote, relative to the subdir. Its stderr is the one of yam.
+ */
+
+/*
+ * Return an idle worker running `cmd' in `cwd', started if there is none,
+ * or NULL if it could not be started. It is busy until it answers.
+ */
+struct worker *
+worker_get(struct worker **workers, const char *cmd, const char *cwd)
+{
+	struct worker *w;
+	int fds[2];
+
+	for (w = *workers; w != NULL; w = w->next) {
+		if (w->busy == 0 && strcmp(w->cmd, cmd) == 0 &&
+			strcmp(w->cwd, cwd) == 0) {
+			w->busy = 1;
+			return w;
+		}
+	}
+
+	/* not inherited by the other jobs, so that it sees yam leave */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		perror("socketpair()");
+		return NULL;
+	}
+
+	if ((w = calloc(1, sizeof(struct worker))) == NULL ||
+		(w->cmd = strdup(cmd)) == NULL)
+		die("calloc()");
+	w->cwd = cwd;
+	w->fd = fds[0];
+	w->busy = 1;
+	utstring_new(w->buf);
+
+	if ((w->pid = fork()) < 0) {
+		perror("fork()");
+		close(fds[0]);
+		close(fds[1]);
+		utstring_free(w->buf);
+		free(w->cmd);
+		free(w);
+		return NULL;
+	}
+
+	/* child */
+	if (w->pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], 0); /* stdin */
+		dup2(fds[1], 1); /* stdout */
+		close(fds[1]);
+
+		if (chdir(cwd) != 0) {
+			perror(cwd);
+			_exit(127);
+		}
+
+		execl("/bin/sh", "sh", "-c", cmd, NULL);
+		perror("execl()");
+		_exit(127);
+	}
+
+	close(fds[1]);
+	LL_PREPEND(*workers, w);
+
+	return w;
+}
+
+/*
+ * Send the command of a job to `w'.
+ */
+int
+worker_send(struct worker *w, const char *cmd)
+{
+	char header[32];
+	size_t len = strlen(cmd);
+	ssize_t sz;
+	const char *p;
+	size_t left;
+	int i;
+
+	snprintf(header, sizeof(header), "%zu\n", len);
+	for (i = 0; i < 2; i++) {
+		p = i == 0 ? header : cmd;
+		left = i == 0 ? strlen(header) : len;
+		while (left > 0) {
+			if ((sz = send(w->fd, p, left, MSG_NOSIGNAL)) < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("send()");
+				return -1;
+			}
+			p += sz;
+			left -= sz;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the length at `*p' in the first line of an answer, and move `*p'
+ * after it. Return -1 if it is not a length, or too large.
+ */
+static int
+parse_length(char **p, size_t *len)
+{
+	unsigned long long v;
+	char *end;
+
+	while (**p == ' ')
+		(*p)++;
+	/* strtoull() would take a sign */
+	if (!isdigit((unsigned char)**p))
+		return -1;
+	errno = 0;
+	v = strtoull(*p, &end, 10);
+	if (errno != 0 || v > SIZE_MAX)
+		return -1;
+	*len = v;
+	*p = end;
+
+	return 0;
+}
+
+/*
+ * Read what `w' answered. Once the answer is complete, set `*status', add
+ * the output to `out', call `cb' with `arg', the mode and the path relative
+ * to the root of each file, unless it is NULL, and return 1. Return 0 if the
+ * answer is not complete, and -1 if `w' exited or answered garbage.
+ */
+int
+worker_read(struct worker *w, int *status, UT_string *out,
+			void (*cb)(void *, unsigned char, const char *), void *arg)
+{
+	char buf[8192];
+	char path[PATH_MAX];
+	char *body, *p, *q, *end, *line;
+	size_t outlen, fileslen;
+	ssize_t sz;
+	long st;
+
+	if ((sz = read(w->fd, buf, sizeof(buf))) < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		perror("read()");
+		return -1;
+	}
+	if (sz == 0)
+		return -1;
+	utstring_bincpy(w->buf, buf, sz);
+
+	body = utstring_body(w->buf);
+	if ((p = memchr(body, '\n', utstring_len(w->buf))) == NULL)
+		return 0;
+	errno = 0;
+	st = strtol(body, &q, 10);
+	if (q == body || errno != 0 || st < INT_MIN || st > INT_MAX ||
+		parse_length(&q, &outlen) != 0 || parse_length(&q, &fileslen) != 0 ||
+		outlen > SIZE_MAX - fileslen || q[strspn(q, " ")] != '\n') {
+		utstring_printf(out, "worker %s: invalid answer\n", w->cmd);
+		kill(w->pid, SIGTERM);
+		return -1;
+	}
+	*status = st;
+	p++;
+	if (utstring_len(w->buf) - (size_t)(p - body) < outlen + fileslen)
+		return 0;
+
+	utstring_bincpy(out, p, outlen);
+	p += outlen;
+	end = p + fileslen;
+	for (line = p; cb != NULL && line < end; line = p + 1) {
+		if ((p = memchr(line, '\n', end - line)) == NULL)
+			p = end;
+		if (p - line < 3 || (line[0] != 'r' && line[0] != 'w') ||
+			line[1] != ' ')
+			continue;
+		snprintf(path, sizeof(path), "%.*s", (int)(p - line - 2), line + 2);
+		resolve_path(w->cwd, path, buf, sizeof(buf));
+		cb(arg, line[0], buf);
+	}
+	utstring_clear(w->buf);
+
+	return 1;
+}
+
+/*
+ * Stop `w' and return its exit status.
+ */
+int
+worker_free(struct worker **workers, struct worker *w)
+{
+	int status = 0;
+
+	LL_DELETE(*workers, w);
+	close(w->fd);
+	while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	utstring_free(w->buf);
+	free(w->cmd);
+	free(w);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/*
+ * Stop the workers, which exit once their stdin is closed.
+ */
+void
+worker_close(struct worker **workers)
+{
+	while (*workers != NULL)
+		worker_free(workers, *workers);
+}
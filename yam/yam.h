@@ -22,19 +22,26 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h> /* for FILE */
-#include <time.h> /* for time_t */
 #include <unistd.h> /* for pid_t */
 
 #include "utlist.h"
 #include "uthash.h"
+#include "utstring.h"
+
+struct log;
+struct eval;
 
 struct flags {
 	unsigned int clean :1;
 	unsigned int lint :1;
 	unsigned int fast :1;
 	unsigned int graphviz :1;
+	unsigned int reload :1;
 	uint8_t verbose;
 	int jobs;
+	/* Output directories of the variants, relative to the root */
+	char **variants;
+	int nvariants;
 };
 
 extern struct flags flags;
@@ -43,17 +50,39 @@ extern struct flags flags;
 #define NODE_JOB 1
 #define NODE_DEP_EXPLICIT 2
 #define NODE_DEP_IMPLICIT 3
+/* An output of a job other than the first, which is the name of the job */
+#define NODE_OUTPUT 4
+
+/* When a job without depfile is traced by the wrapper */
+#define TRACE_ALWAYS 0
+/* When it has not run yet, or its command changed */
+#define TRACE_NEW 1
+/* Never, its explicit dependencies are all it reads */
+#define TRACE_NEVER 2
 
 struct jobs {
 	struct node *head;
 	struct node *tail;
 };
 
+/*
+ * Limit on the number of jobs running at once, on top of `-j', like the
+ * pools of ninja.
+ */
+struct jobpool {
+	char *name;
+	/* 0 means no limit */
+	uint32_t depth;
+	uint32_t active;
+	UT_hash_handle hh;
+};
+
 struct graph {
 	struct node *index;
+	struct depset *depsets;
+	struct depset *depsets_list;
 	struct subdir *subdirs;
-	struct subdir *to_visit;
-	time_t log_mtime;
+	struct jobpool *pools;
 };
 
 struct nodes {
@@ -62,21 +91,95 @@ struct nodes {
 	size_t len;
 };
 
+struct stamp {
+	/*
+	 * If > 0 this is the actual mtime, in nanoseconds.
+	 * If 0, we don't know yet.
+	 * If < 0, this file does not exist.
+	 */
+	int64_t mtime;
+	int64_t size;
+};
+
+struct dep {
+	struct node *node;
+
+	/* Stamp of the dependency when the job last ran, found in the log */
+	struct stamp stamp;
+
+	/*
+	 * Order-only: the dependency is built first, but only makes the job out
+	 * of date if the job read it.
+	 */
+	unsigned int order :1;
+};
+
+struct deps {
+	struct dep *deps;
+	size_t cap;
+	size_t len;
+};
+
+#define DEPSET_UNKNOWN 0
+#define DEPSET_CLEAN 1
+#define DEPSET_DIRTY 2
+
+/*
+ * Set of implicit dependencies, with the stamps they had when the jobs ran.
+ * Many jobs read the same files, so the sets are interned and shared.
+ */
+struct depset {
+	uint64_t hash;
+	struct dep *deps;
+	size_t len;
+
+	/* Whether the dependencies still have their stamps, computed once */
+	unsigned int state :2;
+	/* Used when writing the log */
+	uint32_t id;
+
+	struct depset *next;
+	UT_hash_handle hh;
+};
+
+/* A set already in a journal */
+struct setref {
+	uint64_t hash;
+	UT_hash_handle hh;
+};
+
 struct node {
-	unsigned int type :2;
+	unsigned int type :3;
 	unsigned int todo :1;
 	unsigned int visited :1;
+	/* Needed by the targets of the command line */
+	unsigned int wanted :1;
+	/* Built during this run */
+	unsigned int finished :1;
+	/* Neither the node nor what it depends on can be declared anymore */
+	unsigned int settled :1;
+	unsigned int onstack :1;
+	/* An alias of its dependencies, without command nor output */
+	unsigned int phony :1;
+	/* Its dyndep file was read */
+	unsigned int dyndep_read :1;
+	/* Can run in the same shell as other jobs of its directory */
+	unsigned int batch :1;
+	/* TRACE_ALWAYS, TRACE_NEW or TRACE_NEVER */
+	unsigned int trace :2;
 	char *name;
 	char *cmd;
 	unsigned int new_cmd :1;
+	unsigned int logged :1;
 	const char *cwd;
+	/* Where the job was declared, its record is in the log of this subdir */
+	struct subdir *subdir;
 
-	/*
-	 * If > 0 this is the actual mtime.
-	 * If 0, we don't know yet.
-	 * If < 0, this file does not exist.
-	 */
-	time_t mtime;
+	struct stamp stamp;
+
+	/* Hash of the command and stamp of the output found in the log */
+	uint64_t log_cmd;
+	struct stamp log_stamp;
 
 	/*
 	 * Represent the number of node that needs to be built before this node
@@ -85,9 +188,44 @@ struct node {
 	 */
 	int waiting;
 
+	/* Used by the cycle detection */
+	unsigned int check;
+	unsigned int index;
+	unsigned int lowlink;
+	unsigned int scc;
+
 	/* Adjency list */
 	struct nodes parents;
-	struct nodes children;
+	struct deps children;
+
+	/* Implicit dependencies, found in the log */
+	struct depset *implicit;
+
+	/*
+	 * The other outputs of a job, built by the same run. Their `log_stamp'
+	 * is the stamp found in the record of the job, and `job' points back
+	 * to it.
+	 */
+	struct nodes outputs;
+	struct node *job;
+
+	/*
+	 * File listing more dependencies, built by an order-only dependency
+	 * of the job.
+	 */
+	struct node *dyndep;
+	/*
+	 * Makefile-like file where the command writes what it read, instead of
+	 * being traced by the wrapper.
+	 */
+	char *depfile;
+	/* NULL if the job is only limited by `-j' */
+	struct jobpool *pool;
+	/* Command of the tool running `cmd' as a request, NULL if none */
+	char *worker;
+	/* Response file written before `cmd' runs, and its content */
+	char *rspfile;
+	char *rspcontent;
 
 	/* Linked list of waiting jobs */
 	struct node *next;
@@ -97,47 +235,249 @@ struct node {
 	UT_hash_handle hh;
 };
 
+/*
+ * A directory with a Yamfile. The state of the jobs it declares is kept in
+ * its own log, so builds of disjoint subtrees do not touch the same files.
+ * With variants, the Yamfile is evaluated once per variant, each being a
+ * subdir of its own in the output directory of the variant.
+ */
 struct subdir {
+	/* Where its targets are declared, below its variant if any */
 	char path[MAXPATHLEN + 1];
+	/* The directory of the Yamfile, where the jobs run */
+	char src[MAXPATHLEN + 1];
+	struct nodes jobs;
+
+	/* Lock held from the load of the log until the end of the build */
+	int lock;
+	struct log *log;
+	/* Number of records in the log, to know when to compact it */
+	uint32_t log_live;
+	uint32_t log_dead;
+	/* Sets of implicit dependencies already in the journal */
+	struct setref *sets;
+	/* Jobs to build once this subdir is evaluated */
+	struct nodes blocked;
+
 	struct subdir *next;
 	struct subdir *prev;
 };
 
+#define FRAGMENT_NORULE UINT32_MAX
+#define FRAGMENT_ALIAS (UINT32_MAX - 1)
+
+struct ftarget {
+	char *name;
+	/* The command, or the rule and the source as written in the Yamfile */
+	char *cmd;
+	uint32_t rule;
+	char *in;
+	char **deps;
+	size_t ndeps;
+	size_t cap;
+	/* The outputs other than `name' */
+	char **outputs;
+	size_t noutputs;
+	size_t capoutputs;
+	/* The order-only dependencies */
+	char **order;
+	size_t norder;
+	size_t caporder;
+	/* File listing more dependencies, NULL if none */
+	char *dyndep;
+	/* File where the command writes its dependencies, NULL if none */
+	char *depfile;
+	/* Name of the pool of the job, NULL if none */
+	char *pool;
+	/* Tiny job, run along with others by a single shell */
+	bool batch;
+	/* Command of the persistent tool running the job, NULL if none */
+	char *worker;
+	/* File written with `rspcontent' before the command runs, NULL if none */
+	char *rspfile;
+	char *rspcontent;
+	/* When it is traced, TRACE_ALWAYS by default */
+	uint32_t trace;
+};
+
+/* A pool declared by a ninja manifest */
+struct fpool {
+	char *name;
+	uint32_t depth;
+};
+
+/* A file or an environment variable read by a Yamfile */
+struct finput {
+	char *name;
+	/* Value of the environment variable, NULL if unset */
+	char *value;
+	unsigned int env :1;
+	/* Stamp of the file */
+	struct stamp stamp;
+};
+
+/*
+ * What the Yamfile of a subdir declared, along with what it read. It is
+ * cached and reused as long as none of the inputs changed.
+ * Paths are relative to the root.
+ */
+struct fragment {
+	struct ftarget *targets;
+	size_t ntargets;
+	size_t captargets;
+	/* Command templates of add_rule() */
+	char **rules;
+	size_t nrules;
+	size_t caprules;
+	char **subdirs;
+	size_t nsubdirs;
+	size_t capsubdirs;
+	struct finput *inputs;
+	size_t ninputs;
+	size_t capinputs;
+	struct fpool *pools;
+	size_t npools;
+	size_t cappools;
+	/* It ran commands with io.popen() or os.execute(), not to be cached */
+	bool uncached;
+};
+
 /* graph */
 void graph_init(struct graph *g);
 void graph_free(struct graph *g);
 struct node * graph_get(struct graph *g, const char *key, bool create);
-void graph_add_dep(struct graph *g, struct node *n, const char *name, int type);
+struct dep * graph_add_dep(struct graph *g, struct node *n, const char *name,
+		int type);
+int graph_add_output(struct graph *g, struct node *n, const char *name);
+bool dep_stamped(const struct dep *dep);
+void node_stat(struct node *n);
+void file_stamp(const char *path, struct stamp *stamp);
+void nodes_add(struct nodes *ns, struct node *n);
+struct jobpool * graph_pool(struct graph *g, const char *name);
+struct depset * graph_depset(struct graph *g, struct dep *deps, size_t len);
+struct depset * graph_restamp(struct graph *g, struct depset *ds);
 
-unsigned int graph_compute(struct graph *g, struct node **jobs);
+unsigned int graph_compute(struct graph *g, struct node *n,
+		struct node **jobs);
+int graph_check_cycles(struct graph *g);
 
-int graph_dump_log(struct graph *g, FILE *log);
+int graph_dump_log(struct graph *g, struct subdir *sd, struct log *log);
 
 void dump_graphviz(struct graph *g, FILE *out);
 
 /* yamfile */
-void yamfile(struct graph *g, const char *root);
+struct eval * yamfile_start(struct graph *g, const char *root);
+void yamfile_want(struct eval *e, const char *path);
+void yamfile_eval(struct eval *e, struct subdir *sd);
+int yamfile_fd(struct eval *e);
+struct subdir * yamfile_next(struct eval *e, bool wait);
+struct subdir * yamfile_pending(struct eval *e, const char *path);
+bool yamfile_done(struct eval *e);
+int yamfile_errors(struct eval *e);
+void yamfile_stop(struct eval *e);
+void yamfile_finish(struct eval *e);
+int yamfile(struct graph *g, const char *root);
+
+/* ninja */
+int ninja_load(const char *root, const char *dir, const char *path,
+		struct fragment *f, char *err, size_t errlen);
+
+/* cache */
+void fragment_init(struct fragment *f);
+void fragment_free(struct fragment *f);
+struct ftarget * fragment_target(struct fragment *f, const char *name,
+		const char *cmd);
+struct ftarget * fragment_alias(struct fragment *f, const char *name);
+struct ftarget * fragment_rule_target(struct fragment *f, const char *name,
+		uint32_t rule, const char *in);
+uint32_t fragment_rule(struct fragment *f, const char *cmd);
+char * fragment_cmd(const struct fragment *f, const struct ftarget *t,
+		const char *dir);
+void fragment_dep(struct ftarget *t, const char *path);
+void fragment_output(struct ftarget *t, const char *path);
+void fragment_order(struct ftarget *t, const char *path);
+void fragment_subdir(struct fragment *f, const char *path);
+void fragment_input(struct fragment *f, const char *path);
+void fragment_stamp(struct fragment *f, const char *path,
+		const struct stamp *stamp);
+void fragment_env(struct fragment *f, const char *name, const char *value);
+void fragment_pool(struct fragment *f, const char *name, uint32_t depth);
+int cache_load(const char *dir, struct fragment *f);
+int cache_save(const char *dir, const struct fragment *f);
+void stat_cached(const char *path, struct stamp *stamp);
+bool stat_lookup(const char *path, struct stamp *stamp);
+char ** stat_list(const char *path, size_t *n, struct stamp *stamp);
+void stat_clear(void);
+void shell_load(void);
+void shell_save(void);
+int shell_run(const char *dir, const char *cmd, const char **envs,
+		size_t nenvs, struct fragment *f, UT_string *out);
 
 /* do */
-int do_jobs(struct graph *g, char *root);
+int do_jobs(struct graph *g, char *root, char **targets, int ntargets);
 
 /* subprocess */
-pid_t popen2(const char *cmd, const char *cwd, int child_id, int *fd);
+pid_t popen2(const char *cmd, const char *cwd, int child_id, bool traced,
+		int *fd);
 int pclose2(pid_t pid, int fd);
 
+/*
+ * A tool kept running between the jobs, which run their commands as
+ * requests to it.
+ */
+struct worker {
+	char *cmd;
+	const char *cwd;
+	pid_t pid;
+	/* Its stdin and stdout */
+	int fd;
+	unsigned int busy :1;
+	/* What it answered so far */
+	UT_string *buf;
+	struct worker *next;
+};
+
+/* builtin */
+/* Start of the commands run by yam itself, a no-op for a shell */
+#define BUILTIN_PREFIX ":yam "
+bool builtin_cmd(const char *cmd);
+const char * builtin_check(const char *name, int nargs);
+int builtin_run(const char *cmd, const char *cwd, UT_string *out,
+		void (*cb)(void *, unsigned char, const char *), void *arg);
+void resolve_path(const char *cwd, const char *path, char *buf, size_t len);
+
+/* worker */
+struct worker * worker_get(struct worker **workers, const char *cmd,
+		const char *cwd);
+int worker_send(struct worker *w, const char *cmd);
+int worker_read(struct worker *w, int *status, UT_string *out,
+		void (*cb)(void *, unsigned char, const char *), void *arg);
+int worker_free(struct worker **workers, struct worker *w);
+void worker_close(struct worker **workers);
+
 /* ipc */
 int ipc_listen(int num_clients);
+void ipc_child(void);
+int ipc_run(const char *cmd, const char *cwd, UT_string *out, bool *traced,
+		void (*cb)(void *, const char *), void *arg);
 void ipc_close(int fd);
 FILE * ipc_accept(int fd);
 
 /* log */
-FILE * log_open(const char *dir);
-int log_entry_start(FILE *log, const char *name, const char *cmd);
-int log_entry_dep(FILE *log, const char *path);
-int log_entry_finish(FILE *log);
-int log_close(FILE *fp, const char *dir);
+struct log * log_open(struct graph *g, struct subdir *sd);
+int log_entry_set(struct log *log, struct depset *set);
+int log_entry_start(struct log *log, const char *name, uint64_t cmd,
+		const struct stamp *stamp, const struct depset *set);
+int log_entry_dep(struct log *log, const char *path, const struct stamp *stamp,
+		int type);
+int log_entry_finish(struct log *log);
+int log_close(struct log *log);
+uint64_t log_hash(const char *str);
+uint64_t log_cmd_hash(const struct node *n);
 
-int log_load(const char *dir, struct graph *g);
+int log_load(struct graph *g, struct subdir *sd);
+void log_unlock(struct subdir *sd);
+int log_text_finish(struct graph *g, bool all);
 
 /* err */
 void perrorf(const char *fmt, ...);
@@ -15,7 +15,15 @@
  */
 
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -23,26 +31,250 @@
 
 #include "yam.h"
 
-/* No `void *data' for Lua callback... */
+/*
+ * The Yamfiles are evaluated by a pool of threads, each with its own
+ * lua_State, without changing the current directory. The fragments are
+ * merged in the graph by the main thread as soon as they are evaluated.
+ *
+ * A Yamfile only declares targets and subdirs below its own directory:
+ * a subdir is merged after its parent, and two other subdirs never declare
+ * the same path, so the graph does not depend on the order of the merges.
+ * It also means that once no subdir above a path is left to merge, nothing
+ * can change the node of this path anymore, and the jobs depending on it
+ * can start.
+ * Only the subdirs below the wanted paths are evaluated, along with the
+ * ones asked for by yamfile_eval(), which may declare a path we need.
+ *
+ * With variants, each Yamfile is evaluated once per variant, with VARIANT
+ * set to its output directory and OUT to the directory where the subdir
+ * declares its targets in it. All the variants share the stats of the
+ * sources and the modules loaded by the threads, and are built together.
+ */
+
+/*
+ * Cache of the directories we already resolved, so we only pay realpath(3)
+ * once per directory instead of once per path.
+ */
+struct dir {
+	char *path;	/* absolute, as written in the Yamfile */
+	char *real;	/* relative to the root, "" for the root itself */
+	UT_hash_handle hh;
+};
+
+/* A subdir to evaluate */
+struct visit {
+	struct subdir *subdir;
+	/* Its variant, NULL without variants */
+	const char *variant;
+	struct fragment fragment;
+	/* Whether it was handed to the threads, and merged in the graph */
+	bool queued;
+	bool merged;
+	/* Why the Yamfile could not be evaluated, it is never merged then */
+	char *error;
+	struct visit **children;
+	size_t nchildren;
+	/* In the queue, or in the list of the evaluated visits */
+	struct visit *next;
+	/* In the index of the visits */
+	UT_hash_handle hh;
+};
+
+struct pool {
+	pthread_mutex_t mtx;
+	/* Signaled when a visit is queued, or when it is time to quit */
+	pthread_cond_t work;
+	/* Signaled when a visit is done */
+	pthread_cond_t done;
+	struct visit *queue;
+	/* Evaluated, not merged yet */
+	struct visit *evaluated;
+	bool quit;
+	/* Written to when a visit is done, for the poll(2) loop */
+	int notify;
+};
+
+/* Evaluation in progress */
+struct eval {
+	struct pool pool;
+	pthread_t *threads;
+	long nthreads;
+	int pipe[2];
+	/* Number of visits queued and not merged yet */
+	unsigned int running;
+	/* Number of Yamfiles which failed, not reported yet */
+	int errors;
+	/* Nothing more is evaluated, the build failed */
+	bool stopped;
+	/* All the subdirs declared so far, by path */
+	struct visit *visits;
+	/* Everything below these paths is evaluated */
+	char **wanted;
+	size_t nwanted;
+	size_t capwanted;
+};
+
+/* What the Lua callbacks need, found in the registry */
+struct context {
+	const char *dir;
+	/* Where the targets are declared, `dir' without variants */
+	const char *out;
+	struct fragment *fragment;
+	/*
+	 * What the modules loaded once for all the subdirs read, it is added
+	 * to the inputs of all of them
+	 */
+	struct fragment *shared;
+};
+
+#define CONTEXT_KEY "yam.context"
+/*
+ * Modules found relative to a subdir, by the real path of their file. They
+ * are kept for the other subdirs finding the same file, but their names are
+ * only in package.loaded during the evaluation of a subdir finding them.
+ */
+#define MODULES_KEY "yam.modules"
+#define RELATIVE_KEY "yam.relative"
+/* The templates of package.path and package.cpath, before fix_package_path() */
+#define PATH_KEY "yam.path"
+#define CPATH_KEY "yam.cpath"
+
+/*
+ * The Yamfiles are compiled once, the bytecode is cached in the subdir
+ * along with the stamp of the Yamfile.
+ */
+#define CHUNK_FILETEMP ".yam.chunk.temp"
+#define CHUNK_FILE ".yam.chunk"
+#define CHUNK_MAGIC "YAMCHUNK"
+#define CHUNK_VERSION 1
+
 static struct graph *_g = NULL;
+static const char *_root = NULL;
 static size_t _rootlen = 0;
-static struct subdir *_subdir = NULL;
-static struct subdir *_subdirs = NULL;
+static struct dir *_dirs = NULL;
+static pthread_mutex_t _dirs_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* The variants of a Yamfile may be compiled by several threads at once */
+static pthread_mutex_t _chunk_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Return the directory `path' relative to the root, raising an error in `L'
+ * if it does not exist or is outside of the root.
+ */
+static const char *
+resolve_dir(lua_State *L, const char *path)
+{
+	char buf[PATH_MAX];
+	struct dir *d, *found;
+
+	pthread_mutex_lock(&_dirs_mtx);
+	HASH_FIND_STR(_dirs, path, d);
+	pthread_mutex_unlock(&_dirs_mtx);
+	if (d != NULL)
+		return d->real;
+
+	if (realpath(path, buf) == NULL)
+		luaL_error(L, "realpath(%s): %s", path, strerror(errno));
+
+	if (strncmp(buf, _root, _rootlen) != 0 ||
+		(buf[_rootlen] != '/' && buf[_rootlen] != '\0'))
+		luaL_error(L, "%s is outside of %s", path, _root);
+
+	d = calloc(1, sizeof(struct dir));
+	if (d == NULL)
+		die("calloc()");
+	d->path = strdup(path);
+	d->real = strdup(buf[_rootlen] == '\0' ? "" : buf + _rootlen + 1);
+
+	/* Another thread may have resolved it in the meantime */
+	pthread_mutex_lock(&_dirs_mtx);
+	HASH_FIND_STR(_dirs, path, found);
+	if (found == NULL)
+		HASH_ADD_KEYPTR(hh, _dirs, d->path, strlen(d->path), d);
+	pthread_mutex_unlock(&_dirs_mtx);
+
+	if (found != NULL) {
+		free(d->path);
+		free(d->real);
+		free(d);
+		return found->real;
+	}
+
+	return d->real;
+}
+
+static void
+free_dirs(void)
+{
+	struct dir *d, *tmp;
+
+	HASH_ITER(hh, _dirs, d, tmp) {
+		HASH_DEL(_dirs, d);
+		free(d->path);
+		free(d->real);
+		free(d);
+	}
+}
 
+/*
+ * Return the path of `src', relative to the subdir `dir', relative to the
+ * root.
+ * Only the directory part is resolved (symlinks, `.' and `..'), the last
+ * component is appended lexically as most of the targets do not exist yet.
+ */
 static char *
-get_path(const char *src, char *buf)
+get_path(lua_State *L, const char *dir, const char *src, char *buf)
 {
-	char *p;
+	char path[PATH_MAX];
+	const char *real;
+	char *base;
+	char *slash;
+
+	if (src[0] == '/')
+		snprintf(path, sizeof(path), "%s", src);
+	else
+		snprintf(path, sizeof(path), "%s/%s/%s", _root, dir, src);
+
+	slash = strrchr(path, '/');
+	base = slash + 1;
+
+	if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+		/* `src' is a directory */
+		real = resolve_dir(L, path);
+		snprintf(buf, PATH_MAX, "%s", real[0] != '\0' ? real : ".");
+		return buf;
+	}
+
+	if (slash == path)
+		real = resolve_dir(L, "/");
+	else {
+		*slash = '\0';
+		real = resolve_dir(L, path);
+	}
+
+	if (real[0] == '\0')
+		snprintf(buf, PATH_MAX, "%s", base);
+	else
+		snprintf(buf, PATH_MAX, "%s/%s", real, base);
+
+	return buf;
+}
 
-	if ((p = realpath(src, buf)) == NULL)
-		die("realpath(%s)", src);
-	p += _rootlen + 1;
+/*
+ * Return `path', relative to the subdir `dir', relative to the current
+ * directory which is the root.
+ */
+static const char *
+subdir_path(const char *dir, const char *path, char *buf)
+{
+	if (path[0] == '/' || strcmp(dir, ".") == 0)
+		return path;
 
-	return p;
+	snprintf(buf, PATH_MAX, "%s/%s", dir, path);
+	return buf;
 }
 
 static struct subdir *
-new_subdir(const char *path)
+new_subdir(const char *path, const char *src)
 {
 	struct subdir *s;
 
@@ -51,125 +283,1811 @@ new_subdir(const char *path)
 		die("calloc()");
 
 	strncpy(s->path, path, sizeof(s->path));
+	strncpy(s->src, src, sizeof(s->src));
+	s->lock = -1;
 
 	return s;
 }
 
+/*
+ * Whether `path' is strictly below the subdir `dir'.
+ */
+static bool
+in_scope(const char *dir, const char *path)
+{
+	size_t len;
+
+	if (strcmp(dir, ".") == 0)
+		return strcmp(path, ".") != 0;
+
+	len = strlen(dir);
+	return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+/*
+ * Return the path of `out' relative to the subdir `dir'.
+ */
+static const char *
+out_path(const char *dir, const char *out, char *buf)
+{
+	const char *p;
+	size_t len = 0;
+
+	if (strcmp(dir, out) == 0)
+		return ".";
+
+	buf[0] = '\0';
+	if (strcmp(dir, ".") != 0) {
+		for (p = dir; p != NULL; p = strchr(p + 1, '/'))
+			len += snprintf(buf + len, PATH_MAX - len, "../");
+	}
+	snprintf(buf + len, PATH_MAX - len, "%s", out);
+
+	return buf;
+}
+
+/*
+ * Create the output directory of a variant, and the ones above it. Return
+ * -1 with the reason in `err' if it can not.
+ */
 static int
-l_add_target(lua_State *L)
+make_dirs(const char *path, char *err, size_t errlen)
+{
+	char buf[PATH_MAX];
+	char *slash;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (slash = strchr(buf, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (slash != NULL)
+			*slash = '\0';
+		if (mkdir(buf, 0777) != 0 && errno != EEXIST) {
+			snprintf(err, errlen, "mkdir(%s): %s", buf, strerror(errno));
+			return -1;
+		}
+		if (slash == NULL)
+			break;
+		*slash = '/';
+	}
+
+	return 0;
+}
+
+static struct context *
+get_context(lua_State *L)
+{
+	struct context *ctx;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CONTEXT_KEY);
+	ctx = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return ctx;
+}
+
+/*
+ * Add the paths of the table at `idx' to the dependencies of `t', or to its
+ * order-only dependencies.
+ */
+static void
+add_deps(lua_State *L, struct context *ctx, struct ftarget *t, int idx,
+		 bool order, const char *func)
 {
+	char buf[PATH_MAX];
+	const char *path;
 	int i;
 	int tlen;
+
+	tlen = luaL_getn(L, idx);
+	for (i = 1; i <= tlen; i++) {
+		lua_rawgeti(L, idx, i);
+
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "%s: the table shall only contain strings", func);
+
+		path = get_path(L, ctx->dir, lua_tostring(L, -1), buf);
+		if (order)
+			fragment_order(t, path);
+		else
+			fragment_dep(t, path);
+
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * Return the path of the target `name', which has to be below the subdir,
+ * or below its output directory in a variant.
+ */
+static const char *
+target_path(lua_State *L, struct context *ctx, const char *name, char *buf,
+			const char *func)
+{
+	const char *path;
+
+	path = get_path(L, ctx->dir, name, buf);
+	if (!in_scope(ctx->out, path))
+		luaL_error(L, "%s: %s is not below %s", func, path, ctx->out);
+
+	return path;
+}
+
+/*
+ * Add the order-only dependencies of the table at `idx', and the options in
+ * its fields:
+ * - depfile: the Makefile-like file where the command writes what it read,
+ *   it is not traced then. For a rule, `%' is the stem of the target.
+ * - batch: the command is so quick that it runs along with other ones in
+ *   a single shell.
+ * - worker: the command starting a tool kept running between the jobs,
+ *   which runs the command of the job as a request instead of a shell.
+ * - trace: when the wrapper finds the files the job reads, without a
+ *   depfile: "always", the default, "new" when it has not run yet or its
+ *   command changed, or "never" when its dependencies are all declared.
+ */
+static void
+add_options(lua_State *L, struct context *ctx, struct ftarget *t, int idx,
+			const char *stem, size_t stemlen, const char *func)
+{
+	char buf[PATH_MAX];
+	char depfile[PATH_MAX];
+	const char *p;
+	const char *pct;
+
+	add_deps(L, ctx, t, idx, true, func);
+
+	lua_getfield(L, idx, "depfile");
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		p = lua_tostring(L, -1);
+		if (stem != NULL && (pct = strchr(p, '%')) != NULL) {
+			snprintf(depfile, sizeof(depfile), "%.*s%.*s%s",
+					 (int)(pct - p), p, (int)stemlen, stem, pct + 1);
+			p = depfile;
+		}
+		free(t->depfile);
+		t->depfile = strdup(get_path(L, ctx->dir, p, buf));
+	} else if (!lua_isnil(L, -1))
+		luaL_error(L, "%s: depfile shall be a string", func);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "batch");
+	t->batch = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "worker");
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		free(t->worker);
+		t->worker = strdup(lua_tostring(L, -1));
+	} else if (!lua_isnil(L, -1))
+		luaL_error(L, "%s: worker shall be a string", func);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "trace");
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		p = lua_tostring(L, -1);
+		if (strcmp(p, "always") == 0)
+			t->trace = TRACE_ALWAYS;
+		else if (strcmp(p, "new") == 0)
+			t->trace = TRACE_NEW;
+		else if (strcmp(p, "never") == 0)
+			t->trace = TRACE_NEVER;
+		else
+			luaL_error(L, "%s: trace shall be \"always\", \"new\" or"
+					   " \"never\"", func);
+	} else if (!lua_isnil(L, -1))
+		luaL_error(L, "%s: trace shall be a string", func);
+	lua_pop(L, 1);
+}
+
+/*
+ * Declare the job running `cmd' to build the output, or the table of
+ * outputs, at `idx'.
+ */
+static struct ftarget *
+add_job(lua_State *L, struct context *ctx, int idx, const char *cmd,
+		const char *func)
+{
 	char buf[PATH_MAX];
 	const char *path;
+	struct ftarget *t = NULL;
+	int i;
+	int tlen;
 
-	struct node *n;
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		path = target_path(L, ctx, lua_tostring(L, idx), buf, func);
+		return fragment_target(ctx->fragment, path, cmd);
+	}
 
-	if(lua_gettop(L) != 3)
+	if (lua_type(L, idx) != LUA_TTABLE || (tlen = luaL_getn(L, idx)) == 0)
+		luaL_error(L, "%s: the outputs shall be a string or a table of"
+				   " strings", func);
+
+	for (i = 1; i <= tlen; i++) {
+		lua_rawgeti(L, idx, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "%s: the table shall only contain strings", func);
+
+		path = target_path(L, ctx, lua_tostring(L, -1), buf, func);
+		if (t == NULL)
+			t = fragment_target(ctx->fragment, path, cmd);
+		else
+			fragment_output(t, path);
+
+		lua_pop(L, 1);
+	}
+
+	return t;
+}
+
+static int
+l_add_target(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+	struct ftarget *t;
+
+	if (lua_gettop(L) == 3)
+		lua_newtable(L);
+	if (lua_gettop(L) != 4)
 		luaL_error(L, "add_target: incorrect number of arguments");
 
-	luaL_checktype(L, 1, LUA_TSTRING);
 	luaL_checktype(L, 2, LUA_TSTRING);
 	luaL_checktype(L, 3, LUA_TTABLE);
+	luaL_checktype(L, 4, LUA_TTABLE);
+
+	t = add_job(L, ctx, 1, lua_tostring(L, 2), "add_target");
+	add_deps(L, ctx, t, 3, false, "add_target");
+	add_options(L, ctx, t, 4, NULL, 0, "add_target");
+
+	return 0;
+}
+
+/*
+ * add_targets({{out, cmd, {deps}}, ...}): add_target() for each element.
+ */
+static int
+l_add_targets(lua_State *L)
+{
+	int i;
+	int tlen;
+
+	struct context *ctx = get_context(L);
+	struct ftarget *t;
+
+	if(lua_gettop(L) != 1)
+		luaL_error(L, "add_targets: incorrect number of arguments");
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	tlen = luaL_getn(L, 1);
+	for (i = 1; i <= tlen; i++) {
+		lua_rawgeti(L, 1, i);
+		if (lua_type(L, 2) != LUA_TTABLE)
+			luaL_error(L, "add_targets: the table shall only contain tables");
+		lua_rawgeti(L, 2, 1);
+		lua_rawgeti(L, 2, 2);
+		lua_rawgeti(L, 2, 3);
+		lua_rawgeti(L, 2, 4);
+		if ((lua_type(L, 3) != LUA_TSTRING && lua_type(L, 3) != LUA_TTABLE) ||
+			lua_type(L, 4) != LUA_TSTRING || lua_type(L, 5) != LUA_TTABLE ||
+			(lua_type(L, 6) != LUA_TTABLE && lua_type(L, 6) != LUA_TNIL))
+			luaL_error(L, "add_targets: each target shall be"
+					   " {out, cmd, {deps}, [{order-only deps, options}]}");
+
+		t = add_job(L, ctx, 3, lua_tostring(L, 4), "add_targets");
+		add_deps(L, ctx, t, 5, false, "add_targets");
+		if (lua_type(L, 6) == LUA_TTABLE)
+			add_options(L, ctx, t, 6, NULL, 0, "add_targets");
 
-	path = get_path(lua_tostring(L, 1), buf);
-	n = graph_get(_g, path, true);
+		lua_pop(L, 5);
+	}
+
+	return 0;
+}
+
+/*
+ * Split `pattern' around its `%'.
+ */
+static void
+split_pattern(lua_State *L, const char *pattern, size_t *prefix,
+			  const char **suffix)
+{
+	const char *p;
+
+	if ((p = strchr(pattern, '%')) == NULL || strchr(p + 1, '%') != NULL)
+		luaL_error(L, "add_rule: %s shall contain one %%", pattern);
+
+	*prefix = p - pattern;
+	*suffix = p + 1;
+}
+
+/*
+ * add_rule(out, in, cmd, {sources}, [{deps}], [{order-only deps, options}]):
+ * add a target for each source matching the pattern `in', named after the
+ * pattern `out', `%' being the same in both. The command is a template
+ * where `$in' is the source and `$out' the target, expanded when needed.
+ * Return the table of the targets, as written in the Yamfile.
+ */
+static int
+l_add_rule(lua_State *L)
+{
+	char buf[PATH_MAX];
+	char out[PATH_MAX];
+	const char *outpat, *inpat;
+	const char *outsuffix, *insuffix;
+	const char *src;
+	const char *path;
+	size_t outprefix, inprefix;
+	size_t srclen, insuffixlen;
+	uint32_t rule;
+	int i;
+	int tlen;
+
+	struct context *ctx = get_context(L);
+	struct ftarget *t;
+
+	if (lua_gettop(L) == 4)
+		lua_newtable(L);
+	if (lua_gettop(L) == 5)
+		lua_newtable(L);
+	if (lua_gettop(L) != 6)
+		luaL_error(L, "add_rule: incorrect number of arguments");
+
+	luaL_checktype(L, 1, LUA_TSTRING);
+	luaL_checktype(L, 2, LUA_TSTRING);
+	luaL_checktype(L, 3, LUA_TSTRING);
+	luaL_checktype(L, 4, LUA_TTABLE);
+	luaL_checktype(L, 5, LUA_TTABLE);
+	luaL_checktype(L, 6, LUA_TTABLE);
 
-	n->cmd = strdup(lua_tostring(L, 2));
-	n->type = NODE_JOB;
-	n->cwd = _subdir->path;
+	outpat = lua_tostring(L, 1);
+	inpat = lua_tostring(L, 2);
+	split_pattern(L, outpat, &outprefix, &outsuffix);
+	split_pattern(L, inpat, &inprefix, &insuffix);
+	insuffixlen = strlen(insuffix);
 
-	tlen = luaL_getn(L, 3);
+	/* The same command for all the targets */
+	rule = fragment_rule(ctx->fragment, lua_tostring(L, 3));
+
+	lua_newtable(L);
+	tlen = luaL_getn(L, 4);
 	for (i = 1; i <= tlen; i++) {
-		lua_rawgeti(L, 3, i);
+		lua_rawgeti(L, 4, i);
+		if (lua_type(L, 8) != LUA_TSTRING)
+			luaL_error(L, "add_rule: the table shall only contain strings");
+		src = lua_tolstring(L, 8, &srclen);
+
+		if (srclen < inprefix + insuffixlen ||
+			strncmp(src, inpat, inprefix) != 0 ||
+			strcmp(src + srclen - insuffixlen, insuffix) != 0)
+			luaL_error(L, "add_rule: %s does not match %s", src, inpat);
 
-		if (lua_type(L, 4) != LUA_TSTRING)
-			luaL_error(L, "add_target: the table shall only"
-				   " contain strings");
+		snprintf(out, sizeof(out), "%.*s%.*s%s", (int)outprefix, outpat,
+				 (int)(srclen - inprefix - insuffixlen), src + inprefix,
+				 outsuffix);
 
-		path = get_path(lua_tostring(L, 4), buf);
-		graph_add_dep(_g, n, path, NODE_DEP_EXPLICIT);
+		path = target_path(L, ctx, out, buf, "add_rule");
+		t = fragment_rule_target(ctx->fragment, path, rule, src);
+		fragment_dep(t, get_path(L, ctx->dir, src, buf));
+		add_deps(L, ctx, t, 5, false, "add_rule");
+		add_options(L, ctx, t, 6, src + inprefix,
+					srclen - inprefix - insuffixlen, "add_rule");
 
 		lua_pop(L, 1);
+		lua_pushstring(L, out);
+		lua_rawseti(L, 7, i);
 	}
 
+	return 1;
+}
+
+/*
+ * Declare a phony target, standing for the targets it depends on.
+ */
+static int
+l_add_alias(lua_State *L)
+{
+	char buf[PATH_MAX];
+	const char *path;
+	struct context *ctx = get_context(L);
+	struct ftarget *t;
+
+	if (lua_gettop(L) != 2)
+		luaL_error(L, "add_alias: incorrect number of arguments");
+
+	luaL_checktype(L, 1, LUA_TSTRING);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	path = target_path(L, ctx, lua_tostring(L, 1), buf, "add_alias");
+	t = fragment_alias(ctx->fragment, path);
+	add_deps(L, ctx, t, 2, false, "add_alias");
+
 	return 0;
 }
 
+/*
+ * add_dyndep(target, file): the job building `target' depends on what is
+ * listed in `file', built by another job. The file has lines of
+ * `target: dependencies', with paths relative to the subdir.
+ */
 static int
-l_subdir(lua_State *L)
+l_add_dyndep(lua_State *L)
 {
 	char buf[PATH_MAX];
 	const char *path;
-	struct subdir *s;
+	struct context *ctx = get_context(L);
+	struct ftarget *t = NULL;
+	size_t i;
 
-	if(lua_gettop(L) != 1)
-		luaL_error(L, "subdir: incorrect number of arguments");
+	if (lua_gettop(L) != 2)
+		luaL_error(L, "add_dyndep: incorrect number of arguments");
 
 	luaL_checktype(L, 1, LUA_TSTRING);
-	path = get_path(lua_tostring(L, 1), buf);
+	luaL_checktype(L, 2, LUA_TSTRING);
 
-	s = new_subdir(path);
-	/*
-	 * Prepend, so the last subdir is at the beginning.
-	 */
-	DL_PREPEND(_subdirs, s);
+	/* Most likely one of the last targets */
+	path = get_path(L, ctx->dir, lua_tostring(L, 1), buf);
+	for (i = ctx->fragment->ntargets; i > 0 && t == NULL; i--) {
+		if (strcmp(ctx->fragment->targets[i - 1].name, path) == 0)
+			t = &ctx->fragment->targets[i - 1];
+	}
+	if (t == NULL || t->rule == FRAGMENT_ALIAS)
+		luaL_error(L, "add_dyndep: %s is not a job of %s", path, ctx->dir);
+
+	path = get_path(L, ctx->dir, lua_tostring(L, 2), buf);
+	free(t->dyndep);
+	t->dyndep = strdup(path);
 
 	return 0;
 }
 
-static void
-visit_subdir(struct subdir *s, const char *root)
+/*
+ * ninja(path): add the builds of the ninja manifest at `path', which run
+ * from its directory. Their outputs have to be below the subdir.
+ */
+static int
+l_ninja(lua_State *L)
 {
-	struct subdir *tmp;
-	lua_State *L;
+	char buf[PATH_MAX];
+	char err[PATH_MAX + 256];
+	const char *path;
+	struct context *ctx = get_context(L);
+	struct ftarget *t;
+	size_t i, j;
+	size_t first = ctx->fragment->ntargets;
 
-	_subdir = s;
-	_subdirs = NULL;
+	if (lua_gettop(L) != 1)
+		luaL_error(L, "ninja: incorrect number of arguments");
 
-	if (chdir(s->path) != 0)
-		die("chdir(%s)", s->path);
+	luaL_checktype(L, 1, LUA_TSTRING);
+	path = get_path(L, ctx->dir, lua_tostring(L, 1), buf);
+	if (ninja_load(_root, ctx->dir, path, ctx->fragment, err,
+				   sizeof(err)) != 0)
+		luaL_error(L, "ninja: %s", err);
 
-	L = luaL_newstate();
-	luaL_openlibs(L);
-	lua_register(L, "add_target", l_add_target);
-	lua_register(L, "subdir", l_subdir);
+	for (i = first; i < ctx->fragment->ntargets; i++) {
+		t = &ctx->fragment->targets[i];
+		if (!in_scope(ctx->out, t->name))
+			luaL_error(L, "ninja: %s is not below %s", t->name, ctx->out);
+		for (j = 0; j < t->noutputs; j++) {
+			if (!in_scope(ctx->out, t->outputs[j]))
+				luaL_error(L, "ninja: %s is not below %s", t->outputs[j],
+						   ctx->out);
+		}
+	}
 
-	if (luaL_dofile(L, "Yamfile") != 0)
-		diex("luaL_dofile(): %s\n", lua_tostring(L, -1));
+	return 0;
+}
 
-	lua_close(L);
+/*
+ * builtin(name, paths...): the command running the builtin `name' of yam on
+ * the paths, relative to the subdir, without a process:
+ * - copy src dst, sharing the blocks of src when the file system can;
+ * - link src dst, a hard link;
+ * - mkdir dirs..., with their parents;
+ * - touch files... or stamp files...;
+ * - rm files....
+ * The paths may be `$in' and `$out', as in any command.
+ */
+static int
+l_builtin(lua_State *L)
+{
+	UT_string *cmd;
+	const char *name, *err;
+	const char *path;
+	int nargs = lua_gettop(L);
+	int i;
 
-	/*
-	 * _subdirs being a LIFO, we prepend so we restore the correct order
-	 * at the beginning of to_visit.
-	 */
-	while (_subdirs != NULL) {
-		tmp = _subdirs;
-		DL_DELETE(_subdirs, tmp);
-		DL_PREPEND(_g->to_visit, tmp);
+	name = luaL_checkstring(L, 1);
+	if ((err = builtin_check(name, nargs - 1)) != NULL)
+		luaL_error(L, "builtin: %s: %s", name, err);
+	for (i = 2; i <= nargs; i++) {
+		path = luaL_checkstring(L, i);
+		if (path[0] == '\0' || strpbrk(path, " \t\n") != NULL)
+			luaL_error(L, "builtin: %s: invalid path \"%s\"", name, path);
 	}
 
-	if (chdir(root) != 0)
-		die("chdir(%s)", root);
+	utstring_new(cmd);
+	utstring_printf(cmd, BUILTIN_PREFIX "%s", name);
+	for (i = 2; i <= nargs; i++)
+		utstring_printf(cmd, " %s", lua_tostring(L, i));
+	lua_pushlstring(L, utstring_body(cmd), utstring_len(cmd));
+	utstring_free(cmd);
+
+	return 1;
 }
 
-void
-yamfile(struct graph *g, const char *root)
+static int
+l_subdir(lua_State *L)
 {
-	struct subdir *s;
+	char buf[PATH_MAX];
+	const char *path;
+	struct context *ctx = get_context(L);
 
-	/* init globals */
-	_g = g;
-	_rootlen = strlen(root);
+	if(lua_gettop(L) != 1)
+		luaL_error(L, "subdir: incorrect number of arguments");
+
+	luaL_checktype(L, 1, LUA_TSTRING);
+	path = get_path(L, ctx->dir, lua_tostring(L, 1), buf);
+	if (!in_scope(ctx->dir, path))
+		luaL_error(L, "subdir: %s is not below %s", path, ctx->dir);
 
-	s = new_subdir(".");
-	DL_APPEND(_g->to_visit, s);
+	fragment_subdir(ctx->fragment, path);
 
-	while(_g->to_visit != NULL) {
-		s = _g->to_visit;
-		visit_subdir(s, root);
-		DL_DELETE(_g->to_visit, s);
-		DL_APPEND(_g->subdirs, s);
-	}
+	return 0;
+}
+
+/*
+ * Wrappers of the functions reading files or the environment, so we know
+ * when the Yamfile has to be evaluated again. Relative paths are made
+ * relative to the root, as the Yamfile is not evaluated from its directory.
+ * The original function is the first upvalue.
+ */
+static int
+call_orig(lua_State *L)
+{
+	int top = lua_gettop(L);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, top, LUA_MULTRET);
+
+	return lua_gettop(L);
+}
+
+/*
+ * Replace the path at `idx' by the one relative to the root, and return it.
+ */
+static const char *
+fix_path(lua_State *L, int idx)
+{
+	char buf[PATH_MAX];
+	struct context *ctx = get_context(L);
+	const char *path;
+
+	path = subdir_path(ctx->dir, lua_tostring(L, idx), buf);
+	lua_pushstring(L, path);
+	lua_replace(L, idx);
+
+	return lua_tostring(L, idx);
+}
+
+static int
+l_open(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+	const char *mode = luaL_optstring(L, 2, "r");
+	const char *path;
+
+	luaL_checkstring(L, 1);
+	path = fix_path(L, 1);
+	if (mode[0] == 'r')
+		fragment_input(ctx->fragment, path);
+
+	return call_orig(L);
+}
+
+/* io.lines(), dofile() and loadfile() */
+static int
+l_read_file(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+
+	if (lua_type(L, 1) == LUA_TSTRING)
+		fragment_input(ctx->fragment, fix_path(L, 1));
+
+	return call_orig(L);
+}
+
+/* Run commands from the subdir, io.popen() and os.execute() */
+static int
+l_run(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+	luaL_Buffer b;
+	const char *p;
+
+	/* What the command reads is not known */
+	ctx->fragment->uncached = true;
+
+	if (lua_type(L, 1) != LUA_TSTRING || strcmp(ctx->dir, ".") == 0)
+		return call_orig(L);
+
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "cd '");
+	for (p = ctx->dir; *p != '\0'; p++) {
+		if (*p == '\'')
+			luaL_addstring(&b, "'\\''");
+		else
+			luaL_addchar(&b, *p);
+	}
+	luaL_addstring(&b, "' && ");
+	luaL_addstring(&b, lua_tostring(L, 1));
+	luaL_pushresult(&b);
+	lua_replace(L, 1);
+
+	return call_orig(L);
+}
+
+/*
+ * Add to `to' the inputs of `from' from the index `first', the files and
+ * environment variables the result of the evaluation depends on.
+ */
+static void
+copy_inputs(struct fragment *to, const struct fragment *from, size_t first)
+{
+	const struct finput *in;
+	size_t i;
+
+	if (from->uncached)
+		to->uncached = true;
+
+	for (i = first; i < from->ninputs; i++) {
+		in = &from->inputs[i];
+		if (in->env)
+			fragment_env(to, in->name, in->value);
+		else
+			fragment_stamp(to, in->name, &in->stamp);
+	}
+}
+
+static bool
+is_loaded(lua_State *L, const char *name)
+{
+	bool loaded;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_getfield(L, -1, name);
+	loaded = !lua_isnil(L, -1);
+	lua_pop(L, 3);
+
+	return loaded;
+}
+
+/*
+ * Find the file of the module `module' in package.path, as require() does.
+ */
+static bool
+find_module(lua_State *L, const char *module, char *path, size_t size)
+{
+	char name[PATH_MAX];
+	const char *templates;
+	const char *end;
+	size_t i, j, len;
+	bool found = false;
+
+	snprintf(name, sizeof(name), "%s", module);
+	for (i = 0; name[i] != '\0'; i++)
+		if (name[i] == '.')
+			name[i] = '/';
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "path");
+	templates = lua_tostring(L, -1);
+
+	while (templates != NULL && templates[0] != '\0') {
+		if ((end = strchr(templates, ';')) == NULL)
+			end = templates + strlen(templates);
+
+		for (i = 0, j = 0; templates + i < end && j < size - 1; i++) {
+			if (templates[i] == '?') {
+				len = snprintf(path + j, size - j, "%s", name);
+				j = MIN(j + len, size - 1);
+			} else
+				path[j++] = templates[i];
+		}
+		path[j] = '\0';
+
+		if (j > 0 && access(path, R_OK) == 0) {
+			found = true;
+			break;
+		}
+		templates = end[0] == ';' ? end + 1 : end;
+	}
+	lua_pop(L, 2);
+
+	return found;
+}
+
+/*
+ * Record the file of the module, as found in package.path.
+ * The lua_State is used for many subdirs: a module is only loaded once, and
+ * what it reads is an input of all the subdirs. A module found relative to
+ * the subdir is only known by its name during its evaluation, another
+ * subdir may find another file.
+ */
+static int
+l_require(lua_State *L)
+{
+	char module[PATH_MAX];
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	struct context *ctx = get_context(L);
+	size_t first = ctx->fragment->ninputs;
+	bool uncached = ctx->fragment->uncached;
+	bool relative = false;
+	bool loaded;
+	int nret;
+
+	snprintf(module, sizeof(module), "%s", luaL_checkstring(L, 1));
+	if (find_module(L, module, path, sizeof(path))) {
+		fragment_input(ctx->fragment, path);
+		relative = path[0] != '/';
+	}
+
+	/* The module may be already loaded by another subdir finding it */
+	if (relative) {
+		if (realpath(path, real) == NULL)
+			snprintf(real, sizeof(real), "%s", path);
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "loaded");
+		lua_getfield(L, LUA_REGISTRYINDEX, MODULES_KEY);
+		lua_getfield(L, -1, real);
+		if (!lua_isnil(L, -1))
+			lua_setfield(L, -3, module);
+		else
+			lua_pop(L, 1);
+		lua_pop(L, 3);
+
+		lua_getfield(L, LUA_REGISTRYINDEX, RELATIVE_KEY);
+		lua_pushstring(L, module);
+		lua_rawseti(L, -2, luaL_getn(L, -2) + 1);
+		lua_pop(L, 1);
+	}
+
+	loaded = is_loaded(L, module);
+	/* Only whether the module ran commands is shared */
+	ctx->fragment->uncached = false;
+	nret = call_orig(L);
+
+	if (!loaded) {
+		if (relative) {
+			lua_getglobal(L, "package");
+			lua_getfield(L, -1, "loaded");
+			lua_getfield(L, LUA_REGISTRYINDEX, MODULES_KEY);
+			lua_getfield(L, -2, module);
+			lua_setfield(L, -2, real);
+			lua_pop(L, 3);
+		}
+		copy_inputs(ctx->shared, ctx->fragment, first);
+	}
+	if (uncached)
+		ctx->fragment->uncached = true;
+
+	return nret;
+}
+
+static int
+l_getenv(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+	const char *name = luaL_checkstring(L, 1);
+
+	fragment_env(ctx->fragment, name, getenv(name));
+
+	return call_orig(L);
+}
+
+/*
+ * yam.shell(cmd [, envs]): run `cmd' from the subdir, and return its output
+ * without the last newline and its exit status. The output is reused, even
+ * by the next builds, until the command, the environment variables named
+ * in the table `envs' or the files it read change.
+ */
+static int
+l_shell(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+	const char **envs = NULL;
+	const char *cmd;
+	UT_string *out;
+	size_t len;
+	int nenvs = 0;
+	int i;
+	int status;
+
+	cmd = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		nenvs = luaL_getn(L, 2);
+	}
+
+	if (nenvs > 0 && (envs = calloc(nenvs, sizeof(char *))) == NULL)
+		die("calloc()");
+	for (i = 0; i < nenvs; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		/* The string is kept alive by the table */
+		envs[i] = lua_tostring(L, -1);
+		lua_pop(L, 1);
+		if (envs[i] == NULL) {
+			free(envs);
+			return luaL_error(L, "yam.shell: the table shall only contain"
+							  " strings");
+		}
+	}
+
+	utstring_new(out);
+	status = shell_run(ctx->dir, cmd, envs, nenvs, ctx->fragment, out);
+	free(envs);
+	if (status < 0) {
+		utstring_free(out);
+		return luaL_error(L, "yam.shell: %s did not exit", cmd);
+	}
+
+	len = utstring_len(out);
+	if (len > 0 && utstring_body(out)[len - 1] == '\n')
+		len--;
+	lua_pushlstring(L, utstring_body(out), len);
+	lua_pushinteger(L, status);
+	utstring_free(out);
+
+	return 2;
+}
+
+/*
+ * Return the path of `path', relative to the subdir, relative to the root,
+ * and record it as an input with its stamp.
+ */
+static const char *
+stat_input(lua_State *L, struct stamp *stamp, char *buf)
+{
+	struct context *ctx = get_context(L);
+	const char *path;
+
+	path = subdir_path(ctx->dir, luaL_checkstring(L, 1), buf);
+	stat_cached(path, stamp);
+	fragment_stamp(ctx->fragment, path, stamp);
+
+	return path;
+}
+
+/* yam.exists(path) */
+static int
+l_exists(lua_State *L)
+{
+	char buf[PATH_MAX];
+	struct stamp stamp;
+
+	stat_input(L, &stamp, buf);
+	lua_pushboolean(L, stamp.mtime != -1);
+
+	return 1;
+}
+
+/* yam.mtime(path): in seconds, nil if it does not exist */
+static int
+l_mtime(lua_State *L)
+{
+	char buf[PATH_MAX];
+	struct stamp stamp;
+
+	stat_input(L, &stamp, buf);
+	if (stamp.mtime == -1)
+		lua_pushnil(L);
+	else
+		lua_pushnumber(L, (lua_Number)stamp.mtime / 1000000000);
+
+	return 1;
+}
+
+static void
+join_path(char *buf, const char *dir, const char *name, size_t len)
+{
+	if (dir[0] == '\0' || strcmp(dir, ".") == 0)
+		snprintf(buf, PATH_MAX, "%.*s", (int)len, name);
+	else if (dir[strlen(dir) - 1] == '/')
+		snprintf(buf, PATH_MAX, "%s%.*s", dir, (int)len, name);
+	else
+		snprintf(buf, PATH_MAX, "%s/%.*s", dir, (int)len, name);
+}
+
+/*
+ * Match `pattern' from the directory `real', relative to the root, which is
+ * `shown' in the Yamfile, and append the matches to the table at the top
+ * of the stack. The directories listed and the files looked for are
+ * recorded as inputs, so adding a file evaluates the Yamfile again.
+ */
+static void
+glob_walk(lua_State *L, struct fragment *f, const char *real,
+		  const char *shown, const char *pattern)
+{
+	char real2[PATH_MAX];
+	char shown2[PATH_MAX];
+	char comp[PATH_MAX];
+	struct stamp stamp;
+	const char *rest;
+	char **names;
+	size_t len;
+	size_t n, i;
+
+	while (pattern[0] == '/')
+		pattern++;
+	if ((rest = strchr(pattern, '/')) == NULL)
+		rest = pattern + strlen(pattern);
+	len = rest - pattern;
+	while (rest[0] == '/')
+		rest++;
+
+	if (strcspn(pattern, "*?[") >= len) {
+		join_path(real2, real, pattern, len);
+		join_path(shown2, shown, pattern, len);
+		if (rest[0] != '\0') {
+			glob_walk(L, f, real2, shown2, rest);
+			return;
+		}
+		stat_cached(real2, &stamp);
+		fragment_stamp(f, real2, &stamp);
+		if (stamp.mtime != -1) {
+			lua_pushstring(L, shown2);
+			lua_rawseti(L, -2, luaL_getn(L, -1) + 1);
+		}
+		return;
+	}
+
+	snprintf(comp, sizeof(comp), "%.*s", (int)len, pattern);
+	names = stat_list(real[0] != '\0' ? real : ".", &n, &stamp);
+	fragment_stamp(f, real[0] != '\0' ? real : ".", &stamp);
+
+	for (i = 0; i < n; i++) {
+		if (fnmatch(comp, names[i], FNM_PERIOD) != 0)
+			continue;
+		join_path(real2, real, names[i], strlen(names[i]));
+		join_path(shown2, shown, names[i], strlen(names[i]));
+		if (rest[0] != '\0')
+			glob_walk(L, f, real2, shown2, rest);
+		else {
+			lua_pushstring(L, shown2);
+			lua_rawseti(L, -2, luaL_getn(L, -1) + 1);
+		}
+	}
+}
+
+/*
+ * yam.glob(pattern): the sorted paths matching `pattern', relative to the
+ * subdir, as with glob(3).
+ */
+static int
+l_glob(lua_State *L)
+{
+	struct context *ctx = get_context(L);
+	const char *pattern = luaL_checkstring(L, 1);
+
+	lua_newtable(L);
+	if (pattern[0] == '/')
+		glob_walk(L, ctx->fragment, "/", "/", pattern);
+	else
+		glob_walk(L, ctx->fragment, ctx->dir, "", pattern);
+
+	return 1;
+}
+
+static void
+wrap(lua_State *L, const char *table, const char *name, lua_CFunction f)
+{
+	if (table != NULL) {
+		lua_getglobal(L, table);
+		lua_getfield(L, -1, name);
+		lua_pushcclosure(L, f, 1);
+		lua_setfield(L, -2, name);
+		lua_pop(L, 1);
+	} else {
+		lua_getglobal(L, name);
+		lua_pushcclosure(L, f, 1);
+		lua_setglobal(L, name);
+	}
+}
+
+/*
+ * Make the relative templates of package.path or package.cpath, saved in
+ * the registry at `key', relative to the subdir.
+ */
+static void
+fix_package_path(lua_State *L, const char *dir, const char *field,
+				 const char *key)
+{
+	luaL_Buffer b;
+	const char *templates;
+	const char *end;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, LUA_REGISTRYINDEX, key);
+	templates = lua_tostring(L, -1);
+
+	luaL_buffinit(L, &b);
+	while (templates != NULL && templates[0] != '\0') {
+		if ((end = strchr(templates, ';')) == NULL)
+			end = templates + strlen(templates);
+		if (templates[0] != '/' && templates != end &&
+			strcmp(dir, ".") != 0) {
+			luaL_addstring(&b, dir);
+			luaL_addchar(&b, '/');
+		}
+		luaL_addlstring(&b, templates, end - templates + (end[0] == ';'));
+		templates = end[0] == ';' ? end + 1 : end;
+	}
+	luaL_pushresult(&b);
+	lua_setfield(L, -3, field);
+	lua_pop(L, 2);
+}
+
+static int
+chunk_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	UT_string *buf = ud;
+
+	(void)L;
+	utstring_bincpy(buf, p, sz);
+	return 0;
+}
+
+/*
+ * Load the Yamfile at `path' of the subdir `dir', from the bytecode if the
+ * Yamfile did not change since it was compiled.
+ */
+static int
+load_chunk(lua_State *L, const char *dir, const char *path)
+{
+	char chunk[PATH_MAX];
+	char temp[PATH_MAX];
+	char data[8192];
+	char name[PATH_MAX];
+	struct stamp stamp;
+	struct stamp cached;
+	uint32_t version = CHUNK_VERSION;
+	size_t hdr = sizeof(CHUNK_MAGIC) - 1 + sizeof(version) + sizeof(stamp);
+	UT_string *buf;
+	FILE *fp;
+	size_t n;
+	int error;
+
+	stat_cached(path, &stamp);
+	snprintf(chunk, sizeof(chunk), "%s/%s", dir, CHUNK_FILE);
+	snprintf(name, sizeof(name), "@%s", path);
+
+	utstring_new(buf);
+	if ((fp = fopen(chunk, "r")) != NULL) {
+		while ((n = fread(data, 1, sizeof(data), fp)) > 0)
+			utstring_bincpy(buf, data, n);
+		fclose(fp);
+
+		if (utstring_len(buf) > hdr) {
+			memcpy(&version, utstring_body(buf) + sizeof(CHUNK_MAGIC) - 1,
+				   sizeof(version));
+			memcpy(&cached, utstring_body(buf) + hdr - sizeof(cached),
+				   sizeof(cached));
+		}
+		if (utstring_len(buf) > hdr &&
+			memcmp(utstring_body(buf), CHUNK_MAGIC,
+				   sizeof(CHUNK_MAGIC) - 1) == 0 &&
+			version == CHUNK_VERSION && cached.mtime == stamp.mtime &&
+			cached.size == stamp.size) {
+			error = luaL_loadbuffer(L, utstring_body(buf) + hdr,
+									utstring_len(buf) - hdr, name);
+			if (error == 0) {
+				utstring_free(buf);
+				return 0;
+			}
+			/* Compile it again */
+			lua_pop(L, 1);
+		}
+		utstring_clear(buf);
+	}
+
+	if ((error = luaL_loadfile(L, path)) != 0) {
+		utstring_free(buf);
+		return error;
+	}
+
+	version = CHUNK_VERSION;
+	utstring_bincpy(buf, CHUNK_MAGIC, sizeof(CHUNK_MAGIC) - 1);
+	utstring_bincpy(buf, &version, sizeof(version));
+	utstring_bincpy(buf, &stamp, sizeof(stamp));
+	lua_dump(L, chunk_writer, buf);
+
+	snprintf(temp, sizeof(temp), "%s/%s.%ld", dir, CHUNK_FILETEMP,
+			 (long)getpid());
+	pthread_mutex_lock(&_chunk_mtx);
+	if ((fp = fopen(temp, "w")) == NULL)
+		perrorf("fopen(%s)", temp);
+	else {
+		fwrite(utstring_body(buf), 1, utstring_len(buf), fp);
+		if (ferror(fp) != 0 || fclose(fp) != 0) {
+			perrorf("fwrite(%s)", temp);
+			unlink(temp);
+		} else if (rename(temp, chunk) != 0)
+			perrorf("rename(%s, %s)", temp, chunk);
+	}
+	pthread_mutex_unlock(&_chunk_mtx);
+	utstring_free(buf);
+
+	return 0;
+}
+
+/*
+ * Create the lua_State of a thread, used for all the Yamfiles it
+ * evaluates.
+ */
+static lua_State *
+new_state(void)
+{
+	lua_State *L;
+
+	if ((L = luaL_newstate()) == NULL)
+		diex("luaL_newstate()");
+	luaL_openlibs(L);
+
+	lua_register(L, "add_target", l_add_target);
+	lua_register(L, "add_targets", l_add_targets);
+	lua_register(L, "add_rule", l_add_rule);
+	lua_register(L, "add_alias", l_add_alias);
+	lua_register(L, "add_dyndep", l_add_dyndep);
+	lua_register(L, "subdir", l_subdir);
+	lua_newtable(L);
+	lua_pushcfunction(L, l_shell);
+	lua_setfield(L, -2, "shell");
+	lua_pushcfunction(L, l_glob);
+	lua_setfield(L, -2, "glob");
+	lua_pushcfunction(L, l_exists);
+	lua_setfield(L, -2, "exists");
+	lua_pushcfunction(L, l_mtime);
+	lua_setfield(L, -2, "mtime");
+	lua_pushcfunction(L, l_ninja);
+	lua_setfield(L, -2, "ninja");
+	lua_pushcfunction(L, l_builtin);
+	lua_setfield(L, -2, "builtin");
+	lua_setglobal(L, "yam");
+	wrap(L, "io", "open", l_open);
+	wrap(L, "io", "lines", l_read_file);
+	wrap(L, "io", "popen", l_run);
+	wrap(L, "os", "execute", l_run);
+	wrap(L, NULL, "dofile", l_read_file);
+	wrap(L, NULL, "loadfile", l_read_file);
+	wrap(L, NULL, "require", l_require);
+	wrap(L, "os", "getenv", l_getenv);
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "path");
+	lua_setfield(L, LUA_REGISTRYINDEX, PATH_KEY);
+	lua_getfield(L, -1, "cpath");
+	lua_setfield(L, LUA_REGISTRYINDEX, CPATH_KEY);
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, MODULES_KEY);
+
+	return L;
+}
+
+/*
+ * Forget the names of the modules found relative to the subdir, another
+ * subdir may find other files. The modules themselves are kept.
+ */
+static void
+forget_modules(lua_State *L)
+{
+	int i, n;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_getfield(L, LUA_REGISTRYINDEX, RELATIVE_KEY);
+	n = luaL_getn(L, -1);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, -1, i);
+		lua_pushnil(L);
+		lua_settable(L, -4);
+	}
+	lua_pop(L, 3);
+}
+
+/*
+ * Return the error raised by `func', at the top of the stack of `L', which
+ * is left ready for another Yamfile.
+ */
+static char *
+eval_error(lua_State *L, const char *func)
+{
+	char buf[PATH_MAX + 256];
+	const char *msg;
+	char *error;
+
+	if ((msg = lua_tostring(L, -1)) == NULL)
+		msg = "error object is not a string";
+	snprintf(buf, sizeof(buf), "%s: %s", func, msg);
+	if ((error = strdup(buf)) == NULL)
+		die("strdup()");
+
+	forget_modules(L);
+	lua_settop(L, 0);
+
+	return error;
+}
+
+/*
+ * Evaluate the Yamfile of `v' in `L', with its own table of globals.
+ * Return the error, NULL if none.
+ */
+static char *
+eval_subdir(lua_State *L, struct fragment *shared, struct visit *v)
+{
+	char buf[PATH_MAX];
+	char out[PATH_MAX];
+	struct context ctx;
+	const char *path;
+
+	ctx.dir = v->subdir->src;
+	ctx.out = v->subdir->path;
+	ctx.fragment = &v->fragment;
+	ctx.shared = shared;
+
+	path = subdir_path(ctx.dir, "Yamfile", buf);
+	fragment_input(ctx.fragment, path);
+
+	lua_pushlightuserdata(L, &ctx);
+	lua_setfield(L, LUA_REGISTRYINDEX, CONTEXT_KEY);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, RELATIVE_KEY);
+	fix_package_path(L, ctx.dir, "path", PATH_KEY);
+	fix_package_path(L, ctx.dir, "cpath", CPATH_KEY);
+
+	if (load_chunk(L, ctx.dir, path) != 0)
+		return eval_error(L, "luaL_loadfile()");
+
+	/* The globals it sets are its own, it reads the others from _G */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	if (v->variant != NULL) {
+		lua_pushstring(L, v->variant);
+		lua_setfield(L, -2, "VARIANT");
+	}
+	lua_pushstring(L, out_path(ctx.dir, ctx.out, out));
+	lua_setfield(L, -2, "OUT");
+	lua_setfenv(L, -2);
+
+	if (lua_pcall(L, 0, 0, 0) != 0)
+		return eval_error(L, "lua_pcall()");
+
+	forget_modules(L);
+	copy_inputs(ctx.fragment, shared, 0);
+	lua_settop(L, 0);
+
+	return NULL;
+}
+
+/*
+ * Evaluate the Yamfile of `v', by a thread of the pool. An error is left in
+ * the visit for the main thread, as jobs may be running.
+ */
+static void
+visit_subdir(lua_State **L, struct fragment *shared, struct visit *v)
+{
+	char err[PATH_MAX + 64];
+
+	/* Evaluate the Yamfile only if something it read changed */
+	if (flags.reload == 1 || cache_load(v->subdir->path, &v->fragment) != 0) {
+		fragment_init(&v->fragment);
+		if (v->variant != NULL &&
+			make_dirs(v->subdir->path, err, sizeof(err)) != 0) {
+			if ((v->error = strdup(err)) == NULL)
+				die("strdup()");
+			return;
+		}
+		if (*L == NULL)
+			*L = new_state();
+		if ((v->error = eval_subdir(*L, shared, v)) == NULL)
+			cache_save(v->subdir->path, &v->fragment);
+	}
+}
+
+/*
+ * The visit of the subdir `src' in `variant', NULL if none.
+ */
+static struct visit *
+new_visit(const char *src, const char *variant)
+{
+	char buf[PATH_MAX];
+	struct visit *v;
+
+	if ((v = calloc(1, sizeof(struct visit))) == NULL)
+		die("calloc()");
+	v->variant = variant;
+	if (variant == NULL)
+		v->subdir = new_subdir(src, src);
+	else if (strcmp(src, ".") == 0)
+		v->subdir = new_subdir(variant, src);
+	else {
+		snprintf(buf, sizeof(buf), "%s/%s", variant, src);
+		v->subdir = new_subdir(buf, src);
+	}
+
+	return v;
+}
+
+static void *
+worker(void *arg)
+{
+	struct pool *pool = arg;
+	struct fragment shared;
+	lua_State *L = NULL;
+	struct visit *v;
+	size_t i;
+
+	fragment_init(&shared);
+
+	pthread_mutex_lock(&pool->mtx);
+	for (;;) {
+		while (pool->queue == NULL && !pool->quit)
+			pthread_cond_wait(&pool->work, &pool->mtx);
+		if (pool->queue == NULL)
+			break;
+
+		v = pool->queue;
+		LL_DELETE(pool->queue, v);
+		pthread_mutex_unlock(&pool->mtx);
+
+		visit_subdir(&L, &shared, v);
+
+		/* The subdirs of a Yamfile which failed are left out */
+		if (v->error == NULL && v->fragment.nsubdirs > 0) {
+			if ((v->children = calloc(v->fragment.nsubdirs,
+									  sizeof(struct visit *))) == NULL)
+				die("calloc()");
+			for (i = 0; i < v->fragment.nsubdirs; i++)
+				v->children[i] = new_visit(v->fragment.subdirs[i],
+										   v->variant);
+			v->nchildren = v->fragment.nsubdirs;
+		}
+
+		pthread_mutex_lock(&pool->mtx);
+		LL_APPEND(pool->evaluated, v);
+		pthread_cond_broadcast(&pool->done);
+
+		/* Nobody may be reading, do not block if the pipe is full */
+		(void)write(pool->notify, "", 1);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+
+	if (L != NULL)
+		lua_close(L);
+	fragment_free(&shared);
+
+	return NULL;
+}
+
+/*
+ * Add what the Yamfile declared to the graph. Return -1 if a job conflicts
+ * with another one, it is left out.
+ */
+static int
+merge_fragment(struct subdir *s, const struct fragment *f)
+{
+	const struct ftarget *t;
+	struct node *n;
+	struct dep *dep;
+	size_t i, j;
+	int error = 0;
+
+	for (i = 0; i < f->npools; i++)
+		graph_pool(_g, f->pools[i].name)->depth = f->pools[i].depth;
+
+	for (i = 0; i < f->ntargets; i++) {
+		t = &f->targets[i];
+		n = graph_get(_g, t->name, true);
+		if (n->type == NODE_OUTPUT) {
+			fprintf(stderr, "%s is an output of two jobs\n", n->name);
+			error = -1;
+			continue;
+		}
+
+		free(n->cmd);
+		n->cmd = fragment_cmd(f, t, s->src);
+		n->type = NODE_JOB;
+		n->phony = t->rule == FRAGMENT_ALIAS;
+		n->cwd = s->src;
+		free(n->depfile);
+		n->depfile = t->depfile != NULL ? strdup(t->depfile) : NULL;
+		n->pool = t->pool != NULL ? graph_pool(_g, t->pool) : NULL;
+		n->batch = t->batch;
+		n->trace = t->trace;
+		free(n->worker);
+		n->worker = t->worker != NULL ? strdup(t->worker) : NULL;
+		free(n->rspfile);
+		free(n->rspcontent);
+		n->rspfile = t->rspfile != NULL ? strdup(t->rspfile) : NULL;
+		n->rspcontent = t->rspcontent != NULL ? strdup(t->rspcontent) : NULL;
+		n->subdir = s;
+		nodes_add(&s->jobs, n);
+		for (j = 0; j < t->noutputs; j++)
+			if (graph_add_output(_g, n, t->outputs[j]) != 0)
+				error = -1;
+
+		/* Do not stat(2) again the sources stat'ed by the Yamfiles */
+		for (j = 0; j < t->ndeps; j++) {
+			dep = graph_add_dep(_g, n, t->deps[j], NODE_DEP_EXPLICIT);
+			if (dep != NULL && dep->node->type != NODE_JOB &&
+				dep->node->stamp.mtime == 0)
+				stat_lookup(dep->node->name, &dep->node->stamp);
+		}
+		for (j = 0; j < t->norder; j++) {
+			if ((dep = graph_add_dep(_g, n, t->order[j],
+									 NODE_DEP_EXPLICIT)) != NULL)
+				dep->order = 1;
+		}
+
+		/* The dyndep file is built first */
+		if (t->dyndep != NULL) {
+			n->dyndep = graph_get(_g, t->dyndep, true);
+			if ((dep = graph_add_dep(_g, n, t->dyndep,
+									 NODE_DEP_EXPLICIT)) != NULL)
+				dep->order = 1;
+		}
+	}
+
+	return error;
+}
+
+static void
+queue_visit(struct eval *e, struct visit *v)
+{
+	if (v->queued || e->stopped)
+		return;
+	v->queued = true;
+	e->running++;
+
+	pthread_mutex_lock(&e->pool.mtx);
+	LL_APPEND(e->pool.queue, v);
+	pthread_cond_signal(&e->pool.work);
+	pthread_mutex_unlock(&e->pool.mtx);
+}
+
+/*
+ * Whether `path' is at or below one of the wanted paths.
+ */
+static bool
+is_wanted(struct eval *e, const char *path)
+{
+	size_t i, len;
+
+	for (i = 0; i < e->nwanted; i++) {
+		if (strcmp(e->wanted[i], ".") == 0)
+			return true;
+		len = strlen(e->wanted[i]);
+		if (strncmp(path, e->wanted[i], len) == 0 &&
+			(path[len] == '\0' || path[len] == '/'))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add the visit of the root in `variant' and start evaluating it.
+ */
+static void
+visit_root(struct eval *e, const char *variant)
+{
+	struct visit *v;
+
+	v = new_visit(".", variant);
+	HASH_ADD_KEYPTR(hh, e->visits, v->subdir->path, strlen(v->subdir->path),
+					v);
+	queue_visit(e, v);
+}
+
+/*
+ * Start evaluating the Yamfiles, from the one of the root.
+ */
+struct eval *
+yamfile_start(struct graph *g, const char *root)
+{
+	struct eval *e;
+	long t;
+	int i;
+
+	/* init globals */
+	_g = g;
+	_root = root;
+	_rootlen = strlen(root);
+
+	if ((e = calloc(1, sizeof(struct eval))) == NULL)
+		die("calloc()");
+
+	if (flags.reload != 1)
+		shell_load();
+
+	if (pipe(e->pipe) != 0)
+		die("pipe()");
+	if (fcntl(e->pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+		fcntl(e->pipe[1], F_SETFL, O_NONBLOCK) != 0)
+		die("fcntl()");
+
+	/* Evaluation does not use much more than the CPU, unlike the jobs */
+	if ((e->nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		e->nthreads = 1;
+
+	pthread_mutex_init(&e->pool.mtx, NULL);
+	pthread_cond_init(&e->pool.work, NULL);
+	pthread_cond_init(&e->pool.done, NULL);
+	e->pool.notify = e->pipe[1];
+
+	if ((e->threads = calloc(e->nthreads, sizeof(pthread_t))) == NULL)
+		die("calloc()");
+	for (t = 0; t < e->nthreads; t++)
+		if (pthread_create(&e->threads[t], NULL, worker, &e->pool) != 0)
+			die("pthread_create()");
+
+	/* The root is always needed, it may declare anything */
+	if (flags.nvariants == 0)
+		visit_root(e, NULL);
+	for (i = 0; i < flags.nvariants; i++)
+		visit_root(e, flags.variants[i]);
+
+	return e;
+}
+
+/*
+ * Evaluate the subdirs at or below `path'.
+ */
+void
+yamfile_want(struct eval *e, const char *path)
+{
+	struct visit *v, *tmp;
+
+	if (e->nwanted == e->capwanted) {
+		e->capwanted = e->capwanted == 0 ? 4 : e->capwanted * 2;
+		if ((e->wanted = realloc(e->wanted,
+								 e->capwanted * sizeof(char *))) == NULL)
+			die("realloc()");
+	}
+	if ((e->wanted[e->nwanted++] = strdup(path)) == NULL)
+		die("strdup()");
+
+	HASH_ITER(hh, e->visits, v, tmp) {
+		if (!v->merged && is_wanted(e, v->subdir->path))
+			queue_visit(e, v);
+	}
+}
+
+/*
+ * Evaluate `sd', declared by a subdir already merged, even if it is not
+ * wanted.
+ */
+void
+yamfile_eval(struct eval *e, struct subdir *sd)
+{
+	struct visit *v;
+
+	HASH_FIND_STR(e->visits, sd->path, v);
+	if (v != NULL && !v->merged)
+		queue_visit(e, v);
+}
+
+/*
+ * Readable when a Yamfile has been evaluated, and yamfile_next() may return
+ * a subdir.
+ */
+int
+yamfile_fd(struct eval *e)
+{
+	return e->pipe[0];
+}
+
+/*
+ * Merge a subdir which is evaluated in the graph, and return it.
+ * Return NULL if nothing is being evaluated, or if nothing is evaluated yet
+ * and `wait' is false.
+ * The errors of the Yamfiles which failed are printed, and counted for
+ * yamfile_errors(). They are not merged, so what they may declare is never
+ * complete.
+ */
+struct subdir *
+yamfile_next(struct eval *e, bool wait)
+{
+	struct visit *v;
+	struct visit *child;
+	struct visit *found;
+	struct subdir *sd;
+	char c;
+	size_t i;
+
+	for (;;) {
+		if (e->running == 0)
+			return NULL;
+
+		/* Drain the notifications, we are about to look at the visits */
+		while (read(e->pipe[0], &c, 1) == 1)
+			continue;
+
+		pthread_mutex_lock(&e->pool.mtx);
+		if (e->pool.evaluated == NULL && !wait) {
+			pthread_mutex_unlock(&e->pool.mtx);
+			return NULL;
+		}
+		while (e->pool.evaluated == NULL)
+			pthread_cond_wait(&e->pool.done, &e->pool.mtx);
+		v = e->pool.evaluated;
+		LL_DELETE(e->pool.evaluated, v);
+		pthread_mutex_unlock(&e->pool.mtx);
+
+		e->running--;
+		if (v->error == NULL)
+			break;
+
+		fprintf(stderr, "%s\n", v->error);
+		free(v->error);
+		v->error = NULL;
+		fragment_free(&v->fragment);
+		e->errors++;
+	}
+	v->merged = true;
+
+	sd = v->subdir;
+	if (merge_fragment(sd, &v->fragment) != 0)
+		e->errors++;
+	DL_APPEND(_g->subdirs, sd);
+
+	/*
+	 * The children are only evaluated when needed, and once even if they
+	 * are declared by more than one subdir.
+	 */
+	for (i = 0; i < v->nchildren; i++) {
+		child = v->children[i];
+		HASH_FIND_STR(e->visits, child->subdir->path, found);
+		if (found != NULL) {
+			free(child->subdir);
+			free(child);
+			continue;
+		}
+		HASH_ADD_KEYPTR(hh, e->visits, child->subdir->path,
+						strlen(child->subdir->path), child);
+		if (is_wanted(e, child->subdir->path))
+			queue_visit(e, child);
+	}
+
+	fragment_free(&v->fragment);
+	free(v->children);
+	v->children = NULL;
+	v->nchildren = 0;
+
+	return sd;
+}
+
+/*
+ * Return the deepest subdir above `path' which is not merged yet, as it may
+ * still declare it, or NULL if the node of `path' is complete.
+ */
+struct subdir *
+yamfile_pending(struct eval *e, const char *path)
+{
+	char buf[PATH_MAX];
+	struct visit *v;
+	char *slash;
+
+	if (strcmp(path, ".") == 0)
+		return NULL;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	while ((slash = strrchr(buf, '/')) != NULL) {
+		*slash = '\0';
+		HASH_FIND_STR(e->visits, buf, v);
+		if (v != NULL && !v->merged)
+			return v->subdir;
+	}
+	HASH_FIND_STR(e->visits, ".", v);
+
+	return v != NULL && !v->merged ? v->subdir : NULL;
+}
+
+/*
+ * Whether all the subdirs we need are merged. The others are left out.
+ */
+bool
+yamfile_done(struct eval *e)
+{
+	return e->running == 0;
+}
+
+/*
+ * Return the number of errors found in the Yamfiles since the last call.
+ */
+int
+yamfile_errors(struct eval *e)
+{
+	int errors = e->errors;
+
+	e->errors = 0;
+	return errors;
+}
+
+/*
+ * Do not evaluate any other Yamfile, the build failed. The ones being
+ * evaluated are still merged.
+ */
+void
+yamfile_stop(struct eval *e)
+{
+	e->stopped = true;
+}
+
+/*
+ * Wait for the threads, once all the subdirs we need are merged.
+ */
+void
+yamfile_finish(struct eval *e)
+{
+	struct visit *v, *tmp;
+	size_t i;
+	long t;
+
+	assert(e->running == 0);
+
+	pthread_mutex_lock(&e->pool.mtx);
+	e->pool.quit = true;
+	pthread_cond_broadcast(&e->pool.work);
+	pthread_mutex_unlock(&e->pool.mtx);
+	for (t = 0; t < e->nthreads; t++)
+		pthread_join(e->threads[t], NULL);
+	free(e->threads);
+
+	pthread_mutex_destroy(&e->pool.mtx);
+	pthread_cond_destroy(&e->pool.work);
+	pthread_cond_destroy(&e->pool.done);
+
+	/* The subdirs which were not needed are not in the graph */
+	HASH_ITER(hh, e->visits, v, tmp) {
+		HASH_DEL(e->visits, v);
+		if (!v->merged)
+			free(v->subdir);
+		free(v);
+	}
+
+	for (i = 0; i < e->nwanted; i++)
+		free(e->wanted[i]);
+	free(e->wanted);
+	close(e->pipe[0]);
+	close(e->pipe[1]);
+	free(e);
+
+	shell_save();
+	stat_clear();
+	free_dirs();
+}
+
+/*
+ * Evaluate all the Yamfiles. Return -1 if one of them failed.
+ */
+int
+yamfile(struct graph *g, const char *root)
+{
+	struct eval *e;
+	int errors;
+
+	e = yamfile_start(g, root);
+	yamfile_want(e, ".");
+	while (yamfile_next(e, true) != NULL)
+		continue;
+	errors = yamfile_errors(e);
+	yamfile_finish(e);
+
+	return errors > 0 ? -1 : 0;
 }